@@ -8,5 +8,12 @@
 
 #define FATABLE_FILENAME "fatable.naivedisk"
 #define BLOCKFILE_FILENAME "blockfile.naivedisk"
+#define BLOCKMAP_FILENAME "blockmap.naivedisk"
+#define TIER_FILENAME "blockfile.naivedisk.fast"
+#define TIERMAP_FILENAME "tiermap.naivedisk"
+#define INODE_FILENAME "inode.naivedisk"
+#define SNAPSHOT_FILENAME_PREFIX "snapshot-"
+#define SNAPSHOT_FILENAME_SUFFIX ".naivedisk"
+#define SNAPSHOT_INODE_SUFFIX ".inode"
 
 #endif
\ No newline at end of file
@@ -7,25 +7,130 @@
 
 typedef uint32_t block_size_t;
 typedef uint32_t blockid_data_t;
-#define BLOCK_COUNT_MAX UINT32_MAX
+/*
+    the highest bit of a fatable entry marks the block as unwritten:
+    it holds no data, reads return zeros without touching the blockfile
+*/
+#define FAT_UNWRITTEN_FLAG 0x80000000u
+#define FAT_NEXT_MASK 0x7fffffffu
+#define BLOCK_COUNT_MAX FAT_NEXT_MASK
+#define BLOCK_ID_NONE BLOCK_COUNT_MAX
+#define SLOT_NONE BLOCK_ID_NONE
 
 struct fatable_metadata {
     block_size_t block_num;
     block_size_t free_block_num;
     blockid_data_t first_free_block_id;
+    block_size_t block_size;// bytes per block, chosen when the volume is created
+    block_size_t stripe_count;// backing files the blocks are striped across
+    block_size_t stripe_unit;// consecutive slots stored in one backing file before the next one
 };
 
-#define BLOCK_SIZE 4096
+/*
+    the block size of the loaded volume, a power of two between MIN_BLOCK_SIZE and MAX_BLOCK_SIZE
+    a new volume takes format_block_size, volumes made before it was configurable have 4096 byte blocks
+    the fatable and the inode table are written META_PAGE_SIZE bytes at a time whatever the block size
+*/
+#define BLOCK_SIZE volume_block_size
+#define DEFAULT_BLOCK_SIZE 4096
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (1 << 20)
+#define BLOCK_BUF_DEPTH 4// block buffers a thread keeps for nested take_block_buf() calls
+#define META_PAGE_SIZE 4096
 #define INIT_BLOCK_NUM 1024
 #define MAGNIFICATION 1.5
+#define FAT_SEGMENT_BLOCKS (1 << 20)// entries the fatable is made usable by at a time, and grown by at most
+#define MAX_GROW_FACTOR 4.0
+#define DISCARD_BATCH_RANGES 64// ranges claimed per hold of the fatable lock, then punched without it
+#define IO_RUN_BLOCKS 256// blocks looked up per hold of the fatable lock in read_blocks() and write_blocks()
+/*
+    the slots of a volume are striped round-robin across stripe_count backing files, stripe_unit slots at a time:
+    stripe 0 is the blockfile itself, stripe i the file named after it with ".i" appended,
+    which may be a symlink to a file on another disk
+    read_blocks() and write_blocks() hand the stripes of a large request to one thread each
+    a volume made before striping has a single stripe, the blockfile
+*/
+#define MAX_STRIPE_COUNT 16
+#define DEFAULT_STRIPE_UNIT (64 << 10)
+
+/*
+    when the space of freed blocks is punched out of the blockfile
+*/
+enum discard_policy {
+    DISCARD_OFF,
+    DISCARD_PERIODIC,// every few seconds
+    DISCARD_IMMEDIATE,// as soon as blocks are freed
+};
 
 extern bool need_init_rootdir;
+extern int volume_block_size;
+/*
+    block size of a volume created by init_block_module(), see block_size_valid()
+*/
+extern int format_block_size;
+/*
+    stripes of the loaded volume and slots per stripe unit
+*/
+extern int volume_stripe_count;
+extern int volume_stripe_unit;
+/*
+    stripes of a volume created by init_block_module() and bytes per stripe unit, see stripe_layout_valid()
+    a stripe unit smaller than a block is one block
+*/
+extern int format_stripe_count;
+extern int format_stripe_unit;
+/*
+    bytes of a volume created by init_block_module(), its blocks are in the fatable
+    and fallocated in the blockfile from the start, 0 for INIT_BLOCK_NUM blocks grown on demand
+*/
+extern size_t format_volume_size;
+/*
+    the fatable grows by grow_factor (MAGNIFICATION by default), see grow_policy_valid()
+    with grow_chunk set, the blockfile is fallocated grow_chunk bytes at a time to cover the blocks of the fatable
+    as it grows, so that the host file system lays it out in large extents; 0 leaves it to grow by writes
+*/
+extern double grow_factor;
+extern size_t grow_chunk;
+/*
+    set when a snapshot is loaded, nothing is written back
+*/
+extern bool volume_readonly;
+
+/*
+    whether a volume can have blocks of this size
+*/
+static inline bool block_size_valid(size_t size)
+{
+    return size >= MIN_BLOCK_SIZE && size <= MAX_BLOCK_SIZE && (size & (size - 1)) == 0;
+}
+
+/*
+    whether a volume can be striped this way
+*/
+static inline bool stripe_layout_valid(size_t count, size_t unit)
+{
+    return count >= 1 && count <= MAX_STRIPE_COUNT && unit >= MIN_BLOCK_SIZE && unit <= (1 << 30)
+        && (unit & (unit - 1)) == 0;
+}
+
+/*
+    whether the fatable can grow this way, a chunk of 0 fallocates nothing
+*/
+static inline bool grow_policy_valid(double factor, size_t chunk)
+{
+    return factor > 1.0 && factor <= MAX_GROW_FACTOR && chunk <= ((size_t) 1 << 40);
+}
 
 /*
     initial this module
 */
 void init_block_module(void);
 
+/*
+    initial this module read-only from a snapshot file instead of the fatable
+*/
+void init_snapshot_block_module(const char *path);
+
 /*
     get used block number
 */
@@ -34,6 +139,7 @@ block_size_t get_used_block_num(void);
 /*
     open and load the fatable in the given path
     if doesn't exist, create it
+    the process exits if another one has the fatable loaded
 */
 void load_fatable(const char *path);
 
@@ -43,10 +149,25 @@ void load_fatable(const char *path);
 void create_fatable(const char *path);
 
 /*
-    write current fatable to disk
+    whether another process has loaded the fatable of the volume in the working dir
+*/
+bool volume_in_use(void);
+
+/*
+    write current fatable to disk, only the pages changed since the last call
 */
 void sync_fatable(void);
 
+/*
+    wait until the fatable written by sync_fatable() is durable
+*/
+void flush_fatable(void);
+
+/*
+    wait until every written block is durable, the blocks cached by writeback are written first
+*/
+void flush_blockfile(void);
+
 /*
     get next n block's id
     if the block is not enough, return the same value as id
@@ -60,6 +181,23 @@ block_size_t get_n_next_block_id(block_size_t id, size_t n);
 */
 block_size_t acquire_block_chain(block_size_t size);
 
+/*
+    grow the fatable once so that `size` more blocks can be acquired without growing it again,
+    for bulk loading; the new blocks are handed out in the order of their ids
+*/
+void presize_fatable(block_size_t size);
+
+/*
+    acquire a block chain whose block ids are consecutive
+    every block of it is unwritten
+*/
+block_size_t acquire_contiguous_block_chain(block_size_t size);
+
+/*
+    release a block chain to the free block chain
+*/
+void release_block_chain(block_size_t head);
+
 /*
     cut the block chain into two parts, and release the second part
     n is the block count of the first chain
@@ -72,26 +210,202 @@ void cut_block_chain_at(block_size_t head, size_t n);
 void merge_block_chain(block_size_t head1, block_size_t head2);
 
 /*
-    open the blockfile in the given path
+    mark n blocks of the chain starting from head as unwritten
+    and punch their space out of the blockfile
+*/
+void punch_block_chain(block_size_t head, size_t n);
+
+/*
+    reserve blockfile space for n blocks of the chain starting from head
+    the blocks stay unwritten
+*/
+void reserve_block_chain(block_size_t head, size_t n);
+
+/*
+    start a garbage scan: *reachable is set to a zeroed bitmap of the current blocks
+    blocks acquired before end_block_scan() are never reclaimed by it, the ones acquired before this call
+    should be linked to an opened file by then: they are acquired and linked under the block map,
+    which is waited for, or else a scan is kept off meanwhile, see begin_unlinked_chain() in gc.h
+    returns the number of blocks covered by the bitmap
+*/
+block_size_t begin_block_scan(uint8_t **reachable);
+
+/*
+    mark every block of the chain as reachable, n is the size of the bitmap
+    the walk stops at a marked block, unless through is set: the chain of an opened file
+    may have grown past blocks marked before
+    returns the number of newly marked blocks
+*/
+block_size_t mark_block_chain(block_size_t head, uint8_t *reachable, block_size_t n, bool through);
+
+/*
+    finish a garbage scan: blocks neither reachable, free nor acquired during the scan
+    are released to the free block chain, whose length then becomes the free block count
+    frees the bitmap and returns the number of reclaimed blocks
+*/
+block_size_t end_block_scan(uint8_t *reachable, block_size_t n);
+
+/*
+    count the fatable entries from start to end whose next block id is out of range,
+    the first of them is put in *first_bad
+*/
+block_size_t check_fatable_range(block_size_t start, block_size_t end, block_size_t *first_bad);
+
+/*
+    mark every block of the chain in `owned` like mark_block_chain(), atomically so that
+    several threads may walk chains at once
+    *broken is set if it stops at a block marked already or out of range instead of the tail
+    returns the number of newly marked blocks
+*/
+block_size_t claim_block_chain(block_size_t head, uint8_t *owned, bool *broken);
+
+/*
+    copy the header of the fatable
+*/
+void get_fatable_metadata(struct fatable_metadata *md);
+
+/*
+    hold the block map shared around reading or writing the blocks of a chain,
+    relocation holds it exclusively so that it never moves a block under I/O
+*/
+void lock_block_map(bool exclusive);
+
+void unlock_block_map(void);
+
+/*
+    count the runs of consecutive block ids in a chain, *len is set to its length
+*/
+block_size_t count_chain_runs(block_size_t head, block_size_t *len);
+
+/*
+    move the data of the block after `prev` to `to`, an acquired single block,
+    link `to` in its place and release the old block
+    the chain should be pinned by an opened file and the block map held exclusively
+    returns false if `prev` is the tail
+*/
+bool relocate_next_block(block_size_t prev, block_size_t to);
+
+/*
+    move the blocks at the end of the blockfile into the lowest free blocks
+    and truncate the free tail, the first block of a chain is never moved
+    a run of at most `batch` blocks is copied while the foreground goes on, the block map is only taken
+    to link the copy in, `pause` is called every `batch` blocks
+    the pass stops early once another thread changes the chains or writes to the run, the next one starts over
+    returns the number of moved blocks, *truncated is set to the number of dropped ones
+*/
+block_size_t compact_block_chains(size_t batch, void (*pause)(block_size_t moved), block_size_t *truncated);
+
+/*
+    punch the space of the freed blocks out of the blockfile, consecutive blocks in one range
+    blocks acquired again before it gets to them are skipped
+    returns the number of discarded blocks
+*/
+block_size_t discard_free_blocks(void);
+
+/*
+    start tracking freed blocks and a thread discarding them according to `policy`
+    every block free at this time is discarded first
+    `interval` is in seconds, for DISCARD_PERIODIC
+*/
+void start_discard(enum discard_policy policy, unsigned int interval);
+
+/*
+    check if blocks are stored through the physical map, which is enabled by the first snapshot or reflink
+    and stays on, afterwards a block id no longer tells where the block is in the blockfile
+*/
+bool physical_map_enabled(void);
+
+/*
+    save the fatable and the physical map into a snapshot file,
+    the slots they reference are shared until written (copy on write)
+    returns false if the file can not be written
+*/
+bool save_block_snapshot(const char *path);
+
+/*
+    remove a snapshot file and release the slots only it references
+*/
+bool drop_block_snapshot(const char *path);
+
+/*
+    make n blocks of the chain starting from dst share the slots of the chain starting from src,
+    copy on write as with snapshots, the physical map is enabled by the first call
+    both chains should be at least n blocks long
+*/
+void share_block_chain(block_size_t src, block_size_t dst, size_t n);
+
+/*
+    read a snapshot file, *fat and *map are malloc()ed, fat may be NULL if not needed
+*/
+bool read_snapshot(const char *path, struct fatable_metadata *md, blockid_data_t **fat, block_size_t **map);
+
+/*
+    open the blockfile in the given path and the files of the other stripes
     if doesn't exist, create it
 */
 void open_blockfile(const char *path);
 
 /*
-    create blockfile and write initial data
+    create blockfile and the files of the other stripes, and write initial data
 */
 void create_blockfile(const char *path);
 
+/*
+    unlink the blockfile in the given path and the files of the other stripes of the loaded volume
+*/
+void remove_blockfile(const char *path);
+
+/*
+    a BLOCK_SIZE buffer on the heap, kept by the calling thread for its next call,
+    since a block of up to MAX_BLOCK_SIZE bytes does not belong on the stack
+    nested calls take other buffers, they should be given back in the reverse order by put_block_buf()
+*/
+uint8_t *take_block_buf(void);
+void put_block_buf(uint8_t *buf);
+
 /*
     read a block of data
     assume buf is vaild and has at least BLOCK_SIZE bytes of memory
+    an unwritten block reads as zeros
 */
 void read_block(block_size_t id, uint8_t *buf);
 
 /*
     write a block of data
     assume buf has at least BLOCK_SIZE bytes of data
+    the block is no longer unwritten afterwards
 */
 void write_block(block_size_t id, const uint8_t *buf);
 
+/*
+    read n blocks of a chain starting at `id` into buf, which has n * BLOCK_SIZE bytes,
+    blocks stored one after another in a stripe file are read at once, and the stripes in parallel
+    returns the block after the last one read, the last one itself at the end of the chain
+*/
+block_size_t read_blocks(block_size_t id, size_t n, uint8_t *buf);
+
+/*
+    write n blocks of a chain starting at `id` from buf like read_blocks()
+    the blocks are no longer unwritten afterwards
+    returns the block after the last one written, the last one itself at the end of the chain
+*/
+block_size_t write_blocks(block_size_t id, size_t n, const uint8_t *buf);
+
+/*
+    write the data of a slot, bypassing writeback, for the writeback flusher
+*/
+void write_slot(block_size_t slot, const uint8_t *buf);
+
+/*
+    read or write a slot at its home in the blockfile, bypassing writeback and the fast tier, for the tier migrator
+    a short read is padded with zeros
+*/
+void read_home_slot(block_size_t slot, uint8_t *buf);
+void write_home_slot(block_size_t slot, const uint8_t *buf);
+
+/*
+    wait until the slots written to the blockfile are durable, without writing back the cached ones
+*/
+void sync_home_slots(void);
+
 #endif
@@ -0,0 +1,60 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdbool.h>
+#include "block.h"
+#include "file.h"
+
+/*
+    consistency check of a volume, before it is served or by naivevfs-fsck:
+    the free block chain should end without running into itself and hold as many blocks as the fatable header says,
+    every file reachable from the root dir should have metadata, a chain of block_count blocks holding
+    its file_size bytes, which ends without running into another chain, and a single dir entry,
+    and every dir should parse
+    blocks neither free nor reachable are leaked, like the ones gc reclaims, and are not errors,
+    even if they are linked into another chain or their fatable entry is out of range
+    the threads check a segment of the fatable (FAT_SEGMENT_BLOCKS entries) at a time, then share the dirs
+    through a stack; the chains are claimed in a bitmap, so that no block is walked twice
+*/
+#define CHECK_MAX_THREADS 64
+#define CHECK_PRINT_MAX 32// problems printed, the others are only counted
+
+struct check_report {
+    block_size_t block_num;
+    block_size_t bad_entries;// fatable entries out of range
+    block_size_t free_blocks;// in the free block chain
+    bool free_chain_broken;// it runs into itself or out of range
+    bool free_count_wrong;// the fatable header counts another number of free blocks
+    file_count_t files;
+    file_count_t dirs;
+    file_count_t bad_files;// without metadata, linked twice, or whose chain is too short or runs into another
+    file_count_t bad_dirs;// which do not parse
+    file_count_t long_chains;// files with more blocks than block_count
+    block_size_t tail_blocks;// blocks of the long chains after block_count, they are leaked
+    block_size_t leaked;// blocks neither free nor reachable, the tails included
+    block_size_t reclaimed;// blocks released by a repair
+};
+
+/*
+    check the loaded volume with `threads` threads, 0 for one per CPU, printing the problems found
+    with repair set and no errors, the leaked blocks are released and the free block count is fixed,
+    then the fatable is synced
+    the inode table should be loaded, and nothing should change the volume meanwhile
+    returns true if there are no errors, leaks aside
+*/
+bool check_volume(unsigned int threads, bool repair, struct check_report *report);
+
+/*
+    print the counts of a report, the problems themselves are printed by check_volume()
+*/
+void print_check_report(const struct check_report *report, FILE *out);
+
+/*
+    whether the report holds anything a repair fixes
+*/
+static inline bool check_found_leaks(const struct check_report *report)
+{
+    return report->leaked > 0 || report->free_count_wrong;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include <stddef.h>
+#include "block.h"
+
+/*
+    rewrite every fragmented file of the tree into one run of blocks,
+    then compact the blockfile and truncate its free tail
+    at most `rate` MB of blocks are moved per second, 0 means unlimited
+*/
+void defrag_volume(unsigned int rate);
+
+/*
+    start a thread calling defrag_volume() now and then every `interval` seconds
+    interval 0 means only once
+*/
+void start_defrag(unsigned int interval, unsigned int rate);
+
+/*
+    render the progress and fragmentation of the last pass as text
+    the result is malloc()ed, its length is stored in *len
+*/
+char *render_defrag_stats(size_t *len);
+
+#endif
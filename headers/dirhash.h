@@ -0,0 +1,41 @@
+#ifndef DIRHASH_H
+#define DIRHASH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+    every dir entry has a 32-bit hash of its name, stored in an array of its own in the dir record,
+    a lookup compares the hashes several at a time and only compares the names of the matches
+*/
+enum dir_hash_impl {
+    DIR_HASH_SCALAR,
+    DIR_HASH_SSE2,
+    DIR_HASH_AVX2,
+    DIR_HASH_IMPL_NUM,
+};
+
+extern const char *const dir_hash_impl_names[DIR_HASH_IMPL_NUM];
+
+/*
+    hash of a name as stored on disk, it never changes
+*/
+uint32_t dir_name_hash(const char *name);
+
+/*
+    index of the first of hashes[from, n) equal to hash, or n if none
+*/
+uint32_t find_dir_hash(const uint32_t *hashes, uint32_t from, uint32_t n, uint32_t hash);
+
+/*
+    whether the cpu runs impl
+*/
+bool dir_hash_impl_supported(enum dir_hash_impl impl);
+
+/*
+    make find_dir_hash() use impl, by default it uses the fastest supported one
+    returns false if it is not supported
+*/
+bool set_dir_hash_impl(enum dir_hash_impl impl);
+
+#endif
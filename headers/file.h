@@ -19,21 +19,94 @@ struct file_metadata {
     time_t access_time;
     time_t modify_time;
 };
+/*
+    the data of a file starts after this many bytes of its first block,
+    where the metadata was stored before the inode table
+*/
 #define FILE_METADATA_OFFSET (sizeof(struct file_metadata))
+#define FILE_SIZE_MAX (UINT32_MAX - FILE_METADATA_OFFSET)
+/*
+    a dir file is a header: file_count, DIR_MAGIC, slot_cap, slot_end, free_slot and dead_bytes,
+    then the name hashes and the offsets of the entries, slot_cap of each,
+    then the entries: the first block id and the name with its '\0'
+    a removed entry leaves a tombstone in its slot, the offset of which is DIR_SLOT_DEAD and the next tombstone,
+    a new entry takes the first tombstone (free_slot) or else slot_end, its bytes go after the last entry,
+    so a change writes the header, one slot and the new entry, and never moves the others
+    the bytes of the removed entries (dead_bytes) are reclaimed by compacting the dir in the background
+    a dir written before the hashes has no magic nor slots, its entries follow file_count,
+    a dir with DIR_MAGIC_V1 has a header without slot_end, free_slot and dead_bytes,
+    both are laid out like the others when read, and written whole by their next change
+*/
+#define DIR_MAGIC 0xd14ec7eeu// never the block id of the first entry
+#define DIR_MAGIC_V1 0xd14ec7edu
+#define DIR_HEADER_SIZE (sizeof(file_count_t) + 5 * sizeof(uint32_t))
+#define DIR_HEADER_V1_SIZE (sizeof(file_count_t) + 2 * sizeof(uint32_t))
+#define DIR_MIN_SLOTS 8
+#define DIR_SLOT_DEAD (1u << 31)
+#define DIR_SLOT_NONE (DIR_SLOT_DEAD - 1)// no tombstone
+#define DIR_COMPACT_MIN (16 << 10)// dead bytes worth compacting a dir, once they are half of its entries
+#define DIR_COMPACT_QUEUE 64// dirs waiting for the compactor, more are left for a later removal
+#define DIR_LOCK_STRIPES 64
+/*
+    a view of a dir: its file is read once into raw and the entries are parsed in place,
+    raw comes from an arena of the thread and is given back by destruct_dir_record()
+*/
 struct dir_record {
-    file_count_t file_count;
-    block_size_t *list_first_block_id;
-    char **list_filename;
+    file_count_t file_count;// live entries
+    file_count_t slot_cap;
+    file_count_t slot_end;// slots used so far, tombstones included
+    file_count_t free_slot;// first tombstone or DIR_SLOT_NONE
+    file_size_t dead_bytes;
     fileno_t dir_fileno;
+    uint32_t epoch;// changes of the dir before it was read
+    bool stale;// raw is laid out unlike the dir file, the next change writes it whole
+    uint8_t *raw;// the dir file as laid out on disk, the header first
+    file_size_t size;// bytes used in raw
+    file_size_t cap;// bytes raw can hold
+    bool owned;// raw was malloc()ed, not taken from the arena
 };
+/*
+    an entry of a dir_record, name points into the record and is valid until it changes
+    walk a dir with
+        struct dir_entry entry = DIR_ENTRY_INIT;
+        while (next_dir_entry(&dir, &entry)) ...
+*/
+struct dir_entry {
+    block_size_t first_block_id;
+    const char *name;
+    file_size_t off;// where the entry starts in raw
+    file_size_t next;// where the next one starts
+    file_count_t seen;// slots walked so far
+};
+#define DIR_ENTRY_INIT { .seen = 0 }
+#define DIR_ARENA_SIZE (64 << 10)// initial arena of a thread
+#define DIR_ARENA_MAX (1 << 20)// a larger dir gets its own buffer
 
 #define MODE_ISDIR 1
 #define MODE_ISREG 0
 
 #define EMPTY_DIR_SIZE \
-    (sizeof(file_count_t) + sizeof(block_size_t) + sizeof(".") + sizeof(block_size_t) + sizeof(".."))
+    (DIR_HEADER_SIZE + DIR_MIN_SLOTS * 2 * sizeof(uint32_t) + sizeof(block_size_t) + sizeof(".") + sizeof(block_size_t) + sizeof(".."))
 
 #define FILENO_TABLE_SIZE 65536
+#define RELATIME_INTERVAL (24 * 60 * 60)// seconds an access time is kept under ATIME_RELATIME
+#define COPY_CHUNK_SIZE (1 << 20)// bytes read and written at a time by copy_file()
+
+/*
+    when reading a file updates its access time
+*/
+enum atime_policy {
+    ATIME_STRICT,// every read
+    ATIME_RELATIME,// if it is not after the modify time, or older than RELATIME_INTERVAL
+    ATIME_NOATIME,// never
+};
+
+extern enum atime_policy atime_policy;
+/*
+    timestamp-only updates are left in the inode table when a file is closed,
+    and only written to disk with the other metadata or by sync_all_metadatas()
+*/
+extern bool lazytime;
 
 #define assert_fileno_valid(fileno) \
     if (!file_opened(fileno)) { \
@@ -47,6 +120,11 @@ struct dir_record {
 */
 void init_file_module(void);
 
+/*
+    index in the block chain of a file of the block holding byte `offset`
+*/
+block_size_t get_blockno(file_size_t offset);
+
 /*
     get a unused fileno
 */
@@ -68,19 +146,38 @@ bool file_opened(fileno_t fileno);
 */
 fileno_t open_file(block_size_t first_block_id);
 
+/*
+    same as open_file(), but returns -1 instead of exiting
+    if the block doesn't hold the metadata of a file
+*/
+fileno_t try_open_file(block_size_t first_block_id);
+
 /*
     close a file by fileno:
     sync metadata to disk and release this fileno
+    if the file was removed, release its blocks instead
 */
 void close_file(fileno_t fileno);
 
 /*
-    sync file's metadata
+    release the blocks of a file which has been removed from its dir
+    deferred to the last close_file() if the file is still opened
+*/
+void remove_file(block_size_t first_block_id);
+
+/*
+    set *list to a malloc()ed array of the first block id of every opened file
+    returns the length of it
+*/
+block_size_t list_opened_files(block_size_t **list);
+
+/*
+    sync file's metadata into the inode table
 */
 void sync_file_metadata(fileno_t fileno);
 
 /*
-    sync all opened file's metadata
+    sync all opened file's metadata and write the inode table to disk
 */
 void sync_all_metadatas(void);
 
@@ -110,6 +207,42 @@ int write_file(fileno_t fileno, const uint8_t *buf, file_size_t size, file_size_
     return the size is valid or not
 */
 bool cut_file(fileno_t fileno, file_size_t size);
+
+/*
+    preallocate space for [offset, offset + length) like fallocate(2)
+    the file size is extended unless keep_size is set
+    return false if the range is too large
+*/
+bool allocate_file(fileno_t fileno, file_size_t offset, file_size_t length, bool keep_size);
+
+/*
+    turn [offset, offset + length) into a hole, the file size is kept
+    whole blocks are punched, partial blocks are zeroed
+*/
+void punch_file(fileno_t fileno, file_size_t offset, file_size_t length);
+
+/*
+    make the data and metadata of a file durable like fsync(2), or fdatasync(2) if datasync is set,
+    which leaves out timestamp-only changes
+    nothing is written if the file is clean, concurrent calls share one commit of the volume
+*/
+void fsync_file(fileno_t fileno, bool datasync);
+
+/*
+    copy `length` bytes at offset_in of file `in` to offset_out of file `out` like copy_file_range(2)
+    the data never leaves the process, it is moved COPY_CHUNK_SIZE bytes at a time
+    returns the number of copied bytes, less than length at the end of `in`
+*/
+file_size_t copy_file(fileno_t in, file_size_t offset_in, fileno_t out, file_size_t offset_out, file_size_t length);
+
+/*
+    replace the content of `dst` with the content of `src` without copying it:
+    after the first block every block shares the slot of src, copied on write (reflink)
+    the first reflink turns the physical map on for good, see physical_map_enabled()
+    returns false if both are the same file
+*/
+bool clone_file(fileno_t src, fileno_t dst);
+
 /*
     read dir info to dest
     assume dest is valid
@@ -117,21 +250,60 @@ bool cut_file(fileno_t fileno, file_size_t size);
 void read_dir(fileno_t fileno, struct dir_record *dest);
 
 /*
-    write dir into the dir into blockfile
+    write dir into the dir into blockfile, whole
 */
 void write_dir(const struct dir_record *dir);
 
 /*
-    destruct any dynamic alloc memory in  dir_record
+    add an entry to an open dir_record and to its dir file,
+    only the new entry, its slot and the header are written unless the slots are full
+*/
+void link_dir_entry(struct dir_record *dir, block_size_t first_block_id, const char *name);
+
+/*
+    remove an entry of an open dir_record from it and from its dir file,
+    only its slot and the header are written, the dir is compacted later
+    returns false if the entry was removed or replaced meanwhile, then nothing changes
+*/
+bool unlink_dir_entry(struct dir_record *dir, const struct dir_entry *entry);
+
+/*
+    start a thread compacting the dirs left with many removed entries,
+    without it they are compacted by the removal itself
+*/
+void start_dir_compactor(void);
+
+/*
+    stop the compactor, the dirs still waiting are compacted by a later removal
+*/
+void stop_dir_compactor(void);
+
+/*
+    give back the buffer of the dir_record and close the dir if it is open
 */
 void destruct_dir_record(struct dir_record *rec);
 
 /*
-    find file name in dir_record
-    returns the index in dirrecord
-    if mismatch returns FILE_COUNT_MAX
+    move entry to the next entry of dir
+    returns false after the last one
+*/
+bool next_dir_entry(const struct dir_record *dir, struct dir_entry *entry);
+
+/*
+    find file name in dir_record, the match is stored in entry
+    returns false if mismatch
+*/
+bool find_name_in_dir_record(const char *name, const struct dir_record *rec, struct dir_entry *entry);
+
+/*
+    make rec an empty dir holding . and .. in memory only, it is not open and has no fileno
+*/
+void init_dir_record(struct dir_record *rec, block_size_t self_id, block_size_t parent_id);
+
+/*
+    size of a dir file holding count entries, . and .. included, whose names take names_len bytes with their '\0'
 */
-file_count_t find_name_in_dir_record(const char *name, struct dir_record *rec);
+file_size_t dir_record_size(file_count_t count, file_size_t names_len);
 
 /*
     create a file in the given dir(given by fileno)
@@ -141,14 +313,15 @@ file_count_t find_name_in_dir_record(const char *name, struct dir_record *rec);
 fileno_t create_file(fileno_t dir_fileno, const char *filename, bool is_dir);
 
 /*
-    add a item in dir
+    add a item in dir, in memory only
+    returns the slot it took
 */
-void add_item_in_dir(struct dir_record *dir, block_size_t first_blockid, const char *name);
+file_count_t add_item_in_dir(struct dir_record *dir, block_size_t first_blockid, const char *name);
 
 /*
-    remove a item in dir
+    remove a item in dir, in memory only, its slot becomes a tombstone
 */
-void remove_item_in_dir(struct dir_record *dir, file_count_t index);
+void remove_item_in_dir(struct dir_record *dir, const struct dir_entry *entry);
 
 /*
     init a empty dir:
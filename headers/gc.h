@@ -0,0 +1,35 @@
+#ifndef GC_H
+#define GC_H
+
+#include "block.h"
+
+/*
+    find blocks which are neither reachable from the root dir, held by an opened file
+    nor free, and release them to the free block chain
+    the scan runs without blocking foreground operations,
+    it gives up (returns 0) if a rename or a create happens meanwhile
+    returns the number of reclaimed blocks
+*/
+block_size_t collect_garbage(void);
+
+/*
+    start a thread calling collect_garbage() now and then every `interval` seconds
+    interval 0 means only once
+*/
+void start_gc(unsigned int interval);
+
+/*
+    wrap an operation moving dir entries between dirs, such as rename,
+    or linking a newly acquired file, see create_file()
+*/
+void begin_namespace_change(void);
+void end_namespace_change(void);
+
+/*
+    wrap holding a chain acquired but not linked to any file outside the block map,
+    such as the run defrag moves a file into, no garbage scan runs meanwhile
+*/
+void begin_unlinked_chain(void);
+void end_unlinked_chain(void);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef INODE_H
+#define INODE_H
+
+#include <stdbool.h>
+#include "file.h"
+
+/*
+    the metadata of every file lives in the inode table, looked up by the first block id of the file
+    its records are packed in slots of their own, so it is as large as the number of files
+    it is kept in memory and written back a page (INODES_PER_PAGE records) at a time
+    a record whose block_count is 0 is empty
+*/
+#define INODES_PER_PAGE (META_PAGE_SIZE / sizeof(struct file_metadata))
+
+/*
+    load the inode table in the given path, an empty table if it doesn't exist
+    a table with more empty records than used ones is packed and truncated
+    volumes made before the inode table keep the metadata in the first block of each file,
+    see try_open_file()
+*/
+void load_inode_table(const char *path);
+
+/*
+    copy the inode of `id` to md
+    returns false if it is empty
+*/
+bool get_inode(block_size_t id, struct file_metadata *md);
+
+/*
+    store the inode of `id`, it is written back by sync_inode_table()
+    set lazy if only its timestamps changed
+*/
+void put_inode(block_size_t id, const struct file_metadata *md, bool lazy);
+
+/*
+    empty the inode of `id`, the file was removed
+*/
+void drop_inode(block_size_t id);
+
+/*
+    write the dirty pages of the inode table to disk, and the lazy ones if lazy is set
+    returns the number of written pages
+*/
+size_t sync_inode_table(bool lazy);
+
+/*
+    wait until the pages written by sync_inode_table() are durable
+*/
+void flush_inode_table(void);
+
+/*
+    write the whole inode table into another file, for a snapshot
+*/
+bool save_inode_table(const char *path);
+
+#endif
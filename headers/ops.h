@@ -0,0 +1,81 @@
+#ifndef OPS_H
+#define OPS_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "file.h"
+
+/*
+    file system operations on absolute paths, independent of fuse
+    they return 0 (or the byte count for read/write) on success and -errno on failure
+*/
+
+/*
+    called by vfs_readdir() for every entry
+    return non-zero to stop
+*/
+typedef int (*vfs_filler_t)(void *buf, const char *name);
+
+int vfs_statfs(struct statvfs *stfs);
+
+int vfs_readdir(const char *path, void *buf, vfs_filler_t filler);
+
+int vfs_mkdir(const char *path);
+
+int vfs_rmdir(const char *path);
+
+int vfs_getattr(const char *path, struct stat *st);
+
+int vfs_utimens(const char *path, const struct timespec ts[2]);
+
+/*
+    open a file and store its fileno in fh
+*/
+int vfs_open(const char *path, fileno_t *fh);
+
+int vfs_release(fileno_t fh);
+
+int vfs_read(fileno_t fh, char *buf, size_t size, off_t offset);
+
+int vfs_write(fileno_t fh, const char *buf, size_t size, off_t offset);
+
+/*
+    create a regular file
+*/
+int vfs_mknod(const char *path, mode_t mode);
+
+int vfs_rename(const char *from, const char *to);
+
+int vfs_unlink(const char *path);
+
+int vfs_truncate(const char *path, off_t size);
+
+/*
+    mode is the same as fallocate(2)
+*/
+int vfs_fallocate(fileno_t fh, int mode, off_t offset, off_t length);
+
+/*
+    same as fsync(2), or fdatasync(2) if datasync is set
+*/
+int vfs_fsync(fileno_t fh, bool datasync);
+
+/*
+    fsync a dir by path
+*/
+int vfs_fsyncdir(const char *path, bool datasync);
+
+/*
+    same as copy_file_range(2) without the flags, returns the number of copied bytes
+*/
+int vfs_copy_file_range(fileno_t fh_in, off_t offset_in, fileno_t fh_out, off_t offset_out, size_t size);
+
+/*
+    make the existing regular file `to` a copy of `from`, through vfs_copy_file_range()
+    with reflink set, the blocks are shared copy on write instead of copied
+    returns -EINVAL if both are the same file
+*/
+int vfs_copy(const char *from, const char *to, bool reflink);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+    static tracepoints of the provider "naivevfs"
+    they are built in when <sys/sdt.h> is available (HAVE_SDT) and cost a nop when not attached,
+    list them by `perf list sdt_naivevfs:*` (after `perf buildid-cache --add naivevfs`)
+    or `bpftrace -l 'usdt:./naivevfs:*'`
+*/
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define NAIVE_PROBE0(name) DTRACE_PROBE(naivevfs, name)
+#define NAIVE_PROBE1(name, a) DTRACE_PROBE1(naivevfs, name, a)
+#define NAIVE_PROBE2(name, a, b) DTRACE_PROBE2(naivevfs, name, a, b)
+#define NAIVE_PROBE3(name, a, b, c) DTRACE_PROBE3(naivevfs, name, a, b, c)
+#define NAIVE_PROBE4(name, a, b, c, d) DTRACE_PROBE4(naivevfs, name, a, b, c, d)
+#else
+#define NAIVE_PROBE0(name) do {} while (0)
+#define NAIVE_PROBE1(name, a) do {} while (0)
+#define NAIVE_PROBE2(name, a, b) do {} while (0)
+#define NAIVE_PROBE3(name, a, b, c) do {} while (0)
+#define NAIVE_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif
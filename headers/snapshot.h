@@ -0,0 +1,37 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+
+#define SNAPSHOT_NAME_MAX 64
+#define SNAPSHOT_MAX 256// a slot is referenced at most SNAPSHOT_MAX + 1 times
+
+/*
+    called by list_snapshots() for every snapshot
+    return non-zero to stop
+*/
+typedef int (*snapshot_filler_t)(void *buf, const char *name);
+
+/*
+    freeze the current state of the volume under `name`
+    only the fatable and the physical map are copied, blocks are shared until written
+    returns 0 or -errno
+*/
+int create_snapshot(const char *name);
+
+/*
+    remove a snapshot, the blocks only it uses are freed
+    returns 0 or -errno
+*/
+int delete_snapshot(const char *name);
+
+bool snapshot_exists(const char *name);
+
+void list_snapshots(void *buf, snapshot_filler_t filler);
+
+/*
+    initial the block module read-only from a snapshot, instead of init_block_module()
+*/
+void mount_snapshot(const char *name);
+
+#endif
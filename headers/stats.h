@@ -0,0 +1,95 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "base.h"
+
+enum stats_op {
+    STATS_OP_GETATTR,
+    STATS_OP_READDIR,
+    STATS_OP_MKDIR,
+    STATS_OP_RMDIR,
+    STATS_OP_UTIMENS,
+    STATS_OP_OPEN,
+    STATS_OP_RELEASE,
+    STATS_OP_READ,
+    STATS_OP_WRITE,
+    STATS_OP_MKNOD,
+    STATS_OP_RENAME,
+    STATS_OP_UNLINK,
+    STATS_OP_TRUNCATE,
+    STATS_OP_FALLOCATE,
+    STATS_OP_STATFS,
+    STATS_OP_COPY,
+    STATS_OP_FSYNC,
+    STATS_OP_FSYNCDIR,
+    STATS_OP_READ_BLOCK,
+    STATS_OP_WRITE_BLOCK,
+    STATS_OP_READ_BLOCKS,
+    STATS_OP_WRITE_BLOCKS,
+    STATS_OP_NUM
+};
+
+/*
+    bucket i counts latencies in [2^i, 2^(i+1)) nanoseconds
+*/
+#define STATS_HIST_BUCKETS 40
+
+extern bool stats_enabled;
+
+struct stats_timer {
+    uint64_t start_ns;
+};
+
+/*
+    current monotonic time in nanoseconds
+*/
+static inline uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+    record one operation of the calling thread
+*/
+void stats_record(enum stats_op op, uint64_t latency_ns);
+
+/*
+    start timing an operation, costs nothing if stats is disabled
+*/
+static inline void stats_begin(struct stats_timer *timer)
+{
+    timer->start_ns = stats_enabled ? stats_now_ns() : 0;
+}
+
+/*
+    finish timing an operation started by stats_begin()
+*/
+static inline void stats_end(struct stats_timer *timer, enum stats_op op)
+{
+    if (timer->start_ns != 0) {
+        stats_record(op, stats_now_ns() - timer->start_ns);
+    }
+}
+
+/*
+    get the name of an operation
+*/
+const char *stats_op_name(enum stats_op op);
+
+/*
+    render the counters and latency histograms of all threads as text
+    returns a malloc()ed string, its length is stored in len
+*/
+char *render_stats(size_t *len);
+
+/*
+    start a thread dumping the stats to stderr every `interval` seconds
+*/
+void start_stats_dumper(unsigned int interval);
+
+#endif
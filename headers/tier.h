@@ -0,0 +1,90 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "block.h"
+
+/*
+    hot/cold tiering of the slots: a fast backing file (TIER_FILENAME, e.g. a symlink to an NVMe) holds some slots,
+    whose copy in the blockfile (their home) is then out of date, the others live at home only
+    a slot without a fast block is written to a new one while there are free ones,
+    a slot read often is moved up by the migrator, which also moves the coldest ones home
+    to keep a share of the fast tier free for new writes
+    the slot held by every fast block is recorded in TIERMAP_FILENAME, written after the data by sync_tier()
+    a fast block left by a slot is only reused once that is durable
+*/
+#define TIER_NONE UINT32_MAX
+#define TIER_PROMOTE_HEAT 4// reads of a slot, halved every pass of the migrator, to move it up
+#define TIER_LOW_FREE 8// the migrator moves cold slots home when less than 1/8 of the fast tier is free
+#define TIER_HIGH_FREE 4// until 1/4 of it is free
+#define TIER_MIGRATE_BATCH 64// slots moved per pass of the migrator
+#define TIER_SCAN_CHUNK 65536// slots the migrator looks at per hold of the map lock
+#define TIER_SEQ_BUCKETS 4096// write counters a move checks to see if its slot was written meanwhile
+
+/*
+    set once a volume with a fast tier is loaded
+*/
+extern bool tier_enabled;
+/*
+    bytes of the fast tier given by init_block_module() to a volume which has none, 0 for none
+    an existing fast tier keeps its size
+*/
+extern size_t format_tier_size;
+
+/*
+    load the fast tier of the volume if it has one, else create one of format_tier_size bytes unless readonly
+    called once the blockfile is opened
+*/
+void open_tier(bool readonly);
+
+/*
+    start a thread moving slots between the tiers every `interval_ms`
+*/
+void start_tier_migrator(unsigned int interval_ms);
+
+/*
+    stop the migrator and make the fast tier durable
+*/
+void stop_tier_migrator(void);
+
+/*
+    hold the tiers around the I/O of slots, a slot is never moved in between
+*/
+void tier_begin_io(void);
+
+/*
+    the fast block of each of the n slots, TIER_NONE for a slot at home, SLOT_NONE slots are skipped
+    a read counts an access to the slot, a write gets a new fast block while there are free ones
+*/
+void tier_route(const block_size_t *slots, size_t n, block_size_t *fast, bool write);
+
+/*
+    read or write the blocks of buf whose slots are routed to the fast tier
+    a snapshot mount checks its reads against the tiermap file, the live volume keeps moving slots
+*/
+void tier_io(const block_size_t *slots, const block_size_t *fast, size_t n, uint8_t *buf, bool write);
+
+/*
+    finish the I/O started by tier_begin_io(), a write records the new fast blocks of its slots
+*/
+void tier_end_io(const block_size_t *slots, const block_size_t *fast, size_t n, bool write);
+
+/*
+    the slot is freed, its fast block is given back
+*/
+void tier_drop(block_size_t slot);
+
+/*
+    make the blocks written to both tiers and the owners of the fast blocks durable,
+    the fast blocks left by moved slots are reused afterwards
+*/
+void sync_tier(void);
+
+/*
+    render the hits and moves of the tiers like render_stats(), the result is malloc()ed
+*/
+char *render_tier_stats(size_t *len);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "base.h"
+#include "stats.h"
+
+#define TRACE_MAGIC "NVTRACE1"
+#define TRACE_PATH_MAX 8192
+
+/*
+    one traced operation, followed by path_len bytes of path(s)
+    rename and copy store "from\0to", other ops store a single path without '\0'
+    the meaning of fh/offset/size depends on the op:
+        open: fh is the returned fileno
+        read/write: fh, offset and size of the request
+        truncate: size is the new size
+        fallocate: fh, offset, size as length, mode in flags
+        utimens: offset is atime, size is mtime
+        copy: flags is set for a reflink
+        fsync/fsyncdir: fh for fsync, flags is set for a datasync
+*/
+struct trace_record {
+    uint8_t op;// enum stats_op
+    uint8_t flags;
+    uint16_t path_len;
+    int32_t result;
+    uint64_t fh;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t timestamp_ns;// since the trace began
+    uint64_t latency_ns;
+};
+
+extern bool trace_enabled;
+
+/*
+    begin to write trace records into the given file
+*/
+void start_trace(const char *path);
+
+/*
+    flush and close the trace file
+*/
+void stop_trace(void);
+
+/*
+    append a record, path2 is only used by rename and copy and may be NULL
+    start_ns is the stats_now_ns() at the beginning of the op
+*/
+void trace_op(enum stats_op op, const char *path, const char *path2, uint64_t fh,
+    uint64_t offset, uint64_t size, uint8_t flags, int result, uint64_t start_ns, uint64_t latency_ns);
+
+/*
+    open a trace file for reading and check its header
+    returns NULL on failure
+*/
+FILE *open_trace(const char *path);
+
+/*
+    read the next record, path receives path_len bytes and a '\0'
+    path should have at least TRACE_PATH_MAX bytes
+    return false at the end of the trace
+*/
+bool read_trace_record(FILE *trace, struct trace_record *rec, char *path);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "block.h"
+
+/*
+    write-behind cache of the blockfile: write_block() leaves the data of a slot in memory,
+    a flusher thread writes it back once it is older than the expire time,
+    or the oldest first while more than half of the limit is dirty
+    a writer reaching the limit writes back the oldest slots itself
+*/
+#define WRITEBACK_WAKE_MS 100// how often the flusher looks for expired blocks
+#define WRITEBACK_BATCH 64// blocks written back per pass of the lock
+#define WRITEBACK_BATCH_BYTES (4 << 20)// and at most these bytes, for large blocks
+
+/*
+    start caching writes, at most `limit` bytes are dirty
+    a block is written back `expire_ms` after it was dirtied at the latest
+*/
+void start_writeback(size_t limit, unsigned int expire_ms);
+
+/*
+    write back every block, flush the rest and stop the flusher
+*/
+void stop_writeback(void);
+
+/*
+    copy the data of a cached slot to buf
+    returns false if the slot is not cached
+*/
+bool writeback_read(block_size_t slot, uint8_t *buf);
+
+/*
+    store the data of a slot, it is written back later
+    returns false if the cache is off, the caller should write it itself
+*/
+bool writeback_write(block_size_t slot, const uint8_t *buf);
+
+/*
+    write back or wait while the dirty data is over the limit, call it before taking any lock
+*/
+void writeback_throttle(void);
+
+/*
+    forget a slot which is freed, its data is never written back
+    a write already in flight may still land in it, that is free space anyway
+*/
+void writeback_drop(block_size_t slot);
+
+/*
+    write back every slot dirtied before the call, and wait for the writes in flight
+    it does not flush the blockfile, see flush_blockfile()
+*/
+void writeback_all(void);
+
+/*
+    render the counters of the cache like render_stats(), the result is malloc()ed
+*/
+char *render_writeback_stats(size_t *len);
+
+#endif
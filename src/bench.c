@@ -0,0 +1,534 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "base.h"
+#include "block.h"
+#include "file.h"
+#include "path.h"
+#include "dirhash.h"
+#include "stats.h"
+#include "writeback.h"
+#include "tier.h"
+
+struct bench_config {
+    const char *workload;
+    const char *dir;
+    size_t file_size;
+    size_t io_size;
+    size_t count;
+    size_t depth;
+    size_t dir_entries;
+    unsigned int seed;
+};
+
+static struct bench_config config = {
+    .workload = "all",
+    .dir = "/tmp",
+    .file_size = 64 << 20,
+    .io_size = 128 << 10,
+    .count = 10000,
+    .depth = 64,
+    .dir_entries = 20000,
+    .seed = 1,
+};
+
+/*
+    latencies of one workload, in nanoseconds
+*/
+struct bench_result {
+    uint64_t *lat;
+    size_t n;
+    size_t cap;
+    uint64_t bytes;
+    uint64_t start_ns;
+    uint64_t total_ns;
+};
+
+static void result_begin(struct bench_result *res)
+{
+    memset(res, 0, sizeof(struct bench_result));
+    res->start_ns = stats_now_ns();
+}
+
+static void result_add(struct bench_result *res, uint64_t lat, uint64_t bytes)
+{
+    if (res->n == res->cap) {
+        res->cap = res->cap ? res->cap * 2 : 1024;
+        res->lat = realloc(res->lat, res->cap * sizeof(uint64_t));
+        if (res->lat == NULL) {
+            perror("result_add() realloc");
+            exit(1);
+        }
+    }
+    res->lat[res->n++] = lat;
+    res->bytes += bytes;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct bench_result *res, double p)
+{
+    size_t i = res->n * p;
+    if (i >= res->n) {
+        i = res->n - 1;
+    }
+    return res->lat[i] / 1e3;
+}
+
+static void result_print(const char *name, struct bench_result *res)
+{
+    res->total_ns = stats_now_ns() - res->start_ns;
+    if (res->n == 0) {
+        printf("%-10s no operation\n", name);
+        return ;
+    }
+    qsort(res->lat, res->n, sizeof(uint64_t), cmp_u64);
+    double secs = res->total_ns / 1e9;
+    printf("%-10s %10zu ops %12.1f ops/s %10.2f MB/s  p50 %9.2fus  p90 %9.2fus  p99 %9.2fus  p999 %9.2fus  max %9.2fus\n",
+        name, res->n, res->n / secs, res->bytes / secs / (1 << 20),
+        percentile_us(res, 0.5), percentile_us(res, 0.9), percentile_us(res, 0.99),
+        percentile_us(res, 0.999), res->lat[res->n - 1] / 1e3);
+    free(res->lat);
+}
+
+/*
+    find a file by absolute path and open it
+    return -1 if it doesn't exist
+*/
+static fileno_t open_path(const char *path)
+{
+    struct dir_record dir;
+    int last_slash_i = read_dir_recursively(path, &dir);
+    if (last_slash_i == -1) {
+        destruct_dir_record(&dir);
+        return -1;
+    }
+    struct dir_entry entry;
+    fileno_t fn = find_name_in_dir_record(path + last_slash_i + 1, &dir, &entry) ? open_file(entry.first_block_id) : -1;
+    destruct_dir_record(&dir);
+    return fn;
+}
+
+static uint8_t *alloc_io_buf(void)
+{
+    uint8_t *buf = malloc(config.io_size);
+    if (buf == NULL) {
+        perror("alloc_io_buf() malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < config.io_size; i++) {
+        buf[i] = rand();
+    }
+    return buf;
+}
+
+static void bench_seqwrite(void)
+{
+    struct bench_result res;
+    uint8_t *buf = alloc_io_buf();
+    fileno_t fn = create_file(0, "seq", false);
+    result_begin(&res);
+    for (size_t off = 0; off < config.file_size; off += config.io_size) {
+        uint64_t t = stats_now_ns();
+        write_file(fn, buf, config.io_size, off);
+        result_add(&res, stats_now_ns() - t, config.io_size);
+    }
+    result_print("seqwrite", &res);
+    close_file(fn);
+    free(buf);
+}
+
+static void bench_seqread(void)
+{
+    struct bench_result res;
+    uint8_t *buf = alloc_io_buf();
+    fileno_t fn = open_path("/seq");
+    if (fn == -1) {
+        printerrf("seqread: run seqwrite first\n");
+        exit(1);
+    }
+    result_begin(&res);
+    for (size_t off = 0; off < config.file_size; off += config.io_size) {
+        uint64_t t = stats_now_ns();
+        int n = read_file(fn, buf, config.io_size, off);
+        result_add(&res, stats_now_ns() - t, n);
+    }
+    result_print("seqread", &res);
+    close_file(fn);
+    free(buf);
+}
+
+static void bench_random(bool write)
+{
+    struct bench_result res;
+    uint8_t *buf = alloc_io_buf();
+    fileno_t fn = open_path("/seq");
+    if (fn == -1) {
+        printerrf("%s: run seqwrite first\n", write ? "randwrite" : "randread");
+        exit(1);
+    }
+    size_t slots = config.file_size / config.io_size;
+    result_begin(&res);
+    for (size_t i = 0; i < config.count; i++) {
+        file_size_t off = (rand() % slots) * config.io_size;
+        uint64_t t = stats_now_ns();
+        int n;
+        if (write) {
+            n = write_file(fn, buf, config.io_size, off);
+        } else {
+            n = read_file(fn, buf, config.io_size, off);
+        }
+        result_add(&res, stats_now_ns() - t, n);
+    }
+    result_print(write ? "randwrite" : "randread", &res);
+    close_file(fn);
+    free(buf);
+}
+
+static void bench_randwrite(void)
+{
+    bench_random(true);
+}
+
+static void bench_randread(void)
+{
+    bench_random(false);
+}
+
+static void bench_create(void)
+{
+    struct bench_result res;
+    char name[32];
+    fileno_t dir_fn = create_file(0, "storm", true);
+    result_begin(&res);
+    for (size_t i = 0; i < config.count; i++) {
+        snprintf(name, sizeof(name), "f%zu", i);
+        uint64_t t = stats_now_ns();
+        close_file(create_file(dir_fn, name, false));
+        result_add(&res, stats_now_ns() - t, 0);
+    }
+    result_print("create", &res);
+    close_file(dir_fn);
+}
+
+static void bench_deeppath(void)
+{
+    struct bench_result res;
+    size_t path_len = config.depth * 2 + sizeof("/x");
+    char *path = malloc(path_len);
+    fileno_t fn = 0, next;
+    for (size_t i = 0; i < config.depth; i++) {
+        next = create_file(fn, "d", true);
+        if (fn != 0) {
+            close_file(fn);
+        }
+        fn = next;
+        memcpy(path + i * 2, "/d", 2);
+    }
+    close_file(create_file(fn, "x", false));
+    if (fn != 0) {
+        close_file(fn);
+    }
+    strcpy(path + config.depth * 2, "/x");
+    result_begin(&res);
+    for (size_t i = 0; i < config.count; i++) {
+        uint64_t t = stats_now_ns();
+        fn = open_path(path);
+        if (fn == -1) {
+            printerrf("deeppath: lookup failed\n");
+            exit(1);
+        }
+        close_file(fn);
+        result_add(&res, stats_now_ns() - t, 0);
+    }
+    result_print("deeppath", &res);
+    free(path);
+}
+
+static void bench_hugedir(void)
+{
+    struct bench_result res;
+    char name[32], path[48];
+    fileno_t dir_fn = create_file(0, "huge", true);
+    for (size_t i = 0; i < config.dir_entries; i++) {
+        snprintf(name, sizeof(name), "entry%zu", i);
+        close_file(create_file(dir_fn, name, false));
+    }
+    close_file(dir_fn);
+    result_begin(&res);
+    for (size_t i = 0; i < config.count; i++) {
+        snprintf(path, sizeof(path), "/huge/entry%zu", (size_t) rand() % config.dir_entries);
+        uint64_t t = stats_now_ns();
+        fileno_t fn = open_path(path);
+        if (fn == -1) {
+            printerrf("hugedir: lookup of %s failed\n", path);
+            exit(1);
+        }
+        close_file(fn);
+        result_add(&res, stats_now_ns() - t, 0);
+    }
+    result_print("hugedir", &res);
+}
+
+/*
+    unlink a random entry of a dir of dir_entries entries like vfs_unlink(), then create it again untimed
+*/
+static void bench_unlink(void)
+{
+    struct bench_result res;
+    struct dir_record dir;
+    struct dir_entry entry;
+    char name[32], path[48];
+    fileno_t dir_fn = create_file(0, "churn", true);
+    for (size_t i = 0; i < config.dir_entries; i++) {
+        snprintf(name, sizeof(name), "entry%zu", i);
+        close_file(create_file(dir_fn, name, false));
+    }
+    result_begin(&res);
+    for (size_t i = 0; i < config.count; i++) {
+        snprintf(path, sizeof(path), "/churn/entry%zu", (size_t) rand() % config.dir_entries);
+        const char *filename = strrchr(path, '/') + 1;
+        uint64_t t = stats_now_ns();
+        read_dir_recursively(path, &dir);
+        if (!find_name_in_dir_record(filename, &dir, &entry)) {
+            printerrf("unlink: lookup of %s failed\n", path);
+            exit(1);
+        }
+        unlink_dir_entry(&dir, &entry);
+        remove_file(entry.first_block_id);
+        destruct_dir_record(&dir);
+        result_add(&res, stats_now_ns() - t, 0);
+        close_file(create_file(dir_fn, filename, false));
+    }
+    close_file(dir_fn);
+    result_print("unlink", &res);
+}
+
+/*
+    lookups in a dir record of dir_entries entries held in memory, by walking the names one by one
+    as before the hashes, then by the hashes with every implementation the cpu runs
+*/
+static void bench_dirlookup(void)
+{
+    struct bench_result res;
+    struct dir_record dir;
+    struct dir_entry entry;
+    char name[32], label[32];
+    init_dir_record(&dir, 0, 0);
+    for (size_t i = 0; i < config.dir_entries; i++) {
+        snprintf(name, sizeof(name), "entry%zu", i);
+        add_item_in_dir(&dir, i + 1, name);
+    }
+    for (int impl = -1; impl < DIR_HASH_IMPL_NUM; impl++) {
+        if (impl >= 0 && !set_dir_hash_impl(impl)) {
+            continue;
+        }
+        srand(config.seed);
+        result_begin(&res);
+        for (size_t i = 0; i < config.count; i++) {
+            size_t target = (size_t) rand() % config.dir_entries;
+            snprintf(name, sizeof(name), "entry%zu", target);
+            uint64_t t = stats_now_ns();
+            bool found = false;
+            if (impl == -1) {
+                entry = (struct dir_entry) DIR_ENTRY_INIT;
+                while (!found && next_dir_entry(&dir, &entry)) {
+                    found = strcmp(name, entry.name) == 0;
+                }
+            } else {
+                found = find_name_in_dir_record(name, &dir, &entry);
+            }
+            result_add(&res, stats_now_ns() - t, 0);
+            if (!found || entry.first_block_id != target + 1) {
+                printerrf("dirlookup: lookup of %s failed\n", name);
+                exit(1);
+            }
+        }
+        snprintf(label, sizeof(label), "dirlookup-%s", impl == -1 ? "walk" : dir_hash_impl_names[impl]);
+        result_print(label, &res);
+    }
+    for (int impl = DIR_HASH_IMPL_NUM - 1; !set_dir_hash_impl(impl); impl--)
+        ;
+    destruct_dir_record(&dir);
+}
+
+static void bench_chain(void)
+{
+    struct bench_result res;
+    size_t max_len = config.io_size / BLOCK_SIZE;
+    if (max_len == 0) {
+        max_len = 1;
+    }
+    result_begin(&res);
+    for (size_t i = 0; i < config.count; i++) {
+        block_size_t len = rand() % max_len + 1;
+        uint64_t t = stats_now_ns();
+        block_size_t head = acquire_block_chain(len);
+        get_n_next_block_id(head, len - 1);
+        result_add(&res, stats_now_ns() - t, (uint64_t) len * BLOCK_SIZE);
+    }
+    result_print("chain", &res);
+}
+
+struct workload {
+    const char *name;
+    void (*run)(void);
+};
+
+static const struct workload workloads[] = {
+    {"seqwrite", bench_seqwrite},
+    {"seqread", bench_seqread},
+    {"randwrite", bench_randwrite},
+    {"randread", bench_randread},
+    {"create", bench_create},
+    {"deeppath", bench_deeppath},
+    {"hugedir", bench_hugedir},
+    {"unlink", bench_unlink},
+    {"dirlookup", bench_dirlookup},
+    {"chain", bench_chain},
+};
+
+#define WORKLOAD_NUM (sizeof(workloads) / sizeof(workloads[0]))
+
+static void usage(const char *prog)
+{
+    printerrf("usage: %s [options]\n"
+        "  -w workload   comma separated list of workloads, or 'all' (default)\n"
+        "                seqwrite seqread randwrite randread create deeppath hugedir unlink dirlookup chain\n"
+        "  -D dir        where the scratch volume is created (default /tmp)\n"
+        "  -s bytes      file size of the sequential workloads (default 64M)\n"
+        "  -b bytes      io size (default 128K)\n"
+        "  -B bytes      block size of the scratch volume, a power of two from 4K to 1M (default 4K)\n"
+        "  -t count      stripe the scratch volume across this many files, up to 16 (default 1)\n"
+        "  -u bytes      stripe unit, a power of two from 4K (default 64K)\n"
+        "  -T bytes      give the scratch volume a fast tier of this size, with its migrator (default none)\n"
+        "  -P bytes      presize the scratch volume, its blockfile is fallocated at once (default grown on demand)\n"
+        "  -g factor     growth factor of the fatable, above 1 and at most 4 (default 1.5)\n"
+        "  -C bytes      fallocate the blockfile this many bytes at a time as the fatable grows (default off)\n"
+        "  -n count      operation count of the other workloads (default 10000)\n"
+        "  -d depth      directory depth of deeppath (default 64)\n"
+        "  -k entries    directory entries of hugedir, unlink and dirlookup (default 20000)\n"
+        "  -r seed       random seed (default 1)\n"
+        "  -W bytes      cache writes in the writeback cache of this size (default off)\n"
+        "  -S            also print the stats module report\n", prog);
+    exit(1);
+}
+
+static size_t parse_size(const char *str)
+{
+    char *end;
+    size_t res = strtoull(str, &end, 0);
+    switch (*end) {
+    case 'G': case 'g': res <<= 10;// fall through
+    case 'M': case 'm': res <<= 10;// fall through
+    case 'K': case 'k': res <<= 10;
+    }
+    return res;
+}
+
+static bool workload_selected(const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = config.workload;
+    if (strcmp(p, "all") == 0) {
+        return true;
+    }
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == config.workload || p[-1] == ',') && (p[len] == '\0' || p[len] == ',')) {
+            return true;
+        }
+        p += len;
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    size_t block_size = DEFAULT_BLOCK_SIZE, stripe_count = 1, stripe_unit = DEFAULT_STRIPE_UNIT;
+    bool print_stats = false;
+    size_t writeback_limit = 0;
+    while ((opt = getopt(argc, argv, "w:D:s:b:B:t:u:T:P:g:C:n:d:k:r:W:S")) != -1) {
+        switch (opt) {
+        case 'w': config.workload = optarg; break;
+        case 'D': config.dir = optarg; break;
+        case 's': config.file_size = parse_size(optarg); break;
+        case 'b': config.io_size = parse_size(optarg); break;
+        case 'B': block_size = parse_size(optarg); break;
+        case 't': stripe_count = parse_size(optarg); break;
+        case 'u': stripe_unit = parse_size(optarg); break;
+        case 'T': format_tier_size = parse_size(optarg); break;
+        case 'P': format_volume_size = parse_size(optarg); break;
+        case 'g': grow_factor = atof(optarg); break;
+        case 'C': grow_chunk = parse_size(optarg); break;
+        case 'n': config.count = parse_size(optarg); break;
+        case 'd': config.depth = parse_size(optarg); break;
+        case 'k': config.dir_entries = parse_size(optarg); break;
+        case 'r': config.seed = parse_size(optarg); break;
+        case 'W': writeback_limit = parse_size(optarg); break;
+        case 'S': print_stats = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (config.io_size == 0 || config.file_size < config.io_size || config.dir_entries == 0 || config.depth == 0
+        || !block_size_valid(block_size) || !stripe_layout_valid(stripe_count, stripe_unit)
+        || !grow_policy_valid(grow_factor, grow_chunk)) {
+        usage(argv[0]);
+    }
+    format_block_size = block_size;
+    format_stripe_count = stripe_count;
+    format_stripe_unit = stripe_unit;
+    srand(config.seed);
+    stats_enabled = print_stats;
+
+    char volume_dir[strlen(config.dir) + sizeof("/naivevfs-bench-XXXXXX")];
+    sprintf(volume_dir, "%s/naivevfs-bench-XXXXXX", config.dir);
+    if (mkdtemp(volume_dir) == NULL || chdir(volume_dir) == -1) {
+        perror("main() scratch volume");
+        return 1;
+    }
+    printf("scratch volume: %s, %d byte blocks, %d stripes of %d bytes\n", volume_dir, format_block_size,
+        format_stripe_count, format_stripe_unit);
+    init_block_module();
+    init_file_module();
+    if (writeback_limit > 0) {
+        start_writeback(writeback_limit, 5000);
+    }
+    start_tier_migrator(1000);
+
+    for (size_t i = 0; i < WORKLOAD_NUM; i++) {
+        if (workload_selected(workloads[i].name)) {
+            workloads[i].run();
+        }
+    }
+
+    stop_writeback();
+    stop_tier_migrator();
+    sync_all_metadatas();
+    sync_fatable();
+    if (print_stats) {
+        size_t len;
+        char *report = render_stats(&len);
+        fwrite(report, 1, len, stdout);
+        free(report);
+        if (tier_enabled) {
+            report = render_tier_stats(&len);
+            fwrite(report, 1, len, stdout);
+            free(report);
+        }
+    }
+    unlink(FATABLE_FILENAME);
+    remove_blockfile(BLOCKFILE_FILENAME);
+    unlink(TIER_FILENAME);
+    unlink(TIERMAP_FILENAME);
+    unlink(INODE_FILENAME);
+    chdir("/");
+    rmdir(volume_dir);
+    return 0;
+}
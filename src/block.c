@@ -1,294 +1,2611 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <linux/falloc.h>
 #include "block.h"
+#include "stats.h"
+#include "writeback.h"
+#include "tier.h"
+#include "probes.h"
 
 int fatable_fd;
 struct fatable_metadata metadata;
+/*
+    the fatable never moves: address space for BLOCK_COUNT_MAX entries is reserved at load,
+    and made usable FAT_SEGMENT_BLOCKS entries at a time as it grows,
+    so growing it copies nothing and only touches the new entries
+*/
 blockid_data_t *fatable;
+static block_size_t fatable_committed = 0;
 /*
     priority: mem_lock > file_lock
 */
 pthread_rwlock_t fatable_mem_lock;
 pthread_mutex_t fatable_file_lock;
-
-int blockfile_fd;
-
-bool need_init_rootdir = false;
-
 /*
-    get next block id by current id
-    will exit if `id` and `fatable[id]` is out of range
+    foreground block I/O holds it for reading, relocation and the relinking of a compacted run for writing,
+    so no block is read or written through a chain while it is being changed
+    priority: block_map_lock > mem_lock
 */
-block_size_t get_next_block_id(block_size_t id);
+static pthread_rwlock_t block_map_lock = PTHREAD_RWLOCK_INITIALIZER;
+/*
+    bumped whenever a chain is linked differently, protected by fatable_mem_lock
+*/
+static uint64_t fatable_generation = 0;
+/*
+    the run compact_block_chains() is copying, [moving_start, moving_end),
+    and the number of writes landing in it meanwhile, the copy is dropped if it changes
+*/
+static block_size_t moving_start = 0, moving_end = 0;
+static uint64_t moving_writes = 0;
+/*
+    a garbage scan and a compaction never run at the same time
+*/
+static pthread_mutex_t maintenance_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
-    release a block chian to the free block chain
+    free blocks whose space is not punched out of the blockfile yet, NULL if discard is off
+    bits are set and cleared with fatable_mem_lock held for writing,
+    the discard thread clears them atomically with it held for reading
+*/
+static uint8_t *discard_pending = NULL;
+static block_size_t discard_pending_num = 0;
+static enum discard_policy discard_policy = DISCARD_OFF;
+static pthread_mutex_t discard_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t discard_cond = PTHREAD_COND_INITIALIZER;
+static bool discard_requested = false;
+/*
+    free blocks claimed by the discard thread, which punches them without fatable_mem_lock
+    bits are set with fatable_mem_lock and discard_mutex held, and cleared with discard_mutex held
+    once punched, discard_punched is signaled then
+    priority: fatable_mem_lock > discard_mutex
 */
-void release_block_chain(block_size_t head);
+static uint8_t *discard_inflight = NULL;
+static pthread_cond_t discard_punched = PTHREAD_COND_INITIALIZER;
 
-void init_block_module(void)
+/*
+    a block no longer pending is about to be written, so wait for its punch if it is under way
+    caller should hold fatable_mem_lock for writing
+*/
+static void wait_discard_locked(block_size_t id)
 {
-    pthread_rwlock_init(&fatable_mem_lock, NULL);
-    pthread_mutex_init(&fatable_file_lock, NULL);
-
-    load_fatable(FATABLE_FILENAME);
-    open_blockfile(BLOCKFILE_FILENAME);
+    if (!(__atomic_load_n(discard_inflight + id / 8, __ATOMIC_ACQUIRE) & (1 << (id % 8)))) {
+        return ;
+    }
+    pthread_mutex_lock(&discard_mutex);
+    while (discard_inflight[id / 8] & (1 << (id % 8))) {
+        pthread_cond_wait(&discard_punched, &discard_mutex);
+    }
+    pthread_mutex_unlock(&discard_mutex);
 }
 
-block_size_t get_used_block_num(void)
+static inline void set_discard_pending(block_size_t id, bool pending)
 {
-    pthread_rwlock_rdlock(&fatable_mem_lock);
-    block_size_t res = metadata.block_num - metadata.free_block_num;
-    pthread_rwlock_unlock(&fatable_mem_lock);
-    return res;
+    if (discard_pending != NULL && id < discard_pending_num) {
+        if (pending) {
+            discard_pending[id / 8] |= 1 << (id % 8);
+        } else {
+            discard_pending[id / 8] &= ~(1 << (id % 8));
+            wait_discard_locked(id);
+        }
+    }
 }
 
-void load_fatable(const char *path)
+/*
+    make the pending bitmap cover n blocks
+    caller should hold fatable_mem_lock for writing
+*/
+static void grow_discard_pending_locked(block_size_t n)
 {
-    ssize_t nbytes;
-    fatable_fd = open(path, O_RDWR);
-    if (fatable_fd == -1) {
-        if (errno == ENOENT) {
-            create_fatable(path);
-            return ;
-        } else {
-            perror("load_fatable() open");
-            exit(1);
-        }
+    if (discard_pending == NULL || n <= discard_pending_num) {
+        return ;
     }
-    if (lseek(fatable_fd, 0, SEEK_SET) == -1) {
-        perror("load_fatable() lseek");
+    size_t old_size = (discard_pending_num + 7) / 8, new_size = (n + 7) / 8;
+    uint8_t *new_pending = realloc(discard_pending, new_size);
+    pthread_mutex_lock(&discard_mutex);
+    uint8_t *new_inflight = realloc(discard_inflight, new_size);
+    if (new_pending == NULL || new_inflight == NULL) {
+        perror("grow_discard_pending_locked() realloc");
         exit(1);
     }
-    nbytes = read(fatable_fd, &metadata, sizeof(metadata));
-    if (nbytes == -1) {
-        perror("load_fatable() read");
-        exit(1);
-    } else if (nbytes < sizeof(metadata)) {
-        printerrf("load_fatable(): fatable file is broken");
-        exit(1);
+    memset(new_pending + old_size, 0, new_size - old_size);
+    memset(new_inflight + old_size, 0, new_size - old_size);
+    discard_pending = new_pending;
+    discard_inflight = new_inflight;
+    discard_pending_num = n;
+    pthread_mutex_unlock(&discard_mutex);
+}
+
+/*
+    wake the discard thread up if it punches freed blocks right away
+*/
+static void notify_discard(void)
+{
+    if (discard_policy == DISCARD_IMMEDIATE) {
+        pthread_mutex_lock(&discard_mutex);
+        discard_requested = true;
+        pthread_cond_signal(&discard_cond);
+        pthread_mutex_unlock(&discard_mutex);
     }
-    fatable = malloc(metadata.block_num * sizeof(blockid_data_t));
-    if (fatable == NULL) {
-        perror("load_fatable() malloc");
-        exit(1);
+}
+
+/*
+    until the first snapshot or reflink the physical map is NULL and a block is stored in the slot of its id,
+    afterwards phys[id] is the slot of the blockfile holding block `id`, SLOT_NONE if it has no data,
+    and slot_refs[slot] counts the references to the slot from the live map and every snapshot
+    it is never turned off, even once no slot is shared: that would move every block back to the slot of its id
+    protected by fatable_mem_lock
+*/
+static block_size_t *phys = NULL;// reserved like the fatable, a snapshot mount reads a plain copy
+static block_size_t phys_committed = 0;
+static uint16_t *slot_refs = NULL;
+static block_size_t slot_num = 0, slot_cap = 0;
+static block_size_t *free_slots = NULL;
+static block_size_t free_slot_num = 0;
+/*
+    write_block() holds it for reading from choosing a slot to writing it,
+    so a snapshot never shares a slot which is being written
+    priority: snapshot_lock > mem_lock
+*/
+static pthread_rwlock_t snapshot_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+bool volume_readonly = false;
+
+/*
+    a backing file of the volume, stripe i holds the slots of every stripe_count-th stripe unit from the i-th on
+    with more than one stripe, a worker thread does the I/O handed to it by read_blocks() and write_blocks()
+*/
+struct stripe {
+    int fd;
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct stripe_job *jobs;// waiting for the worker, protected by lock
+    struct stripe_job **jobs_tail;
+};
+static struct stripe stripes[MAX_STRIPE_COUNT];
+
+bool need_init_rootdir = false;
+int volume_block_size = DEFAULT_BLOCK_SIZE;
+int format_block_size = DEFAULT_BLOCK_SIZE;
+int volume_stripe_count = 1;
+int volume_stripe_unit = 1;
+int format_stripe_count = 1;
+int format_stripe_unit = DEFAULT_STRIPE_UNIT;
+size_t format_volume_size = 0;
+double grow_factor = MAGNIFICATION;
+size_t grow_chunk = 0;
+/*
+    slots the blockfile is fallocated up to by grow_blockfile()
+*/
+static block_size_t blockfile_reserved = 0;
+static pthread_mutex_t blockfile_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+    the fatable file starts with FATABLE_MAGIC and the metadata, then the entries, so does a snapshot file
+    a volume made before the block size was configurable has neither the magic nor block_size,
+    one made before striping has FATABLE_MAGIC_V1 and no stripe_count nor stripe_unit,
+    both keep their header, see header_kind
+*/
+#define FATABLE_MAGIC 0xfa7ab1e6u// never a block_num, which is at most BLOCK_COUNT_MAX
+#define FATABLE_MAGIC_V1 0xfa7ab1e5u
+#define LEGACY_HEADER_SIZE offsetof(struct fatable_metadata, block_size)
+#define LEGACY_BLOCK_SIZE 4096
+#define V1_HEADER_SIZE (sizeof(uint32_t) + offsetof(struct fatable_metadata, stripe_count))
+#define FATABLE_HEADER_MAX (sizeof(uint32_t) + sizeof(struct fatable_metadata))
+enum fatable_header_kind {
+    HEADER_LEGACY,
+    HEADER_V1,
+    HEADER_CURRENT,
+};
+static enum fatable_header_kind header_kind = HEADER_CURRENT;
+
+/*
+    the fatable as it was last written by sync_fatable(), to find the changed pages
+    protected by fatable_file_lock
+*/
+#define FATABLE_PAGE_ENTRIES (META_PAGE_SIZE / sizeof(blockid_data_t))
+static blockid_data_t *synced_fatable = NULL;
+static block_size_t synced_block_num = 0, synced_committed = 0;
+
+static bool read_full(int fd, void *buf, size_t len)
+{
+    for (size_t done = 0; done < len; ) {
+        ssize_t nbytes = read(fd, (uint8_t *) buf + done, len - done);
+        if (nbytes <= 0) {
+            return false;
+        }
+        done += nbytes;
     }
-    for (block_size_t i = 0; i < metadata.block_num; i++) {
-        nbytes = read(fatable_fd, fatable + i, sizeof(blockid_data_t));
-        if (nbytes == -1) {
-            perror("load_fatable() read");
-            exit(1);
-        } else if (nbytes < sizeof(blockid_data_t)) {
-            printerrf("load_fatable(): fatable file is broken");
-            exit(1);
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    for (size_t done = 0; done < len; ) {
+        ssize_t nbytes = write(fd, (const uint8_t *) buf + done, len - done);
+        if (nbytes <= 0) {
+            return false;
         }
+        done += nbytes;
     }
+    return true;
 }
 
-void create_fatable(const char *path)
+/*
+    reserve address space for a table of BLOCK_COUNT_MAX entries, none of them usable yet
+*/
+static void *reserve_table(size_t entry_size, block_size_t *committed)
 {
-    fatable_fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (fatable_fd == -1) {
-        perror("create_fatable() open");
+    void *table = mmap(NULL, (size_t) BLOCK_COUNT_MAX * entry_size, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("reserve_table() mmap");
         exit(1);
     }
-    metadata.block_num = INIT_BLOCK_NUM;
-    metadata.first_free_block_id = 1;// 0 is root directory file
-    metadata.free_block_num = metadata.block_num - 1;
-    fatable = malloc(metadata.block_num * sizeof(blockid_data_t));
-    fatable[0] = 0;// root dir, init with one block
-    for (block_size_t i = 1; i < metadata.block_num; i++) {
-        fatable[i] = i + 1;// point to the next block, so that they will be string into a chain
-    }
-    fatable[metadata.block_num -1] = metadata.block_num - 1;// end of the chain
-    sync_fatable();
+    *committed = 0;
+    return table;
 }
 
-void sync_fatable(void)
+/*
+    make the first n entries of a reserved table usable, whole segments at a time
+    *committed is the number of usable entries so far, the new ones read as zeros
+*/
+static void commit_table(void *table, size_t entry_size, block_size_t *committed, block_size_t n)
 {
-    pthread_rwlock_rdlock(&fatable_mem_lock);
-    pthread_mutex_lock(&fatable_file_lock);
-
-    if (lseek(fatable_fd, 0, SEEK_SET) == -1) {
-        perror("sync_fatable() lseek");
-        exit(1);
+    if (n <= *committed) {
+        return ;
     }
-    if (write(fatable_fd, &metadata, sizeof(metadata)) == -1) {
-        perror("sync_fatable() write");
+    size_t end = ((size_t) n + FAT_SEGMENT_BLOCKS - 1) / FAT_SEGMENT_BLOCKS * FAT_SEGMENT_BLOCKS;
+    end = end < BLOCK_COUNT_MAX ? end : BLOCK_COUNT_MAX;
+    if (mprotect((uint8_t *) table + *committed * entry_size, (end - *committed) * entry_size, PROT_READ | PROT_WRITE) == -1) {
+        perror("commit_table() mprotect");
         exit(1);
     }
-    for (block_size_t i = 0; i < metadata.block_num; i++) {
-        if (write(fatable_fd, fatable + i, sizeof(fatable[i])) == -1) {
-            perror("sync_fatable() write");
-            exit(1);
-        }
-    }
+    *committed = end;
+}
 
-    pthread_mutex_unlock(&fatable_file_lock);
-    pthread_rwlock_unlock(&fatable_mem_lock);
+/*
+    encode md as the header of a fatable or snapshot file, returns its size
+*/
+static size_t encode_fatable_header(const struct fatable_metadata *md, uint8_t *buf)
+{
+    if (header_kind == HEADER_LEGACY) {
+        memcpy(buf, md, LEGACY_HEADER_SIZE);
+        return LEGACY_HEADER_SIZE;
+    }
+    uint32_t magic = header_kind == HEADER_V1 ? FATABLE_MAGIC_V1 : FATABLE_MAGIC;
+    size_t len = header_kind == HEADER_V1 ? V1_HEADER_SIZE : FATABLE_HEADER_MAX;
+    memcpy(buf, &magic, sizeof(magic));
+    memcpy(buf + sizeof(magic), md, len - sizeof(magic));
+    return len;
 }
 
-block_size_t get_next_block_id(block_size_t id)
+/*
+    read the header of a fatable or snapshot file at the offset of fd
+    set kind to the header it has, a broken one is a failure
+*/
+static bool read_fatable_header(int fd, struct fatable_metadata *md, enum fatable_header_kind *kind)
 {
-    block_size_t res;
-    if (id >= metadata.block_num) {
-        printerrf("get_next_block_id(): block_id(%ud) out of range\n", (unsigned int) id);
-        exit(1);
+    uint32_t magic;
+    if (!read_full(fd, &magic, sizeof(magic))) {
+        return false;
     }
-    res = fatable[id];
-    if (res >= metadata.block_num) {
-        printerrf("get_next_block_id(): bad fatable[%ud]=%ud\n", (unsigned int) id, (unsigned int) res);
-        exit(1);
+    md->stripe_count = md->stripe_unit = 1;
+    if (magic != FATABLE_MAGIC && magic != FATABLE_MAGIC_V1) {
+        *kind = HEADER_LEGACY;
+        memcpy(md, &magic, sizeof(magic));
+        md->block_size = LEGACY_BLOCK_SIZE;
+        return read_full(fd, (uint8_t *) md + sizeof(magic), LEGACY_HEADER_SIZE - sizeof(magic));
     }
-    return res;
+    *kind = magic == FATABLE_MAGIC_V1 ? HEADER_V1 : HEADER_CURRENT;
+    size_t len = *kind == HEADER_V1 ? V1_HEADER_SIZE : FATABLE_HEADER_MAX;
+    return read_full(fd, md, len - sizeof(magic)) && block_size_valid(md->block_size)
+        && md->stripe_count >= 1 && md->stripe_count <= MAX_STRIPE_COUNT && md->stripe_unit >= 1;
 }
 
-block_size_t get_n_next_block_id(block_size_t id, size_t n)
+/*
+    size of the fatable header of the loaded volume
+*/
+static inline off_t fatable_header_size(void)
 {
-    pthread_rwlock_rdlock(&fatable_mem_lock);
+    return header_kind == HEADER_LEGACY ? LEGACY_HEADER_SIZE
+        : header_kind == HEADER_V1 ? V1_HEADER_SIZE : FATABLE_HEADER_MAX;
+}
 
-    block_size_t now_id = id, next_id;
-    while (n-- > 0) {
-        next_id = get_next_block_id(now_id);
-        if (next_id == now_id) {
-            printerrf("get_n_next_block_id(): do not have engouh block\n");
-            exit(1);
-        }
-        now_id = next_id;
+/*
+    the stripe holding a slot, *off is set to where the slot is in its file
+*/
+static inline struct stripe *locate_slot(block_size_t slot, off_t *off)
+{
+    if (volume_stripe_count == 1) {
+        *off = (off_t)slot * BLOCK_SIZE;
+        return stripes;
     }
+    block_size_t unit = volume_stripe_unit, chunk = slot / unit;
+    *off = ((off_t)(chunk / volume_stripe_count) * unit + slot % unit) * BLOCK_SIZE;
+    return stripes + chunk % volume_stripe_count;
+}
 
-    pthread_rwlock_unlock(&fatable_mem_lock);
-
-    return now_id;
+/*
+    number of the slots below `slots` held by stripe i, which are the first ones of its file
+    the slots of a stripe in any range of slots are consecutive in its file
+*/
+static inline block_size_t stripe_slots_below(int i, block_size_t slots)
+{
+    block_size_t unit = volume_stripe_unit, row = unit * volume_stripe_count;
+    block_size_t rest = slots % row, start = i * unit;
+    return slots / row * unit + (rest <= start ? 0 : rest - start < unit ? rest - start : unit);
 }
 
-void expand_fatable(void)
+/*
+    the slot stored at `index` slots into the file of stripe i
+*/
+static inline block_size_t stripe_slot_at(int i, block_size_t index)
 {
-    pthread_rwlock_wrlock(&fatable_mem_lock);
+    block_size_t unit = volume_stripe_unit;
+    return (index / unit * volume_stripe_count + i) * unit + index % unit;
+}
 
-    block_size_t new_block_num = metadata.block_num * MAGNIFICATION;
-    blockid_data_t *new_fatable = malloc(new_block_num * sizeof(blockid_data_t));
-    memcpy(new_fatable, fatable, metadata.block_num * sizeof(blockid_data_t));
-    free(fatable);
-    fatable = new_fatable;
-    for (block_size_t i = metadata.block_num; i < new_block_num; i++) {
-        fatable[i] = i + 1;// point to the next block, so that they will be string into a chain
+/*
+    fallocate(2) the space of the slots [start, start + n) in the files of their stripes
+*/
+static void fallocate_slots(block_size_t start, block_size_t n, int mode, const char *caller)
+{
+    for (int i = 0; i < volume_stripe_count; i++) {
+        block_size_t lo = stripe_slots_below(i, start), hi = stripe_slots_below(i, start + n);
+        if (hi > lo && fallocate(stripes[i].fd, mode, (off_t)lo * BLOCK_SIZE, (off_t)(hi - lo) * BLOCK_SIZE) == -1
+            && errno != EOPNOTSUPP) {
+            perror(caller);
+        }
     }
-    fatable[new_block_num - 1] = metadata.first_free_block_id;// end of the chain
-    metadata.first_free_block_id = metadata.block_num;// make first newly allocate block be the first of the chain
-    metadata.free_block_num += new_block_num - metadata.block_num;
-    metadata.block_num = new_block_num;
+}
 
+/*
+    fallocate the blockfile up to the blocks of the fatable rounded up to grow_chunk, if it is set
+    called without fatable_mem_lock after the fatable grew, the slots written meanwhile keep their data
+*/
+static void grow_blockfile(void)
+{
+    if (grow_chunk == 0 || volume_readonly) {
+        return ;
+    }
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    uint64_t chunk = grow_chunk > BLOCK_SIZE ? grow_chunk / BLOCK_SIZE : 1;
+    uint64_t target = ((uint64_t) metadata.block_num + chunk - 1) / chunk * chunk;
     pthread_rwlock_unlock(&fatable_mem_lock);
+    target = target < BLOCK_COUNT_MAX ? target : BLOCK_COUNT_MAX;
+    pthread_mutex_lock(&blockfile_grow_lock);
+    if (target > blockfile_reserved) {
+        NAIVE_PROBE2(grow_blockfile, blockfile_reserved, target);
+        fallocate_slots(blockfile_reserved, target - blockfile_reserved, 0, "grow_blockfile() fallocate");
+        blockfile_reserved = target;
+    }
+    pthread_mutex_unlock(&blockfile_grow_lock);
 }
 
-block_size_t acquire_block_chain(block_size_t size)
+/*
+    path of the file of stripe i of the blockfile in `path`, buf has strlen(path) + 16 bytes
+*/
+static void stripe_file_path(const char *path, int i, char *buf)
 {
-    block_size_t head, tail;
+    if (i == 0) {
+        strcpy(buf, path);
+    } else {
+        sprintf(buf, "%s.%d", path, i);
+    }
+}
 
-    pthread_rwlock_wrlock(&fatable_mem_lock);
+static void *stripe_thread(void *arg);
 
-    if (size == 0) {
-        printerrf("acquire_block_chain(): size is 0!\n");
-        exit(1);
-    } else if (size >= metadata.free_block_num) {
-        pthread_rwlock_unlock(&fatable_mem_lock);
-        expand_fatable();
-        pthread_rwlock_wrlock(&fatable_mem_lock);
+/*
+    open the files of every stripe of the loaded volume with `flags`, and start their workers if there are several
+*/
+static void open_stripes(const char *path, int flags)
+{
+    for (int i = 0; i < volume_stripe_count; i++) {
+        char stripe_path[strlen(path) + 16];
+        stripe_file_path(path, i, stripe_path);
+        stripes[i].fd = open(stripe_path, flags, S_IRUSR | S_IWUSR);
+        if (stripes[i].fd == -1) {
+            perror(stripe_path);
+            exit(1);
+        }
     }
-    head = tail = metadata.first_free_block_id;
-    for (block_size_t i = 1; i < size; i++) {
-        tail = get_next_block_id(tail);
+    for (int i = 0; volume_stripe_count > 1 && i < volume_stripe_count; i++) {
+        pthread_mutex_init(&stripes[i].lock, NULL);
+        pthread_cond_init(&stripes[i].cond, NULL);
+        stripes[i].jobs = NULL;
+        stripes[i].jobs_tail = &stripes[i].jobs;
+        if (pthread_create(&stripes[i].tid, NULL, stripe_thread, stripes + i) != 0) {
+            perror("open_stripes() pthread_create");
+            exit(1);
+        }
+        pthread_detach(stripes[i].tid);
     }
-    metadata.first_free_block_id = get_next_block_id(tail);
-    metadata.free_block_num -= size;
-    fatable[tail] = tail;// point to it self, mark it as the tail
+}
 
-    pthread_rwlock_unlock(&fatable_mem_lock);
+/*
+    number of slots up to the last one the files of the stripes hold
+*/
+static block_size_t blockfile_slots(void)
+{
+    block_size_t n = 0;
+    for (int i = 0; i < volume_stripe_count; i++) {
+        struct stat st;
+        if (fstat(stripes[i].fd, &st) == 0 && st.st_size > 0) {
+            block_size_t end = stripe_slot_at(i, (st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE - 1) + 1;
+            n = end > n ? end : n;
+        }
+    }
+    return n;
+}
 
-    return head;
+static inline ssize_t pread_home_slot(block_size_t slot, uint8_t *buf)
+{
+    off_t off;
+    struct stripe *stripe = locate_slot(slot, &off);
+    return pread(stripe->fd, buf, BLOCK_SIZE, off);
 }
 
-void release_block_chain(block_size_t head)
+/*
+    read a slot from the fast tier if it is there, else from its home
+*/
+static ssize_t pread_slot(block_size_t slot, uint8_t *buf)
 {
-    block_size_t tail = head, size = 1, next;
-    while((next = get_next_block_id(tail)) != tail) {
-        tail = next;
-        size++;
+    if (!tier_enabled) {
+        return pread_home_slot(slot, buf);
     }
-    fatable[tail] = metadata.first_free_block_id;
-    metadata.first_free_block_id = head;
-    metadata.free_block_num += size;
+    block_size_t fast;
+    tier_begin_io();
+    tier_route(&slot, 1, &fast, false);
+    ssize_t nbytes = BLOCK_SIZE;
+    if (fast != TIER_NONE) {
+        tier_io(&slot, &fast, 1, buf, false);
+    } else {
+        nbytes = pread_home_slot(slot, buf);
+    }
+    tier_end_io(&slot, &fast, 1, false);
+    return nbytes;
 }
 
-void cut_block_chain_at(block_size_t head, size_t n)
+/*
+    length of the run of consecutive slots at the head of slots[0, n)
+*/
+static size_t slot_run_len(const block_size_t *slots, size_t n)
 {
-    block_size_t tail = get_n_next_block_id(head, n - 1);
+    size_t len = 1;
+    while (len < n && slots[len] == slots[0] + len) {
+        len++;
+    }
+    return len;
+}
 
-    pthread_rwlock_wrlock(&fatable_mem_lock);
+/*
+    a range of a stripe file read or written at once, iov holds iovcnt buffers of read_blocks() or write_blocks()
+*/
+struct stripe_req {
+    off_t off;
+    struct iovec *iov;
+    int iovcnt;
+};
+
+/*
+    the I/O of a batch of read_blocks() or write_blocks(), the requests of stripe i are reqs[first[i], first[i + 1])
+    every buffer is at least a block, so IO_RUN_BLOCKS of each are enough
+*/
+struct stripe_io {
+    struct iovec iov[IO_RUN_BLOCKS];
+    struct stripe_req reqs[IO_RUN_BLOCKS];
+    int first[MAX_STRIPE_COUNT + 1];
+};
 
-    release_block_chain(get_next_block_id(tail));
-    fatable[tail] = tail;// let the chain 1 be tail
+/*
+    the requests of one stripe handed to its worker
+*/
+struct stripe_job {
+    struct stripe_req *reqs;
+    int req_num;
+    bool write;
+    struct stripe_batch *batch;
+    struct stripe_job *next;
+};
 
-    pthread_rwlock_unlock(&fatable_mem_lock);
-}
+/*
+    counts the jobs of a batch still running on the workers
+*/
+struct stripe_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;
+};
 
-void merge_block_chain(block_size_t head1, block_size_t head2)
+/*
+    plan the I/O of n blocks in buf stored in `slots`, those of SLOT_NONE are left out
+    the slots of a run of consecutive slots are consecutive in each stripe file, so a run is one request per stripe,
+    and so are several runs which follow each other there
+*/
+static void plan_stripe_io(struct stripe_io *io, const block_size_t *slots, size_t n, const uint8_t *buf)
 {
-    pthread_rwlock_wrlock(&fatable_mem_lock);
-
-    block_size_t tail1 = head1, next1;
-    while((next1 = get_next_block_id(tail1)) != tail1) {
-        tail1 = next1;
+    int iov_num = 0, req_num = 0;
+    block_size_t unit = volume_stripe_unit;
+    for (int s = 0; s < volume_stripe_count; s++) {
+        io->first[s] = req_num;
+        block_size_t end = SLOT_NONE;// where the last request of the stripe ends in its file
+        for (size_t i = 0; i < n; ) {
+            if (slots[i] == SLOT_NONE) {
+                i++;
+                continue;
+            }
+            size_t len = slot_run_len(slots + i, n - i);
+            block_size_t lo = stripe_slots_below(s, slots[i]), hi = stripe_slots_below(s, slots[i] + len);
+            if (hi > lo && lo != end) {
+                io->reqs[req_num++] = (struct stripe_req) {(off_t)lo * BLOCK_SIZE, io->iov + iov_num, 0};
+            }
+            for (block_size_t index = lo; index < hi; ) {
+                block_size_t piece = unit - index % unit < hi - index ? unit - index % unit : hi - index;
+                uint8_t *p = (uint8_t *) buf + (i + stripe_slot_at(s, index) - slots[i]) * BLOCK_SIZE;
+                struct stripe_req *req = io->reqs + req_num - 1;
+                struct iovec *last = req->iov + req->iovcnt - 1;
+                if (req->iovcnt > 0 && (uint8_t *) last->iov_base + last->iov_len == p) {
+                    last->iov_len += (size_t)piece * BLOCK_SIZE;
+                } else {
+                    io->iov[iov_num++] = (struct iovec) {p, (size_t)piece * BLOCK_SIZE};
+                    req->iovcnt++;
+                }
+                index += piece;
+            }
+            end = hi > lo ? hi : end;
+            i += len;
+        }
     }
-    fatable[tail1] = head2;
-
-    pthread_rwlock_unlock(&fatable_mem_lock);
+    io->first[volume_stripe_count] = req_num;
 }
 
-void open_blockfile(const char *path)
+/*
+    do the requests of a stripe, a read past the end of its file gives zeros
+*/
+static void run_stripe_reqs(struct stripe *stripe, struct stripe_req *reqs, int req_num, bool write)
 {
-    blockfile_fd = open(path, O_RDWR);
-    if (blockfile_fd == -1) {
-        if (errno == ENOENT) {
-            create_blockfile(path);
-        } else {
-            perror("open_blockfile() open");
-            exit(1);
+    for (int r = 0; r < req_num; r++) {
+        off_t off = reqs[r].off;
+        struct iovec *iov = reqs[r].iov;
+        int iovcnt = reqs[r].iovcnt;
+        while (iovcnt > 0) {
+            ssize_t nbytes = write ? pwritev(stripe->fd, iov, iovcnt, off) : preadv(stripe->fd, iov, iovcnt, off);
+            if (nbytes <= 0) {
+                if (write) {
+                    perror("write_blocks() pwritev");
+                    exit(1);
+                } else if (nbytes == -1) {
+                    perror("read_blocks() preadv");
+                }
+                for (; iovcnt > 0; iov++, iovcnt--) {
+                    memset(iov->iov_base, 0, iov->iov_len);
+                }
+                break;
+            }
+            off += nbytes;
+            for (; iovcnt > 0 && (size_t) nbytes >= iov->iov_len; iov++, iovcnt--) {
+                nbytes -= iov->iov_len;
+            }
+            if (nbytes > 0) {
+                iov->iov_base = (uint8_t *) iov->iov_base + nbytes;
+                iov->iov_len -= nbytes;
+            }
         }
     }
 }
 
-void create_blockfile(const char *path)
+static void *stripe_thread(void *arg)
 {
-    blockfile_fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (blockfile_fd == -1) {
-        perror("create_blockfile() open");
-        exit(1);
+    struct stripe *stripe = arg;
+    while (true) {
+        pthread_mutex_lock(&stripe->lock);
+        while (stripe->jobs == NULL) {
+            pthread_cond_wait(&stripe->cond, &stripe->lock);
+        }
+        struct stripe_job *job = stripe->jobs;
+        stripe->jobs = job->next;
+        if (stripe->jobs == NULL) {
+            stripe->jobs_tail = &stripe->jobs;
+        }
+        pthread_mutex_unlock(&stripe->lock);
+
+        run_stripe_reqs(stripe, job->reqs, job->req_num, job->write);
+        struct stripe_batch *batch = job->batch;
+        pthread_mutex_lock(&batch->lock);
+        if (--batch->pending == 0) {
+            pthread_cond_signal(&batch->cond);
+        }
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+/*
+    do the planned I/O, every stripe but one is handed to its worker if more than one has some,
+    the last one is done by the caller
+*/
+static void run_stripe_io(struct stripe_io *io, bool write)
+{
+    int busy = 0, last = 0;
+    for (int s = 0; s < volume_stripe_count; s++) {
+        if (io->first[s + 1] > io->first[s]) {
+            busy++;
+            last = s;
+        }
+    }
+    if (busy > 1) {
+        struct stripe_batch batch = {.pending = busy - 1};
+        struct stripe_job jobs[MAX_STRIPE_COUNT];
+        pthread_mutex_init(&batch.lock, NULL);
+        pthread_cond_init(&batch.cond, NULL);
+        for (int s = 0; s < last; s++) {
+            if (io->first[s + 1] == io->first[s]) {
+                continue;
+            }
+            jobs[s] = (struct stripe_job) {io->reqs + io->first[s], io->first[s + 1] - io->first[s], write, &batch, NULL};
+            pthread_mutex_lock(&stripes[s].lock);
+            *stripes[s].jobs_tail = jobs + s;
+            stripes[s].jobs_tail = &jobs[s].next;
+            pthread_cond_signal(&stripes[s].cond);
+            pthread_mutex_unlock(&stripes[s].lock);
+        }
+        run_stripe_reqs(stripes + last, io->reqs + io->first[last], io->first[last + 1] - io->first[last], write);
+        pthread_mutex_lock(&batch.lock);
+        while (batch.pending > 0) {
+            pthread_cond_wait(&batch.cond, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+        pthread_mutex_destroy(&batch.lock);
+        pthread_cond_destroy(&batch.cond);
+    } else if (busy == 1) {
+        run_stripe_reqs(stripes + last, io->reqs + io->first[last], io->first[last + 1] - io->first[last], write);
+    }
+}
+
+/*
+    make slot_refs cover n slots, and the blockfile n slots long
+    caller should hold fatable_mem_lock for writing
+*/
+static void grow_slots_locked(block_size_t n)
+{
+    if (n > slot_cap) {
+        block_size_t new_cap = slot_cap * MAGNIFICATION > n ? slot_cap * MAGNIFICATION : n;
+        uint16_t *new_refs = realloc(slot_refs, new_cap * sizeof(uint16_t));
+        block_size_t *new_free = realloc(free_slots, new_cap * sizeof(block_size_t));
+        if (new_refs == NULL || new_free == NULL) {
+            perror("grow_slots_locked() realloc");
+            exit(1);
+        }
+        memset(new_refs + slot_cap, 0, (new_cap - slot_cap) * sizeof(uint16_t));
+        slot_refs = new_refs;
+        free_slots = new_free;
+        slot_cap = new_cap;
+    }
+    if (n > slot_num) {
+        slot_num = n;
+        grow_discard_pending_locked(n);
+    }
+}
+
+/*
+    take a slot referenced once
+    caller should hold fatable_mem_lock for writing
+*/
+static block_size_t alloc_slot_locked(void)
+{
+    block_size_t slot;
+    if (free_slot_num > 0) {
+        slot = free_slots[--free_slot_num];
+    } else {
+        slot = slot_num;
+        grow_slots_locked(slot_num + 1);
+    }
+    slot_refs[slot] = 1;
+    set_discard_pending(slot, false);
+    return slot;
+}
+
+/*
+    drop a reference to a slot, it is freed with the last one
+    caller should hold fatable_mem_lock for writing
+*/
+static void put_slot_locked(block_size_t slot)
+{
+    if (--slot_refs[slot] == 0) {
+        free_slots[free_slot_num++] = slot;
+        set_discard_pending(slot, true);
+        writeback_drop(slot);
+        tier_drop(slot);
+    }
+}
+
+/*
+    count the references of a map to its slots
+    caller should hold fatable_mem_lock for writing
+*/
+static void count_slot_refs_locked(const block_size_t *map, block_size_t n)
+{
+    for (block_size_t id = 0; id < n; id++) {
+        if (map[id] != SLOT_NONE) {
+            grow_slots_locked(map[id] + 1);
+            slot_refs[map[id]]++;
+        }
+    }
+}
+
+/*
+    string every unreferenced slot into the free slots, lowest first out
+    caller should hold fatable_mem_lock for writing
+*/
+static void collect_free_slots_locked(void)
+{
+    free_slot_num = 0;
+    for (block_size_t slot = slot_num; slot-- > 0; ) {
+        if (slot_refs[slot] == 0) {
+            free_slots[free_slot_num++] = slot;
+        }
+    }
+}
+
+/*
+    switch from block ids to slots: every written block keeps the slot of its id
+    caller should hold fatable_mem_lock for writing
+*/
+static void enable_physical_map_locked(void)
+{
+    phys = reserve_table(sizeof(block_size_t), &phys_committed);
+    commit_table(phys, sizeof(block_size_t), &phys_committed, metadata.block_num);
+    for (block_size_t id = 0; id < metadata.block_num; id++) {
+        phys[id] = (fatable[id] & FAT_UNWRITTEN_FLAG) ? SLOT_NONE : id;
+    }
+    grow_slots_locked(metadata.block_num);
+    count_slot_refs_locked(phys, metadata.block_num);
+    collect_free_slots_locked();
+    fatable_generation++;// a compaction copying a run gives it up
+}
+
+/*
+    the block no longer holds data
+    its slot is released, or queued for discard without the physical map
+    caller should hold fatable_mem_lock for writing
+*/
+static inline void drop_block_data_locked(block_size_t id)
+{
+    if (phys == NULL) {
+        set_discard_pending(id, true);
+        writeback_drop(id);
+        tier_drop(id);
+    } else if (phys[id] != SLOT_NONE) {
+        put_slot_locked(phys[id]);
+        phys[id] = SLOT_NONE;
+    }
+}
+
+/*
+    a block taken from the free chain will be written, do not discard it
+    caller should hold fatable_mem_lock for writing
+*/
+static inline void claim_block_locked(block_size_t id)
+{
+    if (phys == NULL) {
+        set_discard_pending(id, false);
+    }
+}
+
+bool physical_map_enabled(void)
+{
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    bool res = phys != NULL;
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    return res;
+}
+
+/*
+    get next block id by current id
+    will exit if `id` and `fatable[id]` is out of range
+*/
+block_size_t get_next_block_id(block_size_t id);
+
+/*
+    set next block id of `id`, keep its unwritten flag
+*/
+static inline void set_next_block_id(block_size_t id, block_size_t next)
+{
+    fatable[id] = (fatable[id] & FAT_UNWRITTEN_FLAG) | next;
+}
+
+/*
+    release a block chian to the free block chain
+    caller should hold fatable_mem_lock for writing
+*/
+static void release_block_chain_locked(block_size_t head);
+
+/*
+    blocks acquired while a garbage scan is running, see begin_block_scan()
+    protected by fatable_mem_lock
+*/
+static uint8_t *scan_acquired = NULL;
+static block_size_t scan_block_num = 0;
+
+/*
+    taken by expand_fatable() around writing the new entries, so that one thread grows the fatable at a time,
+    and by compact_block_chains() while it truncates the blockfile
+    priority: block_map_lock > fatable_grow_lock > fatable_mem_lock
+*/
+static pthread_mutex_t fatable_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+    expand the fatable by at least min_new blocks, else by grow_factor but at most FAT_SEGMENT_BLOCKS,
+    only the new entries are written, the others stay in place
+    the entries past block_num are used by no one, so they are written before fatable_mem_lock is taken,
+    which then only covers linking them into the free chain
+    caller should not hold fatable_mem_lock, the new blocks may be taken by others before it takes it again
+*/
+static void expand_fatable(block_size_t min_new);
+
+/*
+    load the physical map of the live volume and count the references of every snapshot
+    nothing is done if there was never a snapshot
+*/
+static void load_physical_map(void);
+
+void init_block_module(void)
+{
+    pthread_rwlock_init(&fatable_mem_lock, NULL);
+    pthread_mutex_init(&fatable_file_lock, NULL);
+
+    load_fatable(FATABLE_FILENAME);
+    open_blockfile(BLOCKFILE_FILENAME);
+    open_tier(false);
+    load_physical_map();
+}
+
+void init_snapshot_block_module(const char *path)
+{
+    pthread_rwlock_init(&fatable_mem_lock, NULL);
+    pthread_mutex_init(&fatable_file_lock, NULL);
+
+    if (!read_snapshot(path, &metadata, &fatable, &phys)) {
+        printerrf("init_snapshot_block_module(): can not load snapshot %s\n", path);
+        exit(1);
+    }
+    volume_block_size = metadata.block_size;
+    volume_stripe_count = metadata.stripe_count;
+    volume_stripe_unit = metadata.stripe_unit;
+    volume_readonly = true;
+    open_stripes(BLOCKFILE_FILENAME, O_RDONLY);
+    open_tier(true);
+}
+
+block_size_t get_used_block_num(void)
+{
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    block_size_t res = metadata.block_num - metadata.free_block_num;
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    return res;
+}
+
+/*
+    hold an exclusive flock on the fatable while it is open, so that a mount and naivevfs-fsck
+    never work on the same volume at once
+*/
+static void lock_fatable(void)
+{
+    if (flock(fatable_fd, LOCK_EX | LOCK_NB) == -1) {
+        if (errno == EWOULDBLOCK) {
+            printerrf("lock_fatable(): the volume is in use\n");
+        } else {
+            perror("lock_fatable() flock");
+        }
+        exit(1);
+    }
+}
+
+bool volume_in_use(void)
+{
+    int fd = open(FATABLE_FILENAME, O_RDONLY);
+    if (fd == -1) {
+        return false;// no volume yet
+    }
+    bool busy = flock(fd, LOCK_EX | LOCK_NB) == -1 && errno == EWOULDBLOCK;
+    close(fd);
+    return busy;
+}
+
+void load_fatable(const char *path)
+{
+    fatable_fd = open(path, O_RDWR);
+    if (fatable_fd == -1) {
+        if (errno == ENOENT) {
+            create_fatable(path);
+            return ;
+        } else {
+            perror("load_fatable() open");
+            exit(1);
+        }
+    }
+    lock_fatable();
+    if (lseek(fatable_fd, 0, SEEK_SET) == -1) {
+        perror("load_fatable() lseek");
+        exit(1);
+    }
+    if (!read_fatable_header(fatable_fd, &metadata, &header_kind) || metadata.block_num == 0
+        || metadata.block_num > BLOCK_COUNT_MAX || metadata.free_block_num >= metadata.block_num
+        || metadata.first_free_block_id >= metadata.block_num) {
+        printerrf("load_fatable(): fatable file is broken\n");
+        exit(1);
+    }
+    volume_block_size = metadata.block_size;
+    volume_stripe_count = metadata.stripe_count;
+    volume_stripe_unit = metadata.stripe_unit;
+    fatable = reserve_table(sizeof(blockid_data_t), &fatable_committed);
+    commit_table(fatable, sizeof(blockid_data_t), &fatable_committed, metadata.block_num);
+    if (!read_full(fatable_fd, fatable, metadata.block_num * sizeof(blockid_data_t))) {
+        printerrf("load_fatable(): fatable file is broken\n");
+        exit(1);
+    }
+    synced_fatable = reserve_table(sizeof(blockid_data_t), &synced_committed);
+    commit_table(synced_fatable, sizeof(blockid_data_t), &synced_committed, metadata.block_num);
+    memcpy(synced_fatable, fatable, metadata.block_num * sizeof(blockid_data_t));
+    synced_block_num = metadata.block_num;
+}
+
+void create_fatable(const char *path)
+{
+    fatable_fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fatable_fd == -1) {
+        perror("create_fatable() open");
+        exit(1);
+    }
+    lock_fatable();
+    uint64_t presized = format_volume_size / format_block_size;
+    metadata.block_num = presized > BLOCK_COUNT_MAX ? BLOCK_COUNT_MAX : presized > INIT_BLOCK_NUM ? presized : INIT_BLOCK_NUM;
+    metadata.block_size = volume_block_size = format_block_size;
+    metadata.stripe_count = volume_stripe_count = format_stripe_count;
+    metadata.stripe_unit = volume_stripe_unit = format_stripe_unit > format_block_size ? format_stripe_unit / format_block_size : 1;
+    metadata.first_free_block_id = 1;// 0 is root directory file
+    metadata.free_block_num = metadata.block_num - 1;
+    fatable = reserve_table(sizeof(blockid_data_t), &fatable_committed);
+    commit_table(fatable, sizeof(blockid_data_t), &fatable_committed, metadata.block_num);
+    synced_fatable = reserve_table(sizeof(blockid_data_t), &synced_committed);
+    fatable[0] = FAT_UNWRITTEN_FLAG;// root dir, init with one block
+    for (block_size_t i = 1; i < metadata.block_num; i++) {
+        fatable[i] = (i + 1) | FAT_UNWRITTEN_FLAG;// point to the next block, so that they will be string into a chain
+    }
+    fatable[metadata.block_num -1] = (metadata.block_num - 1) | FAT_UNWRITTEN_FLAG;// end of the chain
+    sync_fatable();
+}
+
+void sync_fatable(void)
+{
+    if (volume_readonly) {
+        return ;
+    }
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    pthread_mutex_lock(&fatable_file_lock);
+
+    uint8_t header[FATABLE_HEADER_MAX];
+    size_t header_len = encode_fatable_header(&metadata, header);
+    if (pwrite(fatable_fd, header, header_len, 0) != header_len) {
+        perror("sync_fatable() write");
+        exit(1);
+    }
+    // only the pages changed since the last sync are written
+    commit_table(synced_fatable, sizeof(blockid_data_t), &synced_committed, metadata.block_num);
+    for (block_size_t start = 0; start < metadata.block_num; start += FATABLE_PAGE_ENTRIES) {
+        block_size_t n = metadata.block_num - start < FATABLE_PAGE_ENTRIES ? metadata.block_num - start : FATABLE_PAGE_ENTRIES;
+        size_t len = n * sizeof(blockid_data_t);
+        if (start + n <= synced_block_num && memcmp(fatable + start, synced_fatable + start, len) == 0) {
+            continue;
+        }
+        if (pwrite(fatable_fd, fatable + start, len, fatable_header_size() + (off_t)start * sizeof(blockid_data_t)) != len) {
+            perror("sync_fatable() write");
+            exit(1);
+        }
+        memcpy(synced_fatable + start, fatable + start, len);
+    }
+    synced_block_num = metadata.block_num;
+    // drop the entries left behind by a compaction
+    if (ftruncate(fatable_fd, fatable_header_size() + (off_t)metadata.block_num * sizeof(blockid_data_t)) == -1) {
+        perror("sync_fatable() ftruncate");
+    }
+    if (phys != NULL) {
+        int fd = open(BLOCKMAP_FILENAME, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd == -1 || !write_full(fd, phys, metadata.block_num * sizeof(block_size_t)) || fdatasync(fd) == -1) {
+            perror("sync_fatable() blockmap");
+            exit(1);
+        }
+        close(fd);
+    }
+
+    pthread_mutex_unlock(&fatable_file_lock);
+    pthread_rwlock_unlock(&fatable_mem_lock);
+}
+
+void flush_fatable(void)
+{
+    if (volume_readonly) {
+        return ;
+    }
+    pthread_mutex_lock(&fatable_file_lock);
+    if (fdatasync(fatable_fd) == -1) {
+        perror("flush_fatable() fdatasync");
+        exit(1);
+    }
+    pthread_mutex_unlock(&fatable_file_lock);
+}
+
+void flush_blockfile(void)
+{
+    if (volume_readonly) {
+        return ;
+    }
+    writeback_all();
+    if (tier_enabled) {
+        sync_tier();
+    } else {
+        sync_home_slots();
+    }
+}
+
+void sync_home_slots(void)
+{
+    for (int i = 0; i < volume_stripe_count; i++) {
+        if (fdatasync(stripes[i].fd) == -1) {
+            perror("sync_home_slots() fdatasync");
+            exit(1);
+        }
+    }
+}
+
+block_size_t get_next_block_id(block_size_t id)
+{
+    block_size_t res;
+    if (id >= metadata.block_num) {
+        printerrf("get_next_block_id(): block_id(%ud) out of range\n", (unsigned int) id);
+        exit(1);
+    }
+    res = fatable[id] & FAT_NEXT_MASK;
+    if (res >= metadata.block_num) {
+        printerrf("get_next_block_id(): bad fatable[%ud]=%ud\n", (unsigned int) id, (unsigned int) res);
+        exit(1);
+    }
+    return res;
+}
+
+block_size_t get_n_next_block_id(block_size_t id, size_t n)
+{
+    NAIVE_PROBE2(get_n_next_block_id_entry, id, n);
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+
+    block_size_t now_id = id, next_id;
+    for (size_t i = 0; i < n; i++) {
+        next_id = get_next_block_id(now_id);
+        if (next_id == now_id) {
+            printerrf("get_n_next_block_id(): do not have engouh block\n");
+            exit(1);
+        }
+        now_id = next_id;
+    }
+
+    pthread_rwlock_unlock(&fatable_mem_lock);
+
+    NAIVE_PROBE3(get_n_next_block_id_return, id, now_id, n);
+    return now_id;
+}
+
+/*
+    write the entries [from, to) of a growing fatable, and of the physical map if `mapped` is set,
+    as a run of free blocks each linking to the next one
+*/
+static void init_fatable_entries(block_size_t from, block_size_t to, bool mapped)
+{
+    commit_table(fatable, sizeof(blockid_data_t), &fatable_committed, to);
+    for (block_size_t i = from; i < to; i++) {
+        fatable[i] = (i + 1) | FAT_UNWRITTEN_FLAG;// point to the next block, so that they will be string into a chain
+    }
+    if (mapped) {
+        commit_table(phys, sizeof(block_size_t), &phys_committed, to);
+        for (block_size_t i = from; i < to; i++) {
+            phys[i] = SLOT_NONE;
+        }
+    }
+}
+
+static void expand_fatable(block_size_t min_new)
+{
+    pthread_mutex_lock(&fatable_grow_lock);
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    block_size_t old_block_num = metadata.block_num;
+    bool mapped = phys != NULL;
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    NAIVE_PROBE2(expand_fatable_entry, old_block_num, min_new);
+    uint64_t new_block_num = (uint64_t) (old_block_num * grow_factor);
+    if (new_block_num > (uint64_t) old_block_num + FAT_SEGMENT_BLOCKS) {
+        new_block_num = (uint64_t) old_block_num + FAT_SEGMENT_BLOCKS;
+    }
+    if (new_block_num < (uint64_t) old_block_num + min_new) {
+        new_block_num = (uint64_t) old_block_num + min_new;
+    }
+    if (new_block_num > BLOCK_COUNT_MAX) {
+        printerrf("expand_fatable(): block number exceeds %u\n", (unsigned int) BLOCK_COUNT_MAX);
+        exit(1);
+    }
+    init_fatable_entries(old_block_num, new_block_num, mapped);
+
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    if (metadata.block_num < old_block_num || (phys != NULL) != mapped) {
+        // compact_block_chains() cut the tail, or a snapshot mapped the blocks meanwhile
+        init_fatable_entries(metadata.block_num, new_block_num, phys != NULL);
+    }
+    fatable[new_block_num - 1] = metadata.first_free_block_id | FAT_UNWRITTEN_FLAG;// end of the chain
+    if (phys == NULL) {
+        grow_discard_pending_locked(new_block_num);
+        for (block_size_t i = metadata.block_num; i < new_block_num; i++) {
+            set_discard_pending(i, false);// fresh blocks were never written
+        }
+    }
+    metadata.first_free_block_id = metadata.block_num;// make first newly allocate block be the first of the chain
+    metadata.free_block_num += new_block_num - metadata.block_num;
+    metadata.block_num = new_block_num;
+    fatable_generation++;
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    pthread_mutex_unlock(&fatable_grow_lock);
+    NAIVE_PROBE1(expand_fatable_return, new_block_num);
+}
+
+static inline void mark_scan_acquired(block_size_t id)
+{
+    if (scan_acquired != NULL && id < scan_block_num) {
+        scan_acquired[id / 8] |= 1 << (id % 8);
+    }
+}
+
+/*
+    take `size` blocks from the head of the free chain and mark them unwritten
+    caller should hold fatable_mem_lock for writing
+*/
+static block_size_t take_free_blocks(block_size_t size)
+{
+    block_size_t head, tail;
+    head = tail = metadata.first_free_block_id;
+    fatable[tail] |= FAT_UNWRITTEN_FLAG;
+    mark_scan_acquired(tail);
+    claim_block_locked(tail);
+    for (block_size_t i = 1; i < size; i++) {
+        tail = get_next_block_id(tail);
+        fatable[tail] |= FAT_UNWRITTEN_FLAG;
+        mark_scan_acquired(tail);
+        claim_block_locked(tail);
+    }
+    metadata.first_free_block_id = get_next_block_id(tail);
+    metadata.free_block_num -= size;
+    set_next_block_id(tail, tail);// point to it self, mark it as the tail
+    fatable_generation++;
+    return head;
+}
+
+block_size_t acquire_block_chain(block_size_t size)
+{
+    block_size_t head;
+
+    NAIVE_PROBE1(acquire_block_chain_entry, size);
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+
+    if (size == 0) {
+        printerrf("acquire_block_chain(): size is 0!\n");
+        exit(1);
+    }
+    bool expanded = false;
+    while (size >= metadata.free_block_num) {
+        block_size_t min_new = size - metadata.free_block_num + 1;
+        pthread_rwlock_unlock(&fatable_mem_lock);
+        expand_fatable(min_new);
+        pthread_rwlock_wrlock(&fatable_mem_lock);
+        expanded = true;
+    }
+    head = take_free_blocks(size);
+
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    if (expanded) {
+        grow_blockfile();
+    }
+
+    NAIVE_PROBE2(acquire_block_chain_return, head, size);
+    return head;
+}
+
+void presize_fatable(block_size_t size)
+{
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    bool expanded = size >= metadata.free_block_num;
+    block_size_t min_new = expanded ? size - metadata.free_block_num + 1 : 0;
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    if (expanded) {
+        expand_fatable(min_new);
+        grow_blockfile();
+    }
+}
+
+block_size_t acquire_contiguous_block_chain(block_size_t size)
+{
+    block_size_t head, id, next;
+
+    NAIVE_PROBE1(acquire_contiguous_block_chain_entry, size);
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+
+    if (size == 0) {
+        printerrf("acquire_contiguous_block_chain(): size is 0!\n");
+        exit(1);
+    }
+    // a fresh expansion puts a consecutive run at the head of the free chain
+    bool contiguous = false, expanded = false;
+    while (!contiguous) {
+        contiguous = size < metadata.free_block_num;
+        id = metadata.first_free_block_id;
+        for (block_size_t i = 1; contiguous && i < size; i++) {
+            next = get_next_block_id(id);
+            contiguous = next == id + 1;
+            id = next;
+        }
+        if (!contiguous) {
+            // others may take blocks of the new run before the lock is taken again
+            pthread_rwlock_unlock(&fatable_mem_lock);
+            expand_fatable(size + 1);
+            pthread_rwlock_wrlock(&fatable_mem_lock);
+            expanded = true;
+        }
+    }
+    head = take_free_blocks(size);
+
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    if (expanded) {
+        grow_blockfile();
+    }
+
+    NAIVE_PROBE3(acquire_contiguous_block_chain_return, head, size, !expanded);
+    return head;
+}
+
+static void release_block_chain_locked(block_size_t head)
+{
+    block_size_t tail = head, size = 1, next;
+    fatable[tail] |= FAT_UNWRITTEN_FLAG;
+    drop_block_data_locked(tail);
+    while((next = get_next_block_id(tail)) != tail) {
+        tail = next;
+        fatable[tail] |= FAT_UNWRITTEN_FLAG;
+        drop_block_data_locked(tail);
+        size++;
+    }
+    set_next_block_id(tail, metadata.first_free_block_id);
+    metadata.first_free_block_id = head;
+    metadata.free_block_num += size;
+    fatable_generation++;
+}
+
+void release_block_chain(block_size_t head)
+{
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    release_block_chain_locked(head);
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    notify_discard();
+}
+
+void cut_block_chain_at(block_size_t head, size_t n)
+{
+    block_size_t tail = get_n_next_block_id(head, n - 1);
+
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+
+    release_block_chain_locked(get_next_block_id(tail));
+    set_next_block_id(tail, tail);// let the chain 1 be tail
+
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    notify_discard();
+}
+
+void merge_block_chain(block_size_t head1, block_size_t head2)
+{
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+
+    block_size_t tail1 = head1, next1;
+    while((next1 = get_next_block_id(tail1)) != tail1) {
+        tail1 = next1;
+    }
+    set_next_block_id(tail1, head2);
+    fatable_generation++;
+
+    pthread_rwlock_unlock(&fatable_mem_lock);
+}
+
+block_size_t begin_block_scan(uint8_t **reachable)
+{
+    pthread_mutex_lock(&maintenance_lock);
+    // a chain acquired before the scan is linked to an opened file once the foreground lets go of the block map,
+    // one acquired from now on is recorded in scan_acquired until end_block_scan()
+    pthread_rwlock_wrlock(&block_map_lock);
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    scan_block_num = metadata.block_num;
+    size_t bitmap_size = (scan_block_num + 7) / 8;
+    scan_acquired = calloc(bitmap_size, 1);
+    *reachable = calloc(bitmap_size, 1);
+    if (scan_acquired == NULL || *reachable == NULL) {
+        perror("begin_block_scan() calloc");
+        exit(1);
+    }
+    block_size_t res = scan_block_num;
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    pthread_rwlock_unlock(&block_map_lock);
+    return res;
+}
+
+block_size_t mark_block_chain(block_size_t head, uint8_t *reachable, block_size_t n, bool through)
+{
+    block_size_t id = head, next, count = 0;
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    for (block_size_t steps = 0; id < n && steps < n; steps++) {
+        if (reachable[id / 8] & (1 << (id % 8))) {
+            if (!through) {
+                break;
+            }
+        } else {
+            reachable[id / 8] |= 1 << (id % 8);
+            count++;
+        }
+        next = get_next_block_id(id);
+        if (next == id) {
+            break;
+        }
+        id = next;
+    }
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    return count;
+}
+
+static inline bool test_and_set_bit(uint8_t *bitmap, block_size_t id)
+{
+    uint8_t bit = 1 << (id % 8);
+    return __atomic_fetch_or(bitmap + id / 8, bit, __ATOMIC_RELAXED) & bit;
+}
+
+block_size_t check_fatable_range(block_size_t start, block_size_t end, block_size_t *first_bad)
+{
+    block_size_t bad = 0;
+    *first_bad = BLOCK_ID_NONE;
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    for (block_size_t id = start; id < end; id++) {
+        if ((fatable[id] & FAT_NEXT_MASK) >= metadata.block_num && bad++ == 0) {
+            *first_bad = id;
+        }
+    }
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    return bad;
+}
+
+block_size_t claim_block_chain(block_size_t head, uint8_t *owned, bool *broken)
+{
+    block_size_t id = head, next, count = 0;
+    *broken = false;
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    while (true) {
+        if (id >= metadata.block_num || test_and_set_bit(owned, id)) {
+            *broken = true;
+            break;
+        }
+        count++;
+        next = fatable[id] & FAT_NEXT_MASK;
+        if (next == id) {
+            break;
+        }
+        id = next;
+    }
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    return count;
+}
+
+void get_fatable_metadata(struct fatable_metadata *md)
+{
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    *md = metadata;
+    pthread_rwlock_unlock(&fatable_mem_lock);
+}
+
+block_size_t end_block_scan(uint8_t *reachable, block_size_t n)
+{
+    block_size_t id, next, reclaimed = 0, free_num = 1;
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    // everything in the free chain is accounted for
+    id = metadata.first_free_block_id;
+    while (true) {
+        if (id < n) {
+            reachable[id / 8] |= 1 << (id % 8);
+        }
+        next = get_next_block_id(id);
+        if (next == id) {
+            break;
+        }
+        id = next;
+        free_num++;
+    }
+    if (free_num != metadata.free_block_num) {
+        printerrf("end_block_scan(): %u free blocks counted as %u\n", (unsigned int) free_num,
+            (unsigned int) metadata.free_block_num);
+        metadata.free_block_num = free_num;
+        fatable_generation++;
+    }
+    for (id = 0; id < n; id++) {
+        uint8_t bit = 1 << (id % 8);
+        if ((reachable[id / 8] & bit) || (scan_acquired[id / 8] & bit)) {
+            continue;
+        }
+        fatable[id] = metadata.first_free_block_id | FAT_UNWRITTEN_FLAG;
+        metadata.first_free_block_id = id;
+        metadata.free_block_num++;
+        drop_block_data_locked(id);
+        reclaimed++;
+    }
+    if (reclaimed > 0) {
+        fatable_generation++;
+    }
+    free(scan_acquired);
+    scan_acquired = NULL;
+    scan_block_num = 0;
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    pthread_mutex_unlock(&maintenance_lock);
+    free(reachable);
+    if (reclaimed > 0) {
+        notify_discard();
+    }
+    return reclaimed;
+}
+
+/*
+    call fallocate() with `mode` on the blockfile for n blocks of a chain,
+    consecutive block ids are merged into one range
+    if `unwritten` is set, mark the blocks as unwritten first
+*/
+static void fallocate_block_chain(block_size_t head, size_t n, int mode, bool unwritten)
+{
+    block_size_t run_start, run_len, id = head;
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    if (phys != NULL) {
+        // slots may be shared with snapshots, they are released and discarded once unreferenced
+        for (; unwritten && n > 0; n--) {
+            fatable[id] |= FAT_UNWRITTEN_FLAG;
+            drop_block_data_locked(id);
+            block_size_t next = get_next_block_id(id);
+            if (next == id) {
+                break;
+            }
+            id = next;
+        }
+        pthread_rwlock_unlock(&fatable_mem_lock);
+        notify_discard();
+        return ;
+    }
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    while (n > 0) {
+        pthread_rwlock_wrlock(&fatable_mem_lock);
+        run_start = id;
+        run_len = 0;
+        while (n > 0) {
+            if (unwritten) {
+                fatable[id] |= FAT_UNWRITTEN_FLAG;
+                writeback_drop(id);// not to write it back over the hole
+                tier_drop(id);
+            }
+            run_len++;
+            n--;
+            block_size_t next = get_next_block_id(id);
+            if (n == 0 || next == id) {
+                n = 0;
+                break;
+            }
+            id = next;
+            if (id != run_start + run_len) {
+                break;
+            }
+        }
+        pthread_rwlock_unlock(&fatable_mem_lock);
+
+        fallocate_slots(run_start, run_len, mode, "fallocate_block_chain() fallocate");
+    }
+}
+
+void punch_block_chain(block_size_t head, size_t n)
+{
+    fallocate_block_chain(head, n, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, true);
+}
+
+void reserve_block_chain(block_size_t head, size_t n)
+{
+    fallocate_block_chain(head, n, 0, false);
+}
+
+void open_blockfile(const char *path)
+{
+    if (access(path, F_OK) == -1 && errno == ENOENT) {
+        create_blockfile(path);
+    } else {
+        open_stripes(path, O_RDWR);
+        blockfile_reserved = blockfile_slots();
+    }
+}
+
+void create_blockfile(const char *path)
+{
+    open_stripes(path, O_RDWR | O_CREAT);
+    need_init_rootdir = true;
+    blockfile_reserved = 0;
+    if (format_volume_size > 0) {
+        fallocate_slots(0, metadata.block_num, 0, "create_blockfile() fallocate");
+        blockfile_reserved = metadata.block_num;
+    }
+    grow_blockfile();
+}
+
+void remove_blockfile(const char *path)
+{
+    for (int i = 0; i < volume_stripe_count; i++) {
+        char stripe_path[strlen(path) + 16];
+        stripe_file_path(path, i, stripe_path);
+        unlink(stripe_path);
+    }
+}
+
+/*
+    check if the block holds no data
+*/
+static bool block_unwritten(block_size_t id)
+{
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    bool res = id < metadata.block_num && (fatable[id] & FAT_UNWRITTEN_FLAG);
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    return res;
+}
+
+/*
+    get the slot holding the data of a block
+    returns false if it holds no data
+*/
+static bool block_slot(block_size_t id, block_size_t *slot)
+{
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    bool res = id < metadata.block_num && !(fatable[id] & FAT_UNWRITTEN_FLAG);
+    *slot = phys == NULL ? id : phys[id];
+    res = res && *slot != SLOT_NONE;
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    return res;
+}
+
+/*
+    get the slot to write a block to, a slot shared with a snapshot is never written:
+    the block gets a slot of its own, whole blocks are written so nothing is copied
+    caller should hold snapshot_lock for reading
+*/
+static block_size_t writable_slot(block_size_t id)
+{
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    block_size_t slot = phys == NULL ? id : phys[id];
+    bool owned = phys == NULL || (slot != SLOT_NONE && slot_refs[slot] == 1);
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    if (owned) {
+        return slot;
+    }
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    slot = phys[id];
+    if (slot == SLOT_NONE || slot_refs[slot] > 1) {
+        if (slot != SLOT_NONE) {
+            put_slot_locked(slot);
+        }
+        slot = alloc_slot_locked();
+        phys[id] = slot;
+        NAIVE_PROBE2(cow_block, id, slot);
+    }
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    return slot;
+}
+
+/*
+    the block buffers of a thread, bufs[depth] is the next one taken
+*/
+struct block_bufs {
+    uint8_t *bufs[BLOCK_BUF_DEPTH];
+    size_t sizes[BLOCK_BUF_DEPTH];
+    unsigned int depth;
+};
+static pthread_key_t block_bufs_key;
+static pthread_once_t block_bufs_once = PTHREAD_ONCE_INIT;
+static __thread struct block_bufs *local_block_bufs = NULL;
+
+static void free_block_bufs(void *p)
+{
+    struct block_bufs *bb = p;
+    for (int i = 0; i < BLOCK_BUF_DEPTH; i++) {
+        free(bb->bufs[i]);
+    }
+    free(bb);
+}
+
+static void create_block_bufs_key(void)
+{
+    pthread_key_create(&block_bufs_key, free_block_bufs);
+}
+
+uint8_t *take_block_buf(void)
+{
+    struct block_bufs *bb = local_block_bufs;
+    if (bb == NULL) {
+        pthread_once(&block_bufs_once, create_block_bufs_key);
+        bb = local_block_bufs = calloc(1, sizeof(struct block_bufs));
+        if (bb == NULL) {
+            perror("take_block_buf() calloc");
+            exit(1);
+        }
+        pthread_setspecific(block_bufs_key, bb);
+    }
+    unsigned int depth = bb->depth++;
+    if (depth >= BLOCK_BUF_DEPTH) {
+        uint8_t *buf = malloc(BLOCK_SIZE);// nested deeper than expected, given back to free()
+        if (buf == NULL) {
+            perror("take_block_buf() malloc");
+            exit(1);
+        }
+        return buf;
+    }
+    if (bb->sizes[depth] < BLOCK_SIZE) {
+        free(bb->bufs[depth]);
+        bb->bufs[depth] = malloc(BLOCK_SIZE);
+        if (bb->bufs[depth] == NULL) {
+            perror("take_block_buf() malloc");
+            exit(1);
+        }
+        bb->sizes[depth] = BLOCK_SIZE;
+    }
+    return bb->bufs[depth];
+}
+
+void put_block_buf(uint8_t *buf)
+{
+    if (--local_block_bufs->depth >= BLOCK_BUF_DEPTH) {
+        free(buf);
     }
-    need_init_rootdir = true;
 }
 
 void read_block(block_size_t id, uint8_t *buf)
 {
-    int nbytes = pread(blockfile_fd, buf, BLOCK_SIZE, (off_t)id * BLOCK_SIZE);
+    struct stats_timer timer;
+    stats_begin(&timer);
+    NAIVE_PROBE1(read_block_entry, id);
+    block_size_t slot;
+    if (!block_slot(id, &slot)) {
+        memset(buf, 0, BLOCK_SIZE);
+        stats_end(&timer, STATS_OP_READ_BLOCK);
+        NAIVE_PROBE2(read_block_return, id, 0);
+        return ;
+    }
+    int nbytes = writeback_read(slot, buf) ? BLOCK_SIZE : pread_slot(slot, buf);
+    if (nbytes == -1) {
+        perror("read_block() pread");
+    } else if (nbytes < BLOCK_SIZE) {
+        memset(buf + nbytes, 0, BLOCK_SIZE - nbytes);
+    }
+    stats_end(&timer, STATS_OP_READ_BLOCK);
+    NAIVE_PROBE2(read_block_return, id, nbytes);
+}
+
+/*
+    count a write of block `id` done, if compact_block_chains() is copying it
+*/
+static inline void note_block_write(block_size_t id)
+{
+    if (id < __atomic_load_n(&moving_end, __ATOMIC_SEQ_CST) && id >= __atomic_load_n(&moving_start, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&moving_writes, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void write_block(block_size_t id, const uint8_t *buf)
+{
+    struct stats_timer timer;
+    stats_begin(&timer);
+    NAIVE_PROBE1(write_block_entry, id);
+    if (volume_readonly) {
+        printerrf("write_block(): volume is read-only\n");
+        return ;
+    }
+    writeback_throttle();
+    pthread_rwlock_rdlock(&snapshot_lock);
+    block_size_t slot = writable_slot(id);
+    if (!writeback_write(slot, buf)) {
+        write_slot(slot, buf);
+    }
+    note_block_write(id);
+    if (block_unwritten(id)) {
+        pthread_rwlock_wrlock(&fatable_mem_lock);
+        fatable[id] &= ~FAT_UNWRITTEN_FLAG;
+        pthread_rwlock_unlock(&fatable_mem_lock);
+    }
+    pthread_rwlock_unlock(&snapshot_lock);
+    stats_end(&timer, STATS_OP_WRITE_BLOCK);
+    NAIVE_PROBE1(write_block_return, id);
+}
+
+void write_slot(block_size_t slot, const uint8_t *buf)
+{
+    if (!tier_enabled) {
+        write_home_slot(slot, buf);
+        return ;
+    }
+    block_size_t fast;
+    tier_begin_io();
+    tier_route(&slot, 1, &fast, true);
+    if (fast != TIER_NONE) {
+        tier_io(&slot, &fast, 1, (uint8_t *) buf, true);
+    } else {
+        write_home_slot(slot, buf);
+    }
+    tier_end_io(&slot, &fast, 1, true);
+}
+
+void read_home_slot(block_size_t slot, uint8_t *buf)
+{
+    ssize_t nbytes = pread_home_slot(slot, buf);
     if (nbytes == -1) {
-        perror("read_block() pread");
-    } else if (nbytes < BLOCK_SIZE) {
+        perror("read_home_slot() pread");
+        nbytes = 0;
+    }
+    if (nbytes < BLOCK_SIZE) {
         memset(buf + nbytes, 0, BLOCK_SIZE - nbytes);
     }
 }
 
-void write_block(block_size_t id, const uint8_t *buf)
+void write_home_slot(block_size_t slot, const uint8_t *buf)
+{
+    off_t off;
+    struct stripe *stripe = locate_slot(slot, &off);
+    if (pwrite(stripe->fd, buf, BLOCK_SIZE, off) == -1) {
+        perror("write_home_slot() pwrite");
+        exit(1);
+    }
+}
+
+/*
+    follow a chain for n blocks from `id`, recording their ids and their slots, SLOT_NONE if unwritten
+    returns the block after the last one, the last one itself at the end of the chain
+    caller should hold fatable_mem_lock
+*/
+static block_size_t gather_chain_locked(block_size_t id, size_t n, block_size_t *ids, block_size_t *slots)
+{
+    for (size_t i = 0; i < n; i++) {
+        ids[i] = id;
+        slots[i] = (fatable[id] & FAT_UNWRITTEN_FLAG) ? SLOT_NONE : phys == NULL ? id : phys[id];
+        block_size_t next = get_next_block_id(id);
+        if (next == id && i + 1 < n) {
+            printerrf("gather_chain_locked(): do not have enough block\n");
+            exit(1);
+        }
+        id = next;
+    }
+    return id;
+}
+
+/*
+    read or write the n slots of buf, SLOT_NONE ones are skipped
+    the slots on the fast tier are done there, the others at home run by run, the stripes in parallel
+*/
+static void run_slots_io(const block_size_t *slots, size_t n, uint8_t *buf, bool write)
+{
+    struct stripe_io io;
+    if (!tier_enabled) {
+        plan_stripe_io(&io, slots, n, buf);
+        run_stripe_io(&io, write);
+        return ;
+    }
+    block_size_t fast[IO_RUN_BLOCKS], home[IO_RUN_BLOCKS];
+    tier_begin_io();
+    tier_route(slots, n, fast, write);
+    for (size_t i = 0; i < n; i++) {
+        home[i] = fast[i] == TIER_NONE ? slots[i] : SLOT_NONE;
+    }
+    tier_io(slots, fast, n, buf, write);
+    plan_stripe_io(&io, home, n, buf);
+    run_stripe_io(&io, write);
+    tier_end_io(slots, fast, n, write);
+}
+
+block_size_t read_blocks(block_size_t id, size_t n, uint8_t *buf)
+{
+    struct stats_timer timer;
+    stats_begin(&timer);
+    NAIVE_PROBE2(read_blocks_entry, id, n);
+    block_size_t ids[IO_RUN_BLOCKS], slots[IO_RUN_BLOCKS];
+    while (n > 0) {
+        size_t batch = n < IO_RUN_BLOCKS ? n : IO_RUN_BLOCKS;
+        pthread_rwlock_rdlock(&fatable_mem_lock);
+        id = gather_chain_locked(id, batch, ids, slots);
+        pthread_rwlock_unlock(&fatable_mem_lock);
+        // blocks held by writeback are taken from it first, the others are read by run_slots_io()
+        for (size_t i = 0; i < batch; i++) {
+            if (slots[i] == SLOT_NONE) {
+                memset(buf + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+            } else if (writeback_read(slots[i], buf + i * BLOCK_SIZE)) {
+                slots[i] = SLOT_NONE;
+            }
+        }
+        run_slots_io(slots, batch, buf, false);
+        buf += batch * BLOCK_SIZE;
+        n -= batch;
+    }
+    stats_end(&timer, STATS_OP_READ_BLOCKS);
+    NAIVE_PROBE1(read_blocks_return, id);
+    return id;
+}
+
+block_size_t write_blocks(block_size_t id, size_t n, const uint8_t *buf)
+{
+    struct stats_timer timer;
+    stats_begin(&timer);
+    NAIVE_PROBE2(write_blocks_entry, id, n);
+    if (volume_readonly) {
+        printerrf("write_blocks(): volume is read-only\n");
+        return id;
+    }
+    block_size_t ids[IO_RUN_BLOCKS], slots[IO_RUN_BLOCKS];
+    while (n > 0) {
+        size_t batch = n < IO_RUN_BLOCKS ? n : IO_RUN_BLOCKS;
+        bool unwritten = false;
+        writeback_throttle();
+        pthread_rwlock_rdlock(&snapshot_lock);
+        pthread_rwlock_rdlock(&fatable_mem_lock);
+        id = gather_chain_locked(id, batch, ids, slots);
+        pthread_rwlock_unlock(&fatable_mem_lock);
+        for (size_t i = 0; i < batch; i++) {
+            unwritten = unwritten || slots[i] == SLOT_NONE;
+            slots[i] = writable_slot(ids[i]);
+            if (writeback_write(slots[i], buf + i * BLOCK_SIZE)) {
+                slots[i] = SLOT_NONE;
+            }
+        }
+        run_slots_io(slots, batch, (uint8_t *) buf, true);
+        for (size_t i = 0; i < batch; i++) {
+            note_block_write(ids[i]);
+        }
+        if (unwritten) {
+            pthread_rwlock_wrlock(&fatable_mem_lock);
+            for (size_t i = 0; i < batch; i++) {
+                fatable[ids[i]] &= ~FAT_UNWRITTEN_FLAG;
+            }
+            pthread_rwlock_unlock(&fatable_mem_lock);
+        }
+        pthread_rwlock_unlock(&snapshot_lock);
+        buf += batch * BLOCK_SIZE;
+        n -= batch;
+    }
+    stats_end(&timer, STATS_OP_WRITE_BLOCKS);
+    NAIVE_PROBE1(write_blocks_return, id);
+    return id;
+}
+
+void lock_block_map(bool exclusive)
+{
+    if (exclusive) {
+        pthread_rwlock_wrlock(&block_map_lock);
+    } else {
+        pthread_rwlock_rdlock(&block_map_lock);
+    }
+}
+
+void unlock_block_map(void)
+{
+    pthread_rwlock_unlock(&block_map_lock);
+}
+
+block_size_t count_chain_runs(block_size_t head, block_size_t *len)
+{
+    block_size_t id = head, next, runs = 1;
+    *len = 1;
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    while ((next = get_next_block_id(id)) != id) {
+        if (next != id + 1) {
+            runs++;
+        }
+        (*len)++;
+        id = next;
+    }
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    return runs;
+}
+
+/*
+    copy the data of a block to an acquired unwritten one
+    nothing is copied from an unwritten block
+*/
+static void copy_block(block_size_t from, block_size_t to)
+{
+    if (block_unwritten(from)) {
+        return ;
+    }
+    uint8_t *buf = take_block_buf();
+    read_block(from, buf);
+    write_block(to, buf);
+    put_block_buf(buf);
+}
+
+/*
+    link `to` into the chain in place of `from`, the block after `prev`
+    `from` is left as a single block chain
+    caller should hold fatable_mem_lock for writing
+*/
+static void relink_block_locked(block_size_t prev, block_size_t from, block_size_t to)
+{
+    block_size_t next = fatable[from] & FAT_NEXT_MASK;
+    set_next_block_id(to, next == from ? to : next);
+    set_next_block_id(prev, to);
+    fatable[from] = from | FAT_UNWRITTEN_FLAG;
+    fatable_generation++;
+}
+
+bool relocate_next_block(block_size_t prev, block_size_t to)
+{
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    block_size_t from = get_next_block_id(prev);
+    bool mapped = phys != NULL;
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    if (from == prev || mapped) {
+        return false;
+    }
+    copy_block(from, to);
+
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    relink_block_locked(prev, from, to);
+    release_block_chain_locked(from);
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    notify_discard();
+
+    NAIVE_PROBE3(relocate_block, prev, from, to);
+    return true;
+}
+
+/*
+    bitmap of the blocks in the free chain
+    caller should hold fatable_mem_lock
+*/
+static uint8_t *free_block_map_locked(void)
+{
+    uint8_t *map = calloc((metadata.block_num + 7) / 8, 1);
+    if (map == NULL) {
+        perror("free_block_map_locked() calloc");
+        exit(1);
+    }
+    block_size_t id = metadata.first_free_block_id;
+    for (block_size_t i = 0; i < metadata.free_block_num; i++) {
+        map[id / 8] |= 1 << (id % 8);
+        id = get_next_block_id(id);
+    }
+    return map;
+}
+
+static inline bool block_map_test(const uint8_t *map, block_size_t id)
+{
+    return map[id / 8] & (1 << (id % 8));
+}
+
+/*
+    string the free blocks below `limit` into a chain in ascending order,
+    so that the lowest ones are handed out first
+    caller should hold fatable_mem_lock for writing
+*/
+static void rebuild_free_chain_locked(const uint8_t *free_map, block_size_t limit)
+{
+    block_size_t head = BLOCK_ID_NONE, count = 0;
+    for (block_size_t id = limit; id-- > 0; ) {
+        if (block_map_test(free_map, id)) {
+            fatable[id] = (head == BLOCK_ID_NONE ? id : head) | FAT_UNWRITTEN_FLAG;
+            head = id;
+            count++;
+        }
+    }
+    metadata.first_free_block_id = head;
+    metadata.free_block_num = count;
+    fatable_generation++;
+}
+
+/*
+    pred[id] is the block linking to `id`, BLOCK_ID_NONE for chain heads and free blocks
+    caller should hold fatable_mem_lock
+*/
+static void build_pred_map_locked(block_size_t *pred, const uint8_t *free_map)
+{
+    for (block_size_t id = 0; id < metadata.block_num; id++) {
+        pred[id] = BLOCK_ID_NONE;
+    }
+    for (block_size_t id = 0; id < metadata.block_num; id++) {
+        block_size_t next = fatable[id] & FAT_NEXT_MASK;
+        if (!block_map_test(free_map, id) && next != id) {
+            pred[next] = id;
+        }
+    }
+}
+
+/*
+    lowest run of `len` free blocks below `limit`, the blocks right after `prev` are tried first
+    the free chain should be sorted, returns BLOCK_ID_NONE if there is none
+    caller should hold fatable_mem_lock
+*/
+static block_size_t find_free_run_locked(const uint8_t *free_map, block_size_t prev, block_size_t len, block_size_t limit)
+{
+    block_size_t id, run = 0;
+    for (id = prev + 1; id < limit && id < prev + 1 + len && block_map_test(free_map, id); id++) {
+        run++;
+    }
+    if (run == len) {
+        return prev + 1;
+    }
+    run = 0;
+    for (id = metadata.first_free_block_id; id < limit; id++) {
+        if (id % 8 == 0 && free_map[id / 8] == 0) {
+            id += 7;// skip a byte of used blocks
+            run = 0;
+        } else if (block_map_test(free_map, id)) {
+            if (++run == len) {
+                return id + 1 - len;
+            }
+        } else {
+            run = 0;
+        }
+    }
+    return BLOCK_ID_NONE;
+}
+
+/*
+    take the free blocks [start, start + len) out of the sorted free chain,
+    and string them into a chain of unwritten blocks
+    caller should hold fatable_mem_lock for writing
+*/
+static void take_free_run_locked(uint8_t *free_map, block_size_t start, block_size_t len)
+{
+    block_size_t last = start + len - 1, next = get_next_block_id(last), prev = start;
+    while (prev-- > 0 && !block_map_test(free_map, prev)) {
+        if (prev % 8 == 0 && prev >= 8 && free_map[prev / 8 - 1] == 0) {
+            prev -= 7;// skip a byte of used blocks
+        }
+    }
+    if (start == metadata.first_free_block_id) {
+        metadata.first_free_block_id = next;
+    } else {
+        set_next_block_id(prev, next == last ? prev : next);
+    }
+    for (block_size_t id = start; id <= last; id++) {
+        fatable[id] = (id == last ? id : id + 1) | FAT_UNWRITTEN_FLAG;
+        free_map[id / 8] &= ~(1 << (id % 8));
+        set_discard_pending(id, false);
+    }
+    metadata.free_block_num -= len;
+    fatable_generation++;
+}
+
+block_size_t compact_block_chains(size_t batch, void (*pause)(block_size_t moved), block_size_t *truncated)
+{
+    block_size_t moved = 0, id, new_block_num;
+    block_size_t *pred = NULL;
+    uint8_t *free_map = NULL;
+    uint64_t pred_generation = 0;
+    bool done = false;
+
+    pthread_mutex_lock(&maintenance_lock);
+    pthread_rwlock_rdlock(&fatable_mem_lock);
+    // with the physical map, block ids say nothing about the layout of the blockfile
+    id = phys == NULL ? metadata.block_num : 0;
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    *truncated = 0;
+    if (id == 0) {
+        pthread_mutex_unlock(&maintenance_lock);
+        return 0;
+    }
+    // blocks moved away from, they are freed by the truncation below
+    block_size_t moved_num = id;
+    uint8_t *moved_map = calloc((moved_num + 7) / 8, 1);
+    if (moved_map == NULL) {
+        perror("compact_block_chains() calloc");
+        exit(1);
+    }
+
+    // walk down from the end, moving each run of consecutive blocks as a whole
+    while (!done && id > 1) {
+        block_size_t count = 0;
+        pthread_rwlock_wrlock(&fatable_mem_lock);
+        while (count < batch && id > 1) {
+            if (pred != NULL && pred_generation != fatable_generation) {
+                // the chains changed between runs, the maps would be rebuilt in O(block_num)
+                // under the write lock every run of a busy volume, the next pass starts over
+                done = true;
+                break;
+            }
+            if (pred == NULL) {
+                free_map = free_block_map_locked();
+                rebuild_free_chain_locked(free_map, metadata.block_num);
+                pred = realloc(pred, metadata.block_num * sizeof(block_size_t));
+                if (pred == NULL) {
+                    perror("compact_block_chains() realloc");
+                    exit(1);
+                }
+                build_pred_map_locked(pred, free_map);
+                pred_generation = fatable_generation;
+            }
+            block_size_t end = id - 1, start = end;
+            if (pred[end] == BLOCK_ID_NONE) {
+                id--;
+                continue;// free, moved or the pinned first block of a file
+            }
+            if (metadata.first_free_block_id >= end) {
+                done = true;// no free block below it
+                break;
+            }
+            while (pred[start] == start - 1 && pred[start - 1] != BLOCK_ID_NONE) {
+                start--;
+            }
+            // a long run is moved from its lowest part, so that the parts stay in order
+            block_size_t len = end + 1 - start > batch ? batch : end + 1 - start;
+            block_size_t dest = BLOCK_ID_NONE;
+            if (len < metadata.free_block_num) {
+                dest = find_free_run_locked(free_map, pred[start], len, start);
+            }
+            if (dest == BLOCK_ID_NONE) {
+                // no hole is large enough, move one block into the lowest free one
+                len = 1;
+                dest = metadata.first_free_block_id;
+                if (metadata.free_block_num <= 1 || dest >= start) {
+                    done = true;
+                    break;
+                }
+            }
+            take_free_run_locked(free_map, dest, len);
+            uint64_t generation = fatable_generation;
+            __atomic_store_n(&moving_start, start, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&moving_end, start + len, __ATOMIC_SEQ_CST);
+            uint64_t writes = __atomic_load_n(&moving_writes, __ATOMIC_SEQ_CST);
+            pthread_rwlock_unlock(&fatable_mem_lock);
+            // copied while the foreground goes on, a write to the run meanwhile is counted
+            for (block_size_t k = 0; k < len; k++) {
+                copy_block(start + k, dest + k);
+            }
+            // the writes which found the run through its chain are done once the block map is held
+            lock_block_map(true);
+            pthread_rwlock_wrlock(&fatable_mem_lock);
+            __atomic_store_n(&moving_end, 0, __ATOMIC_SEQ_CST);
+            if (generation != fatable_generation || writes != __atomic_load_n(&moving_writes, __ATOMIC_SEQ_CST)) {
+                release_block_chain_locked(dest);// the run changed under us, leave it and the pass
+                unlock_block_map();
+                done = true;
+                break;
+            }
+            for (block_size_t k = 0; k < len; k++) {
+                block_size_t prev = k == 0 ? pred[start] : dest + k - 1;
+                relink_block_locked(prev, start + k, dest + k);
+                pred[dest + k] = prev;
+                pred[start + k] = BLOCK_ID_NONE;
+                moved_map[(start + k) / 8] |= 1 << ((start + k) % 8);
+            }
+            unlock_block_map();
+            block_size_t last = dest + len - 1, next = get_next_block_id(last);
+            if (next != last) {
+                pred[next] = last;
+            }
+            pred_generation = fatable_generation;
+            if (start + len > end) {
+                id = start;
+            }
+            count += len;
+        }
+        pthread_rwlock_unlock(&fatable_mem_lock);
+        moved += count;
+        if (pause != NULL && count > 0) {
+            pause(count);
+        }
+    }
+
+    // cut the free blocks off the end, keep one so that the free chain is never empty
+    // no block past the new end is reached through a chain once the block map is held,
+    // and the fatable does not grow again until the blockfile is truncated
+    lock_block_map(true);
+    pthread_mutex_lock(&fatable_grow_lock);
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    free(free_map);
+    free_map = free_block_map_locked();
+    for (id = 0; id < moved_num; id++) {
+        if (block_map_test(moved_map, id)) {
+            free_map[id / 8] |= 1 << (id % 8);
+            drop_block_data_locked(id);
+        }
+    }
+    new_block_num = metadata.block_num;
+    while (phys == NULL && new_block_num > 2 && block_map_test(free_map, new_block_num - 1)
+        && block_map_test(free_map, new_block_num - 2)) {
+        new_block_num--;
+    }
+    *truncated = metadata.block_num - new_block_num;
+    rebuild_free_chain_locked(free_map, new_block_num);
+    metadata.block_num = new_block_num;// the entries past it are written again by expand_fatable()
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    unlock_block_map();
+    if (*truncated > 0) {
+        // a write still in flight to the freed tail would grow the blockfile again
+        writeback_all();
+        for (int i = 0; i < volume_stripe_count; i++) {
+            struct stat st;
+            off_t size = (off_t)stripe_slots_below(i, new_block_num) * BLOCK_SIZE;
+            if (fstat(stripes[i].fd, &st) == 0 && st.st_size > size && ftruncate(stripes[i].fd, size) == -1) {
+                perror("compact_block_chains() ftruncate");
+            }
+        }
+        pthread_mutex_lock(&blockfile_grow_lock);
+        blockfile_reserved = blockfile_reserved < new_block_num ? blockfile_reserved : new_block_num;
+        pthread_mutex_unlock(&blockfile_grow_lock);
+    }
+    pthread_mutex_unlock(&fatable_grow_lock);
+
+    free(moved_map);
+    free(free_map);
+    free(pred);
+    pthread_mutex_unlock(&maintenance_lock);
+    notify_discard();
+    NAIVE_PROBE2(compact_block_chains, moved, *truncated);
+    return moved;
+}
+
+block_size_t discard_free_blocks(void)
+{
+    block_size_t id = 0, n, discarded = 0;
+    block_size_t starts[DISCARD_BATCH_RANGES], lens[DISCARD_BATCH_RANGES];
+    bool finished = false;
+    while (!finished) {
+        // claim a batch of ranges, a block taken before it is punched waits in set_discard_pending()
+        size_t ranges = 0;
+        pthread_rwlock_rdlock(&fatable_mem_lock);
+        pthread_mutex_lock(&discard_mutex);
+        n = phys == NULL ? metadata.block_num : slot_num;
+        n = n < discard_pending_num ? n : discard_pending_num;
+        while (id < n && ranges < DISCARD_BATCH_RANGES) {
+            if (id % 8 == 0 && discard_pending[id / 8] == 0) {
+                id += 8;// skip a byte of nothing to discard
+                continue;
+            }
+            if (!block_map_test(discard_pending, id)) {
+                id++;
+                continue;
+            }
+            starts[ranges] = id;
+            while (id < n && block_map_test(discard_pending, id)) {
+                __atomic_and_fetch(discard_pending + id / 8, ~(1 << (id % 8)), __ATOMIC_RELAXED);
+                __atomic_or_fetch(discard_inflight + id / 8, 1 << (id % 8), __ATOMIC_RELEASE);
+                id++;
+            }
+            lens[ranges] = id - starts[ranges];
+            ranges++;
+        }
+        finished = id >= n;
+        pthread_mutex_unlock(&discard_mutex);
+        pthread_rwlock_unlock(&fatable_mem_lock);
+
+        for (size_t i = 0; i < ranges; i++) {
+            fallocate_slots(starts[i], lens[i], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, "discard_free_blocks() fallocate");
+            NAIVE_PROBE2(discard_range, starts[i], lens[i]);
+            discarded += lens[i];
+            pthread_mutex_lock(&discard_mutex);
+            for (block_size_t k = starts[i]; k < starts[i] + lens[i]; k++) {
+                __atomic_and_fetch(discard_inflight + k / 8, ~(1 << (k % 8)), __ATOMIC_RELEASE);
+            }
+            pthread_cond_broadcast(&discard_punched);
+            pthread_mutex_unlock(&discard_mutex);
+        }
+    }
+    return discarded;
+}
+
+static void *discard_thread(void *arg)
+{
+    unsigned int interval = (uintptr_t) arg;
+    while (true) {
+        discard_free_blocks();
+        if (discard_policy == DISCARD_IMMEDIATE) {
+            pthread_mutex_lock(&discard_mutex);
+            while (!discard_requested) {
+                pthread_cond_wait(&discard_cond, &discard_mutex);
+            }
+            discard_requested = false;
+            pthread_mutex_unlock(&discard_mutex);
+        } else {
+            sleep(interval);
+        }
+    }
+    return NULL;
+}
+
+void start_discard(enum discard_policy policy, unsigned int interval)
+{
+    pthread_t tid;
+    if (policy == DISCARD_OFF) {
+        return ;
+    }
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    discard_pending_num = phys == NULL ? metadata.block_num : slot_num;
+    discard_pending = calloc((discard_pending_num + 7) / 8, 1);
+    discard_inflight = calloc((discard_pending_num + 7) / 8, 1);
+    if (discard_pending == NULL || discard_inflight == NULL) {
+        perror("start_discard() calloc");
+        exit(1);
+    }
+    // blocks freed before this mount may still take space
+    if (phys == NULL) {
+        block_size_t id = metadata.first_free_block_id;
+        for (block_size_t i = 0; i < metadata.free_block_num; i++) {
+            set_discard_pending(id, true);
+            id = get_next_block_id(id);
+        }
+    } else {
+        for (block_size_t i = 0; i < free_slot_num; i++) {
+            set_discard_pending(free_slots[i], true);
+        }
+    }
+    discard_policy = policy;
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    if (pthread_create(&tid, NULL, discard_thread, (void *)(uintptr_t) interval) != 0) {
+        perror("start_discard() pthread_create");
+        exit(1);
+    }
+    pthread_detach(tid);
+}
+
+bool read_snapshot(const char *path, struct fatable_metadata *md, blockid_data_t **fat, block_size_t **map)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    enum fatable_header_kind kind;
+    bool ok = read_fatable_header(fd, md, &kind);
+    *map = NULL;
+    if (fat != NULL) {
+        *fat = NULL;
+    }
+    if (ok) {
+        size_t size = md->block_num * sizeof(block_size_t);
+        *map = malloc(size);
+        if (fat != NULL) {
+            *fat = malloc(md->block_num * sizeof(blockid_data_t));
+            ok = *fat != NULL && read_full(fd, *fat, md->block_num * sizeof(blockid_data_t));
+        } else {
+            ok = lseek(fd, md->block_num * sizeof(blockid_data_t), SEEK_CUR) != -1;
+        }
+        ok = ok && *map != NULL && read_full(fd, *map, size);
+    }
+    close(fd);
+    if (!ok) {
+        free(*map);
+        if (fat != NULL) {
+            free(*fat);
+        }
+    }
+    return ok;
+}
+
+/*
+    call fn on the path of every snapshot file in the volume dir
+*/
+static void for_each_snapshot_file(void (*fn)(const char *path))
+{
+    DIR *dir = opendir(".");
+    struct dirent *entry;
+    if (dir == NULL) {
+        perror("for_each_snapshot_file() opendir");
+        exit(1);
+    }
+    size_t prefix_len = strlen(SNAPSHOT_FILENAME_PREFIX), suffix_len = strlen(SNAPSHOT_FILENAME_SUFFIX);
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len > prefix_len + suffix_len && strncmp(entry->d_name, SNAPSHOT_FILENAME_PREFIX, prefix_len) == 0
+            && strcmp(entry->d_name + len - suffix_len, SNAPSHOT_FILENAME_SUFFIX) == 0) {
+            fn(entry->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+static bool snapshot_found;
+
+static void note_snapshot(const char *path)
+{
+    snapshot_found = true;
+}
+
+/*
+    caller should hold fatable_mem_lock for writing
+*/
+static void count_snapshot_refs_locked(const char *path)
+{
+    struct fatable_metadata md;
+    block_size_t *map;
+    if (!read_snapshot(path, &md, NULL, &map)) {
+        printerrf("load_physical_map(): snapshot %s is broken\n", path);
+        exit(1);
+    }
+    count_slot_refs_locked(map, md.block_num);
+    free(map);
+}
+
+static void load_physical_map(void)
+{
+    snapshot_found = false;
+    for_each_snapshot_file(note_snapshot);
+    int fd = open(BLOCKMAP_FILENAME, O_RDONLY);
+    if (fd == -1 && !snapshot_found) {
+        return ;
+    }
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    if (fd == -1) {
+        // the first snapshot was taken, but the map was never synced
+        enable_physical_map_locked();
+    } else {
+        phys = reserve_table(sizeof(block_size_t), &phys_committed);
+        commit_table(phys, sizeof(block_size_t), &phys_committed, metadata.block_num);
+        if (!read_full(fd, phys, metadata.block_num * sizeof(block_size_t))) {
+            printerrf("load_physical_map(): blockmap file is broken\n");
+            exit(1);
+        }
+        close(fd);
+        count_slot_refs_locked(phys, metadata.block_num);
+    }
+    for_each_snapshot_file(count_snapshot_refs_locked);
+    grow_slots_locked(blockfile_slots());
+    collect_free_slots_locked();
+    pthread_rwlock_unlock(&fatable_mem_lock);
+}
+
+/*
+    copy the data of a slot into a new one, for a slot which can not take another reference
+    caller should hold snapshot_lock and fatable_mem_lock for writing
+*/
+static block_size_t copy_slot_locked(block_size_t from)
+{
+    uint8_t *buf = take_block_buf();
+    block_size_t to = alloc_slot_locked();
+    if (!writeback_read(from, buf) && pread_slot(from, buf) != BLOCK_SIZE) {
+        perror("copy_slot_locked() pread");
+        exit(1);
+    }
+    if (!writeback_write(to, buf)) {
+        write_slot(to, buf);
+    }
+    put_block_buf(buf);
+    return to;
+}
+
+bool save_block_snapshot(const char *path)
 {
-    if (pwrite(blockfile_fd, buf, BLOCK_SIZE, (off_t)id * BLOCK_SIZE) == -1) {
-        perror("write_block() pwrite");
+    pthread_rwlock_wrlock(&snapshot_lock);
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    if (phys == NULL) {
+        enable_physical_map_locked();
+    }
+    struct fatable_metadata md = metadata;
+    blockid_data_t *fat = malloc(md.block_num * sizeof(blockid_data_t));
+    block_size_t *map = malloc(md.block_num * sizeof(block_size_t));
+    if (fat == NULL || map == NULL) {
+        perror("save_block_snapshot() malloc");
         exit(1);
     }
+    memcpy(fat, fatable, md.block_num * sizeof(blockid_data_t));
+    memcpy(map, phys, md.block_num * sizeof(block_size_t));
+    for (block_size_t id = 0; id < md.block_num; id++) {
+        if (map[id] == SLOT_NONE) {
+            continue;
+        }
+        if (slot_refs[map[id]] == UINT16_MAX) {
+            map[id] = copy_slot_locked(map[id]);
+        } else {
+            slot_refs[map[id]]++;
+        }
+    }
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    pthread_rwlock_unlock(&snapshot_lock);
+    sync_tier();// its slots are found through the tiermap file by a snapshot mount
+
+    // write it aside and rename, a snapshot file is either complete or missing
+    char tmp_path[strlen(path) + sizeof(".tmp")];
+    sprintf(tmp_path, "%s.tmp", path);
+    uint8_t header[FATABLE_HEADER_MAX];
+    size_t header_len = encode_fatable_header(&md, header);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    bool ok = fd != -1 && write_full(fd, header, header_len)
+        && write_full(fd, fat, md.block_num * sizeof(blockid_data_t))
+        && write_full(fd, map, md.block_num * sizeof(block_size_t))
+        && fsync(fd) == 0;
+    if (fd != -1) {
+        close(fd);
+    }
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok) {
+        perror("save_block_snapshot()");
+        unlink(tmp_path);
+        pthread_rwlock_wrlock(&fatable_mem_lock);
+        for (block_size_t id = 0; id < md.block_num; id++) {
+            if (map[id] != SLOT_NONE) {
+                put_slot_locked(map[id]);
+            }
+        }
+        pthread_rwlock_unlock(&fatable_mem_lock);
+    }
+    NAIVE_PROBE2(save_block_snapshot, md.block_num, ok);
+    free(fat);
+    free(map);
+    return ok;
+}
+
+bool drop_block_snapshot(const char *path)
+{
+    struct fatable_metadata md;
+    block_size_t *map;
+    if (!read_snapshot(path, &md, NULL, &map)) {
+        return false;
+    }
+    if (unlink(path) == -1) {
+        free(map);
+        return false;
+    }
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    for (block_size_t id = 0; id < md.block_num; id++) {
+        if (map[id] != SLOT_NONE) {
+            put_slot_locked(map[id]);
+        }
+    }
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    free(map);
+    notify_discard();
+    return true;
+}
+
+void share_block_chain(block_size_t src, block_size_t dst, size_t n)
+{
+    pthread_rwlock_wrlock(&snapshot_lock);
+    pthread_rwlock_wrlock(&fatable_mem_lock);
+    if (phys == NULL) {
+        enable_physical_map_locked();
+    }
+    for (size_t i = 0; i < n; i++) {
+        drop_block_data_locked(dst);
+        if ((fatable[src] & FAT_UNWRITTEN_FLAG) || phys[src] == SLOT_NONE) {
+            fatable[dst] |= FAT_UNWRITTEN_FLAG;
+        } else {
+            block_size_t slot = phys[src];
+            if (slot_refs[slot] == UINT16_MAX) {
+                slot = copy_slot_locked(slot);
+            } else {
+                slot_refs[slot]++;
+            }
+            phys[dst] = slot;
+            fatable[dst] &= ~FAT_UNWRITTEN_FLAG;
+        }
+        src = get_next_block_id(src);
+        dst = get_next_block_id(dst);
+    }
+    pthread_rwlock_unlock(&fatable_mem_lock);
+    pthread_rwlock_unlock(&snapshot_lock);
+    NAIVE_PROBE1(share_block_chain, n);
+    notify_discard();
 }
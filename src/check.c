@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "check.h"
+#include "inode.h"
+
+struct dir_item {
+    block_size_t id;
+    file_size_t size;
+};
+
+struct long_chain {
+    block_size_t head;
+    block_size_t block_count;
+};
+
+struct check_state {
+    struct fatable_metadata md;
+    uint8_t *owned;// blocks of the free chain and of the reachable files
+    block_size_t next_segment;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dir_item *dirs;// dirs waiting to be read
+    size_t dir_num;
+    size_t dir_cap;
+    unsigned int busy;// threads reading a dir
+    struct long_chain *long_chains;
+    size_t long_num;
+    size_t long_cap;
+    unsigned int printed;
+};
+
+/*
+    the counts of a thread, summed up once they are done
+*/
+struct check_worker {
+    pthread_t tid;
+    struct check_state *st;
+    uint8_t *block_buf;
+    block_size_t bad_entries;
+    block_size_t first_bad;
+    file_count_t files;
+    file_count_t dirs;
+    file_count_t bad_files;
+    file_count_t bad_dirs;
+    file_count_t long_chains;
+    block_size_t tails;// blocks of the long chains after block_count
+};
+
+static void report_problem(struct check_state *st, const char *fmt, ...)
+{
+    va_list args;
+    pthread_mutex_lock(&st->lock);
+    if (st->printed++ < CHECK_PRINT_MAX) {
+        va_start(args, fmt);
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+    } else if (st->printed == CHECK_PRINT_MAX + 1) {
+        printerrf("check: more problems are only counted\n");
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+static void *check_fatable_thread(void *arg)
+{
+    struct check_worker *w = arg;
+    struct check_state *st = w->st;
+    while (true) {
+        block_size_t seg = __atomic_fetch_add(&st->next_segment, 1, __ATOMIC_RELAXED);
+        if ((uint64_t) seg * FAT_SEGMENT_BLOCKS >= st->md.block_num) {
+            break;
+        }
+        block_size_t start = seg * FAT_SEGMENT_BLOCKS, first_bad;
+        block_size_t end = st->md.block_num - start < FAT_SEGMENT_BLOCKS ? st->md.block_num : start + FAT_SEGMENT_BLOCKS;
+        block_size_t bad = check_fatable_range(start, end, &first_bad);
+        if (bad > 0 && (w->bad_entries == 0 || first_bad < w->first_bad)) {
+            w->first_bad = first_bad;
+        }
+        w->bad_entries += bad;
+    }
+    return NULL;
+}
+
+static void push_dir(struct check_state *st, block_size_t id, file_size_t size)
+{
+    pthread_mutex_lock(&st->lock);
+    if (st->dir_num == st->dir_cap) {
+        st->dir_cap = st->dir_cap ? st->dir_cap * 2 : 256;
+        st->dirs = realloc(st->dirs, st->dir_cap * sizeof(struct dir_item));
+        if (st->dirs == NULL) {
+            perror("push_dir() realloc");
+            exit(1);
+        }
+    }
+    st->dirs[st->dir_num++] = (struct dir_item) {id, size};
+    pthread_cond_signal(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+static void push_long_chain(struct check_state *st, block_size_t head, block_size_t block_count)
+{
+    pthread_mutex_lock(&st->lock);
+    if (st->long_num == st->long_cap) {
+        st->long_cap = st->long_cap ? st->long_cap * 2 : 64;
+        st->long_chains = realloc(st->long_chains, st->long_cap * sizeof(struct long_chain));
+        if (st->long_chains == NULL) {
+            perror("push_long_chain() realloc");
+            exit(1);
+        }
+    }
+    st->long_chains[st->long_num++] = (struct long_chain) {head, block_count};
+    pthread_mutex_unlock(&st->lock);
+}
+
+/*
+    the metadata of a file like try_open_file() finds it, without opening it
+*/
+static bool load_metadata(struct check_worker *w, block_size_t id, struct file_metadata *md)
+{
+    if (get_inode(id, md)) {
+        return md->first_block_id == id;
+    }
+    read_block(id, w->block_buf);
+    memcpy(md, w->block_buf, sizeof(*md));
+    return md->first_block_id == id && md->block_count > 0;
+}
+
+/*
+    check a file linked from a dir and claim its chain, a dir is queued to be read
+*/
+static void check_file(struct check_worker *w, block_size_t id, block_size_t dir_id, const char *name)
+{
+    struct check_state *st = w->st;
+    struct file_metadata md;
+    bool broken;
+    if (id >= st->md.block_num) {
+        report_problem(st, "check: %s in dir %u starts at block %u, out of range\n", name, dir_id, id);
+        w->bad_files++;
+        return;
+    }
+    if (!load_metadata(w, id, &md)) {
+        report_problem(st, "check: %s (block %u) in dir %u has no metadata\n", name, id, dir_id);
+        w->bad_files++;
+        return;
+    }
+    block_size_t len = claim_block_chain(id, st->owned, &broken);
+    block_size_t needed = md.file_size == 0 ? 1 : get_blockno(md.file_size - 1) + 1;
+    const char *problem = NULL;
+    if (broken && len == 0) {
+        problem = "is linked twice or from the middle of another chain";
+    } else if (broken) {
+        problem = "has a chain running into another one or out of range";
+    } else if (len < md.block_count) {
+        problem = "has a chain shorter than its block_count";
+    } else if (needed > md.block_count) {
+        problem = "has a block_count too small for its file_size";
+    } else if (md.mode != MODE_ISDIR && md.mode != MODE_ISREG) {
+        problem = "has a bad mode";
+    }
+    if (problem != NULL) {
+        report_problem(st, "check: %s (block %u) in dir %u %s: %u blocks, block_count %u, file_size %u\n", name, id,
+            dir_id, problem, len, md.block_count, md.file_size);
+        w->bad_files++;
+        return;
+    }
+    if (len > md.block_count) {
+        push_long_chain(st, id, md.block_count);
+        w->long_chains++;
+        w->tails += len - md.block_count;
+    }
+    if (md.mode == MODE_ISDIR) {
+        w->dirs++;
+        push_dir(st, id, md.file_size);
+    } else {
+        w->files++;
+    }
+}
+
+/*
+    parse a dir file laid out as read_dir() takes it, and check the files of its entries
+    returns false if it does not parse
+*/
+static bool check_dir_entries(struct check_worker *w, block_size_t dir_id, const uint8_t *raw, file_size_t size)
+{
+    uint32_t header[6] = {0, 0, 0, 0, 0, 0};
+    memcpy(header, raw, size < sizeof(header) ? size : sizeof(header));
+    file_count_t count = header[0], slots, slot_cap = header[2];
+    file_size_t start;
+    const uint32_t *offs = NULL;
+    if (header[1] == DIR_MAGIC) {
+        if (size < DIR_HEADER_SIZE || slot_cap > size / (2 * sizeof(uint32_t))
+            || DIR_HEADER_SIZE + slot_cap * 2 * sizeof(uint32_t) > size || header[3] > slot_cap
+            || count > header[3] || (header[4] != DIR_SLOT_NONE && header[4] >= header[3])) {
+            return false;
+        }
+        offs = (const uint32_t *) (raw + DIR_HEADER_SIZE + slot_cap * sizeof(uint32_t));
+        slots = header[3];
+        start = DIR_HEADER_SIZE + slot_cap * 2 * sizeof(uint32_t);
+    } else if (header[1] == DIR_MAGIC_V1) {
+        if (size < DIR_HEADER_V1_SIZE || slot_cap > size / (2 * sizeof(uint32_t))
+            || DIR_HEADER_V1_SIZE + slot_cap * 2 * sizeof(uint32_t) > size || slot_cap < count) {
+            return false;
+        }
+        offs = (const uint32_t *) (raw + DIR_HEADER_V1_SIZE + slot_cap * sizeof(uint32_t));
+        slots = count;
+        start = DIR_HEADER_V1_SIZE + slot_cap * 2 * sizeof(uint32_t);
+    } else {
+        slots = count;
+        start = sizeof(file_count_t);
+    }
+    file_size_t off = start;
+    file_count_t live = 0;
+    for (file_count_t i = 0; i < slots; i++) {
+        if (offs != NULL) {
+            if (offs[i] & DIR_SLOT_DEAD) {
+                continue;
+            }
+            off = offs[i];
+        }
+        file_size_t name_off = off + sizeof(block_size_t);
+        const uint8_t *name_end = off >= start && name_off < size ? memchr(raw + name_off, '\0', size - name_off) : NULL;
+        if (name_end == NULL) {
+            return false;
+        }
+        block_size_t id;
+        memcpy(&id, raw + off, sizeof(id));
+        const char *name = (const char *) raw + name_off;
+        if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+            check_file(w, id, dir_id, name);
+        }
+        off = name_end + 1 - raw;
+        live++;
+    }
+    return live == count;
+}
+
+static void check_dir(struct check_worker *w, const struct dir_item *dir)
+{
+    if (dir->size < sizeof(file_count_t)) {
+        report_problem(w->st, "check: dir %u is too small: %u bytes\n", dir->id, dir->size);
+        w->bad_dirs++;
+        return;
+    }
+    block_size_t n = get_blockno(dir->size - 1) + 1;
+    uint8_t *buf = malloc((size_t) n * BLOCK_SIZE);
+    if (buf == NULL) {
+        perror("check_dir() malloc");
+        exit(1);
+    }
+    read_blocks(dir->id, n, buf);// check_file() made sure the chain has these blocks
+    if (!check_dir_entries(w, dir->id, buf + FILE_METADATA_OFFSET, dir->size)) {
+        report_problem(w->st, "check: dir %u does not parse\n", dir->id);
+        w->bad_dirs++;
+    }
+    free(buf);
+}
+
+static void *check_dirs_thread(void *arg)
+{
+    struct check_worker *w = arg;
+    struct check_state *st = w->st;
+    while (true) {
+        pthread_mutex_lock(&st->lock);
+        while (st->dir_num == 0 && st->busy > 0) {
+            pthread_cond_wait(&st->cond, &st->lock);
+        }
+        if (st->dir_num == 0) {
+            pthread_mutex_unlock(&st->lock);
+            break;
+        }
+        struct dir_item dir = st->dirs[--st->dir_num];
+        st->busy++;
+        pthread_mutex_unlock(&st->lock);
+
+        check_dir(w, &dir);
+
+        pthread_mutex_lock(&st->lock);
+        if (--st->busy == 0 && st->dir_num == 0) {
+            pthread_cond_broadcast(&st->cond);
+        }
+        pthread_mutex_unlock(&st->lock);
+    }
+    return NULL;
+}
+
+static void run_workers(struct check_worker *workers, unsigned int threads, void *(*fn)(void *))
+{
+    for (unsigned int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i].tid, NULL, fn, workers + i) != 0) {
+            perror("check_volume() pthread_create");
+            exit(1);
+        }
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+}
+
+/*
+    release the leaked blocks: the tails of the long chains, then the blocks gc would reclaim
+*/
+static block_size_t repair_leaks(struct check_state *st)
+{
+    uint8_t *reachable;
+    for (size_t i = 0; i < st->long_num; i++) {
+        cut_block_chain_at(st->long_chains[i].head, st->long_chains[i].block_count);
+    }
+    block_size_t n = begin_block_scan(&reachable);
+    memcpy(reachable, st->owned, (n + 7) / 8);
+    block_size_t released = end_block_scan(reachable, n);
+    sync_fatable();
+    flush_fatable();
+    return released;
+}
+
+bool check_volume(unsigned int threads, bool repair, struct check_report *report)
+{
+    struct check_state st;
+    memset(&st, 0, sizeof(st));
+    memset(report, 0, sizeof(*report));
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+    get_fatable_metadata(&st.md);
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+    threads = threads > CHECK_MAX_THREADS ? CHECK_MAX_THREADS : threads;
+    size_t bitmap_size = ((size_t) st.md.block_num + 7) / 8;
+    st.owned = calloc(bitmap_size, 1);
+    struct check_worker *workers = calloc(threads, sizeof(struct check_worker));
+    if (st.owned == NULL || workers == NULL) {
+        perror("check_volume() calloc");
+        exit(1);
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+        workers[i].st = &st;
+        workers[i].block_buf = malloc(BLOCK_SIZE);
+        if (workers[i].block_buf == NULL) {
+            perror("check_volume() malloc");
+            exit(1);
+        }
+    }
+    report->block_num = st.md.block_num;
+
+    // an entry out of range is an error once a chain runs into it, else it is leaked
+    run_workers(workers, threads, check_fatable_thread);
+    block_size_t first_bad = BLOCK_ID_NONE;
+    for (unsigned int i = 0; i < threads; i++) {
+        if (workers[i].bad_entries > 0 && workers[i].first_bad < first_bad) {
+            first_bad = workers[i].first_bad;
+        }
+        report->bad_entries += workers[i].bad_entries;
+    }
+    if (report->bad_entries > 0) {
+        report_problem(&st, "check: %u fatable entries out of range, the first at block %u\n",
+            report->bad_entries, first_bad);
+    }
+
+    bool broken;
+    report->free_blocks = claim_block_chain(st.md.first_free_block_id, st.owned, &broken);
+    report->free_chain_broken = broken;
+    if (broken) {
+        report_problem(&st, "check: the free block chain runs into itself or out of range after %u blocks\n",
+            report->free_blocks);
+    } else if (report->free_blocks != st.md.free_block_num) {
+        report->free_count_wrong = true;
+        report_problem(&st, "check: %u free blocks counted as %u\n", report->free_blocks, st.md.free_block_num);
+    }
+
+    check_file(workers, 0, 0, "/");// rootdir
+    run_workers(workers, threads, check_dirs_thread);
+    for (unsigned int i = 0; i < threads; i++) {
+        report->files += workers[i].files;
+        report->dirs += workers[i].dirs;
+        report->bad_files += workers[i].bad_files;
+        report->bad_dirs += workers[i].bad_dirs;
+        report->long_chains += workers[i].long_chains;
+        report->tail_blocks += workers[i].tails;
+        free(workers[i].block_buf);
+    }
+    block_size_t owned = 0;
+    for (size_t i = 0; i < bitmap_size; i++) {
+        owned += __builtin_popcount(st.owned[i]);
+    }
+    report->leaked = st.md.block_num - owned + report->tail_blocks;
+
+    bool ok = !report->free_chain_broken && report->bad_files == 0 && report->bad_dirs == 0;
+    if (repair && ok && check_found_leaks(report)) {
+        report->reclaimed = report->tail_blocks + repair_leaks(&st);
+    }
+    free(workers);
+    free(st.owned);
+    free(st.dirs);
+    free(st.long_chains);
+    pthread_mutex_destroy(&st.lock);
+    pthread_cond_destroy(&st.cond);
+    return ok;
+}
+
+void print_check_report(const struct check_report *report, FILE *out)
+{
+    fprintf(out, "%u blocks, %u free, %u files, %u dirs\n", report->block_num, report->free_blocks,
+        report->files, report->dirs);
+    fprintf(out, "errors: %s free chain, %u bad files, %u bad dirs, %u fatable entries out of range\n",
+        report->free_chain_broken ? "broken" : "sound", report->bad_files, report->bad_dirs, report->bad_entries);
+    fprintf(out, "leaks: %u blocks, %u of them after the block_count of %u files, free block count %s, %u reclaimed\n",
+        report->leaked, report->tail_blocks, report->long_chains, report->free_count_wrong ? "wrong" : "right",
+        report->reclaimed);
+}
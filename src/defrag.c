@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "defrag.h"
+#include "file.h"
+#include "gc.h"
+
+#define DEFRAG_BATCH 64// blocks moved per exclusive hold of the block map, or per compacted run
+
+struct defrag_thread_arg {
+    unsigned int interval;
+    unsigned int rate;
+};
+
+/*
+    counters of the current or last pass, updated atomically
+*/
+static struct {
+    unsigned long long running;
+    unsigned long long passes;
+    unsigned long long files_scanned;
+    unsigned long long files_fragmented;
+    unsigned long long runs_before;
+    unsigned long long runs_after;
+    unsigned long long blocks_moved;
+    unsigned long long blocks_compacted;
+    unsigned long long blocks_truncated;
+} progress;
+
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int defrag_rate = 0;
+
+#define PROGRESS_ADD(field, n) __atomic_add_fetch(&progress.field, (n), __ATOMIC_RELAXED)
+#define PROGRESS_SET(field, n) __atomic_store_n(&progress.field, (n), __ATOMIC_RELAXED)
+#define PROGRESS_GET(field) __atomic_load_n(&progress.field, __ATOMIC_RELAXED)
+
+/*
+    sleep long enough for `moved` blocks to respect defrag_rate
+*/
+static void throttle(block_size_t moved)
+{
+    if (defrag_rate == 0) {
+        return ;
+    }
+    uint64_t ns = (uint64_t) moved * BLOCK_SIZE * 1000000000 / ((uint64_t) defrag_rate << 20);
+    struct timespec ts = {ns / 1000000000, ns % 1000000000};
+    nanosleep(&ts, NULL);
+}
+
+/*
+    move every block but the first of a file into one run
+*/
+static void defrag_file(block_size_t head)
+{
+    struct file_metadata md;
+    block_size_t len, data_len, runs;
+    fileno_t fn = head == 0 ? 0 : try_open_file(head);
+    if (fn == -1) {
+        return ;// removed meanwhile
+    }
+    runs = count_chain_runs(head, &len);
+    PROGRESS_ADD(files_scanned, 1);
+    PROGRESS_ADD(runs_before, runs);
+    // the first block holds the metadata and stays put
+    if (len < 3 || count_chain_runs(get_n_next_block_id(head, 1), &data_len) == 1) {
+        PROGRESS_ADD(runs_after, runs);
+        if (head != 0) {
+            close_file(fn);
+        }
+        return ;
+    }
+    PROGRESS_ADD(files_fragmented, 1);
+
+    begin_unlinked_chain();
+    block_size_t dest = acquire_contiguous_block_chain(data_len), prev = head, pos = 0;
+    while (pos < data_len) {
+        block_size_t count = 0;
+        lock_block_map(true);
+        // the file may have been truncated since the last batch
+        get_metadata(fn, &md);
+        block_size_t limit = md.block_count - 1 < data_len ? md.block_count - 1 : data_len;
+        while (count < DEFRAG_BATCH && pos < limit && relocate_next_block(prev, dest + pos)) {
+            prev = dest + pos;
+            pos++;
+            count++;
+        }
+        unlock_block_map();
+        PROGRESS_ADD(blocks_moved, count);
+        throttle(count);
+        if (count < DEFRAG_BATCH) {
+            break;
+        }
+    }
+    if (pos < data_len) {
+        release_block_chain(dest + pos);// the unused part of the run is still chained
+    }
+    end_unlinked_chain();
+    PROGRESS_ADD(runs_after, count_chain_runs(head, &len));
+    if (head != 0) {
+        close_file(fn);
+    }
+}
+
+/*
+    defrag the root dir and everything below it
+*/
+static void defrag_tree(void)
+{
+    block_size_t *stack = NULL;
+    size_t stack_len = 0, stack_cap = 0;
+    struct dir_record dir;
+    struct file_metadata md;
+    block_size_t head = 0;
+    while (true) {
+        fileno_t fn = head == 0 ? 0 : try_open_file(head);
+        if (fn != -1) {
+            get_metadata(fn, &md);
+            if (md.mode == MODE_ISDIR) {
+                read_dir(fn, &dir);
+                struct dir_entry entry = DIR_ENTRY_INIT;
+                while (next_dir_entry(&dir, &entry)) {
+                    if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+                        continue;
+                    }
+                    if (stack_len == stack_cap) {
+                        stack_cap = stack_cap ? stack_cap * 2 : 256;
+                        stack = realloc(stack, stack_cap * sizeof(block_size_t));
+                        if (stack == NULL) {
+                            perror("defrag_tree() realloc");
+                            exit(1);
+                        }
+                    }
+                    stack[stack_len++] = entry.first_block_id;
+                }
+                destruct_dir_record(&dir);
+            }
+            defrag_file(head);
+            if (head != 0) {
+                close_file(fn);
+            }
+        }
+        if (stack_len == 0) {
+            break;
+        }
+        head = stack[--stack_len];
+    }
+    free(stack);
+}
+
+void defrag_volume(unsigned int rate)
+{
+    block_size_t truncated;
+    pthread_mutex_lock(&defrag_lock);
+    defrag_rate = rate;
+    PROGRESS_SET(running, 1);
+    PROGRESS_SET(files_scanned, 0);
+    PROGRESS_SET(files_fragmented, 0);
+    PROGRESS_SET(runs_before, 0);
+    PROGRESS_SET(runs_after, 0);
+    PROGRESS_SET(blocks_moved, 0);
+    PROGRESS_SET(blocks_compacted, 0);
+    PROGRESS_SET(blocks_truncated, 0);
+
+    // with snapshots, blocks are placed by the physical map, moving block ids gains nothing
+    if (!physical_map_enabled()) {
+        defrag_tree();
+    }
+    PROGRESS_SET(blocks_compacted, compact_block_chains(DEFRAG_BATCH, throttle, &truncated));
+    PROGRESS_SET(blocks_truncated, truncated);
+
+    PROGRESS_ADD(passes, 1);
+    PROGRESS_SET(running, 0);
+    pthread_mutex_unlock(&defrag_lock);
+}
+
+static void *defrag_thread(void *arg)
+{
+    struct defrag_thread_arg config = *(struct defrag_thread_arg *) arg;
+    free(arg);
+    while (true) {
+        defrag_volume(config.rate);
+        printerrf("defrag: %llu of %llu files fragmented, %llu -> %llu runs, "
+            "moved %llu blocks, compacted %llu blocks, truncated %llu blocks\n",
+            PROGRESS_GET(files_fragmented), PROGRESS_GET(files_scanned),
+            PROGRESS_GET(runs_before), PROGRESS_GET(runs_after), PROGRESS_GET(blocks_moved),
+            PROGRESS_GET(blocks_compacted), PROGRESS_GET(blocks_truncated));
+        if (config.interval == 0) {
+            break;
+        }
+        sleep(config.interval);
+    }
+    return NULL;
+}
+
+void start_defrag(unsigned int interval, unsigned int rate)
+{
+    pthread_t tid;
+    struct defrag_thread_arg *arg = malloc(sizeof(struct defrag_thread_arg));
+    if (arg == NULL) {
+        perror("start_defrag() malloc");
+        exit(1);
+    }
+    arg->interval = interval;
+    arg->rate = rate;
+    if (pthread_create(&tid, NULL, defrag_thread, arg) != 0) {
+        perror("start_defrag() pthread_create");
+        exit(1);
+    }
+    pthread_detach(tid);
+}
+
+char *render_defrag_stats(size_t *len)
+{
+    char *buf = NULL;
+    FILE *out = open_memstream(&buf, len);
+    if (out == NULL) {
+        perror("render_defrag_stats() open_memstream");
+        exit(1);
+    }
+    unsigned long long scanned = PROGRESS_GET(files_scanned);
+    fprintf(out, "state %s\n", PROGRESS_GET(running) ? "running" : "idle");
+    fprintf(out, "passes %llu\n", PROGRESS_GET(passes));
+    fprintf(out, "files_scanned %llu\n", scanned);
+    fprintf(out, "files_fragmented %llu\n", PROGRESS_GET(files_fragmented));
+    fprintf(out, "runs_before %llu\n", PROGRESS_GET(runs_before));
+    fprintf(out, "runs_after %llu\n", PROGRESS_GET(runs_after));
+    fprintf(out, "runs_per_file %.2f\n", scanned ? (double) PROGRESS_GET(runs_after) / scanned : 0.0);
+    fprintf(out, "blocks_moved %llu\n", PROGRESS_GET(blocks_moved));
+    fprintf(out, "blocks_compacted %llu\n", PROGRESS_GET(blocks_compacted));
+    fprintf(out, "blocks_truncated %llu\n", PROGRESS_GET(blocks_truncated));
+    fprintf(out, "used_blocks %u\n", (unsigned int) get_used_block_num());
+    fclose(out);
+    return buf;
+}
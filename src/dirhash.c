@@ -0,0 +1,110 @@
+#include <stddef.h>
+#include "dirhash.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+const char *const dir_hash_impl_names[DIR_HASH_IMPL_NUM] = {"scalar", "sse2", "avx2"};
+
+uint32_t dir_name_hash(const char *name)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *) name; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t find_dir_hash_scalar(const uint32_t *hashes, uint32_t from, uint32_t n, uint32_t hash)
+{
+    for (uint32_t i = from; i < n; i++) {
+        if (hashes[i] == hash) {
+            return i;
+        }
+    }
+    return n;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static uint32_t find_dir_hash_sse2(const uint32_t *hashes, uint32_t from, uint32_t n, uint32_t hash)
+{
+    __m128i key = _mm_set1_epi32(hash);
+    uint32_t i = from;
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (hashes + i)), key);
+        __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (hashes + i + 4)), key);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(a)) | _mm_movemask_ps(_mm_castsi128_ps(b)) << 4;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return find_dir_hash_scalar(hashes, i, n, hash);
+}
+
+__attribute__((target("avx2")))
+static uint32_t find_dir_hash_avx2(const uint32_t *hashes, uint32_t from, uint32_t n, uint32_t hash)
+{
+    __m256i key = _mm256_set1_epi32(hash);
+    uint32_t i = from;
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (hashes + i)), key);
+        __m256i b = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (hashes + i + 8)), key);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(a)) | _mm256_movemask_ps(_mm256_castsi256_ps(b)) << 8;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return find_dir_hash_sse2(hashes, i, n, hash);
+}
+#endif
+
+typedef uint32_t (*find_dir_hash_fn)(const uint32_t *, uint32_t, uint32_t, uint32_t);
+static find_dir_hash_fn find_fn = NULL;
+
+bool dir_hash_impl_supported(enum dir_hash_impl impl)
+{
+    switch (impl) {
+    case DIR_HASH_SCALAR:
+        return true;
+#ifdef HAVE_X86_SIMD
+    case DIR_HASH_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case DIR_HASH_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+bool set_dir_hash_impl(enum dir_hash_impl impl)
+{
+    static const find_dir_hash_fn fns[DIR_HASH_IMPL_NUM] = {
+        find_dir_hash_scalar,
+#ifdef HAVE_X86_SIMD
+        find_dir_hash_sse2,
+        find_dir_hash_avx2,
+#endif
+    };
+    if (!dir_hash_impl_supported(impl)) {
+        return false;
+    }
+    __atomic_store_n(&find_fn, fns[impl], __ATOMIC_RELAXED);
+    return true;
+}
+
+uint32_t find_dir_hash(const uint32_t *hashes, uint32_t from, uint32_t n, uint32_t hash)
+{
+    find_dir_hash_fn fn = __atomic_load_n(&find_fn, __ATOMIC_RELAXED);
+    if (fn == NULL) {
+        for (int impl = DIR_HASH_IMPL_NUM - 1; !set_dir_hash_impl(impl); impl--)
+            ;
+        fn = __atomic_load_n(&find_fn, __ATOMIC_RELAXED);
+    }
+    return fn(hashes, from, n, hash);
+}
@@ -5,16 +5,39 @@
 #include <stdbool.h>
 #include <string.h>
 #include "file.h"
+#include "inode.h"
+#include "dirhash.h"
+#include "gc.h"
+#include "probes.h"
 
 struct file_metadata metadatas[FILENO_TABLE_SIZE];
 int occupied[FILENO_TABLE_SIZE];//fileno's reference count
+bool unlinked[FILENO_TABLE_SIZE];//release the blocks at the last close
+bool times_dirty[FILENO_TABLE_SIZE];//only the timestamps changed since the last sync
+bool unsynced[FILENO_TABLE_SIZE];//changed besides the timestamps since the last fsync_file()
+/*
+    set when a file is closed with changes which were never fsynced,
+    the next fsync_file() of any file commits them
+*/
+static bool closed_unsynced = false;
+enum atime_policy atime_policy = ATIME_STRICT;
+bool lazytime = false;
+/*
+    protect occupied, unlinked and the first_block_id of metadatas
+*/
+pthread_mutex_t fileno_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void init_file_module(void)
 {
     memset(occupied, 0, sizeof(occupied));
+    memset(unlinked, 0, sizeof(unlinked));
+    if (!volume_readonly) {
+        load_inode_table(INODE_FILENAME);// a snapshot has loaded its own in mount_snapshot()
+    }
     open_file(0);// rootdir fileno is always 0
     if (need_init_rootdir) {
         need_init_rootdir = false;
+        metadatas[0].block_count = 1;// the fresh fatable gave it a block, its zeroed metadata counts none
         init_empty_dir(0, 0);
         metadatas[0].create_time = metadatas[0].modify_time;
         metadatas[0].mode = MODE_ISDIR;
@@ -34,20 +57,52 @@ file_size_t get_inblock_offset(file_size_t offset)
     return real_offset % BLOCK_SIZE;
 }
 
-fileno_t acquire_fileno(void)
+/*
+    caller should hold fileno_lock
+*/
+static fileno_t acquire_fileno_locked(void)
 {
     for (fileno_t i = 0; i < FILENO_TABLE_SIZE; i++) {
         if (!occupied[i]) {
             occupied[i] = 1;
+            unlinked[i] = false;
+            times_dirty[i] = false;
+            unsynced[i] = false;
             return i;
         }
     }
     return -1;
 }
 
+fileno_t acquire_fileno(void)
+{
+    pthread_mutex_lock(&fileno_lock);
+    fileno_t res = acquire_fileno_locked();
+    pthread_mutex_unlock(&fileno_lock);
+    return res;
+}
+
 void release_fileno(fileno_t fileno)
 {
+    pthread_mutex_lock(&fileno_lock);
     occupied[fileno] = 0;
+    pthread_mutex_unlock(&fileno_lock);
+}
+
+/*
+    get a fileno holding a copy of md
+*/
+static fileno_t install_fileno(const struct file_metadata *md)
+{
+    pthread_mutex_lock(&fileno_lock);
+    fileno_t fileno = acquire_fileno_locked();
+    if (fileno == -1) {
+        printerrf("install_fileno(): not enough fileno\n");
+        exit(1);
+    }
+    metadatas[fileno] = *md;
+    pthread_mutex_unlock(&fileno_lock);
+    return fileno;
 }
 
 bool file_opened(fileno_t fileno)
@@ -57,53 +112,124 @@ bool file_opened(fileno_t fileno)
 
 fileno_t open_file(block_size_t first_block_id)
 {
+    fileno_t fileno = try_open_file(first_block_id);
+    if (fileno == -1) {
+        printerrf("open_file(): memtadata is broken\n");
+        exit(1);
+    }
+    return fileno;
+}
+
+fileno_t try_open_file(block_size_t first_block_id)
+{
+    NAIVE_PROBE1(open_file_entry, first_block_id);
+    pthread_mutex_lock(&fileno_lock);
     for (fileno_t i = 0; i < FILENO_TABLE_SIZE; i++)
         if (file_opened(i) && metadatas[i].first_block_id == first_block_id) {
             occupied[i]++;
+            pthread_mutex_unlock(&fileno_lock);
+            NAIVE_PROBE3(open_file_return, first_block_id, i, occupied[i]);
             return i;
         }
-    uint8_t block_buf[BLOCK_SIZE];
-    read_block(first_block_id, block_buf);
-    fileno_t fileno = acquire_fileno();
+    fileno_t fileno = acquire_fileno_locked();
     if (fileno == -1) {
         printerrf("open_file(): not enough fileno\n");
         exit(1);
     }
-    memcpy(metadatas + fileno, block_buf, sizeof(metadatas[fileno]));
+    if (!get_inode(first_block_id, metadatas + fileno)) {
+        // written before the inode table, the metadata is still at the head of the first block
+        uint8_t *block_buf = take_block_buf();
+        read_block(first_block_id, block_buf);
+        memcpy(metadatas + fileno, block_buf, sizeof(metadatas[fileno]));
+        put_block_buf(block_buf);
+        if (metadatas[fileno].first_block_id == first_block_id) {
+            put_inode(first_block_id, metadatas + fileno, false);
+        }
+    }
     if (metadatas[fileno].first_block_id != first_block_id) {
-        printerrf("open_file(): memtadata is broken\n");
-        exit(1);
+        occupied[fileno] = 0;
+        pthread_mutex_unlock(&fileno_lock);
+        return -1;
     }
+    pthread_mutex_unlock(&fileno_lock);
+    NAIVE_PROBE3(open_file_return, first_block_id, fileno, 1);
     return fileno;
 }
 
 void close_file(fileno_t fileno)
 {
+    assert_fileno_valid(fileno);
+    pthread_mutex_lock(&fileno_lock);
     if (occupied[fileno] > 1) {
         occupied[fileno]--;
-    } else {
-        assert_fileno_valid(fileno);
-        sync_file_metadata(fileno);
-        release_fileno(fileno);
+        pthread_mutex_unlock(&fileno_lock);
+        return ;
+    }
+    if (unsynced[fileno]) {
+        __atomic_store_n(&closed_unsynced, true, __ATOMIC_SEQ_CST);
+    }
+    if (unlinked[fileno]) {
+        drop_inode(metadatas[fileno].first_block_id);
+        release_block_chain(metadatas[fileno].first_block_id);
+    } else if (times_dirty[fileno]) {
+        put_inode(metadatas[fileno].first_block_id, metadatas + fileno, lazytime);
+        times_dirty[fileno] = false;
+    }
+    occupied[fileno] = 0;
+    unlinked[fileno] = false;
+    pthread_mutex_unlock(&fileno_lock);
+}
+
+void remove_file(block_size_t first_block_id)
+{
+    pthread_mutex_lock(&fileno_lock);
+    for (fileno_t i = 0; i < FILENO_TABLE_SIZE; i++) {
+        if (file_opened(i) && metadatas[i].first_block_id == first_block_id) {
+            unlinked[i] = true;
+            pthread_mutex_unlock(&fileno_lock);
+            return ;
+        }
     }
+    drop_inode(first_block_id);
+    release_block_chain(first_block_id);
+    pthread_mutex_unlock(&fileno_lock);
+}
+
+block_size_t list_opened_files(block_size_t **list)
+{
+    block_size_t n = 0;
+    pthread_mutex_lock(&fileno_lock);
+    *list = malloc(FILENO_TABLE_SIZE * sizeof(block_size_t));
+    for (fileno_t i = 0; i < FILENO_TABLE_SIZE; i++) {
+        if (file_opened(i)) {
+            (*list)[n++] = metadatas[i].first_block_id;
+        }
+    }
+    pthread_mutex_unlock(&fileno_lock);
+    return n;
 }
 
 void sync_file_metadata(fileno_t fileno)
 {
     assert_fileno_valid(fileno);
-    uint8_t block_buf[BLOCK_SIZE];
-    read_block(metadatas[fileno].first_block_id, block_buf);
-    memcpy(block_buf, metadatas + fileno, sizeof(metadatas[fileno]));
-    write_block(metadatas[fileno].first_block_id, block_buf);
+    if (volume_readonly) {
+        return ;
+    }
+    put_inode(metadatas[fileno].first_block_id, metadatas + fileno, false);
+    times_dirty[fileno] = false;
+    unsynced[fileno] = true;
 }
 
 void sync_all_metadatas(void)
 {
+    pthread_mutex_lock(&fileno_lock);
     for (fileno_t i = 0; i < FILENO_TABLE_SIZE; i++) {
-        if (occupied[i]) {
+        if (occupied[i] && !unlinked[i]) {
             sync_file_metadata(i);
         }
     }
+    pthread_mutex_unlock(&fileno_lock);
+    sync_inode_table(true);
 }
 
 void get_metadata(fileno_t fileno, struct file_metadata *buf)
@@ -118,18 +244,47 @@ void set_metadata(fileno_t fileno, struct file_metadata *src)
     sync_file_metadata(fileno);
 }
 
+/*
+    set the access time to `now` if atime_policy asks for it
+*/
+static void touch_access_time(fileno_t fileno, time_t now)
+{
+    struct file_metadata *file_info = metadatas + fileno;
+    if (atime_policy == ATIME_NOATIME) {
+        return ;
+    }
+    if (atime_policy == ATIME_RELATIME && file_info->access_time > file_info->modify_time
+        && now - file_info->access_time < RELATIME_INTERVAL) {
+        return ;
+    }
+    if (file_info->access_time != now) {
+        file_info->access_time = now;
+        times_dirty[fileno] = true;
+    }
+}
+
+/*
+    set the modify time to `now`
+*/
+static void touch_modify_time(fileno_t fileno, time_t now)
+{
+    metadatas[fileno].modify_time = now;
+    times_dirty[fileno] = true;
+}
+
 int read_file(fileno_t fileno, uint8_t *buf, file_size_t size, file_size_t offset)
 {
     assert_fileno_valid(fileno);
-    uint8_t block_buf[BLOCK_SIZE];
     struct file_metadata *file_info = metadatas + fileno;
     block_size_t start_blockno, end_blockno;
     file_size_t start_inblock_offset, end_inblock_offset;
     file_size_t end_offset;
-    file_info->access_time = time(NULL);
+    touch_access_time(fileno, time(NULL));
     if (offset >= file_info->file_size) {
         return 0;
     }
+    uint8_t *block_buf = take_block_buf();
+    lock_block_map(false);
     start_blockno = get_blockno(offset);
     start_inblock_offset = get_inblock_offset(offset);
     if (offset + size <= file_info->file_size) {
@@ -147,43 +302,111 @@ int read_file(fileno_t fileno, uint8_t *buf, file_size_t size, file_size_t offse
         block_size_t current_blockid, current_blockno = start_blockno;
         uint8_t *current_buf_loc = buf;
         current_blockid = get_n_next_block_id(file_info->first_block_id, current_blockno);
-        //copy the first block
-        read_block(current_blockid, block_buf);
-        memcpy(current_buf_loc, block_buf + start_inblock_offset, BLOCK_SIZE - start_inblock_offset);
-
-        current_blockid = get_n_next_block_id(current_blockid, 1);
-        current_blockno++;
-        current_buf_loc += BLOCK_SIZE - start_inblock_offset;
-        //copy other entire block
-        while (current_blockno < end_blockno) {
-            read_block(current_blockid, current_buf_loc);
+        //copy the first block, unless it is read entirely with the others
+        if (start_inblock_offset != 0) {
+            read_block(current_blockid, block_buf);
+            memcpy(current_buf_loc, block_buf + start_inblock_offset, BLOCK_SIZE - start_inblock_offset);
 
             current_blockid = get_n_next_block_id(current_blockid, 1);
             current_blockno++;
-            current_buf_loc += BLOCK_SIZE;
+            current_buf_loc += BLOCK_SIZE - start_inblock_offset;
+        }
+        //copy other entire block straight into buf
+        if (current_blockno < end_blockno) {
+            current_blockid = read_blocks(current_blockid, end_blockno - current_blockno, current_buf_loc);
+            current_buf_loc += (file_size_t)(end_blockno - current_blockno) * BLOCK_SIZE;
+        }
+        //copy the last block, an aligned end does not touch it
+        if (end_inblock_offset != 0) {
+            read_block(current_blockid, block_buf);
+            memcpy(current_buf_loc, block_buf, end_inblock_offset);
         }
-        //copy the last block
-        read_block(current_blockid, block_buf);
-        memcpy(current_buf_loc, block_buf, end_inblock_offset);
     }
+    unlock_block_map();
+    put_block_buf(block_buf);
     return end_offset - offset;
 }
 
+/*
+    zero [from, to) of a file, both should be within its block chain
+    whole blocks are punched, partial blocks are written with zeros
+*/
+static void zero_file_range(fileno_t fileno, file_size_t from, file_size_t to)
+{
+    struct file_metadata *file_info = metadatas + fileno;
+    block_size_t start_blockno, end_blockno, blockid;
+    file_size_t start_inblock_offset, end_inblock_offset;
+    if (from >= to) {
+        return ;
+    }
+    uint8_t *block_buf = take_block_buf();
+    start_blockno = get_blockno(from);
+    start_inblock_offset = get_inblock_offset(from);
+    end_blockno = get_blockno(to);
+    end_inblock_offset = get_inblock_offset(to);
+    if (start_blockno == end_blockno) {
+        blockid = get_n_next_block_id(file_info->first_block_id, start_blockno);
+        read_block(blockid, block_buf);
+        memset(block_buf + start_inblock_offset, 0, end_inblock_offset - start_inblock_offset);
+        write_block(blockid, block_buf);
+        put_block_buf(block_buf);
+        return ;
+    }
+    if (start_inblock_offset != 0) {
+        //zero the tail of the first block
+        blockid = get_n_next_block_id(file_info->first_block_id, start_blockno);
+        read_block(blockid, block_buf);
+        memset(block_buf + start_inblock_offset, 0, BLOCK_SIZE - start_inblock_offset);
+        write_block(blockid, block_buf);
+        start_blockno++;
+    }
+    if (end_inblock_offset != 0) {
+        //zero the head of the last block
+        blockid = get_n_next_block_id(file_info->first_block_id, end_blockno);
+        read_block(blockid, block_buf);
+        memset(block_buf, 0, end_inblock_offset);
+        write_block(blockid, block_buf);
+    }
+    put_block_buf(block_buf);
+    if (start_blockno < end_blockno) {
+        blockid = get_n_next_block_id(file_info->first_block_id, start_blockno);
+        punch_block_chain(blockid, end_blockno - start_blockno);
+    }
+}
+
+/*
+    zero the stale bytes between the old file end and `new_size`
+    that are still inside the old last block
+*/
+static void zero_file_gap(fileno_t fileno, file_size_t new_size)
+{
+    file_size_t old_size = metadatas[fileno].file_size;
+    file_size_t block_end = old_size + (BLOCK_SIZE - get_inblock_offset(old_size));
+    if (new_size <= old_size || get_inblock_offset(old_size) == 0) {
+        return ;
+    }
+    zero_file_range(fileno, old_size, new_size < block_end ? new_size : block_end);
+}
+
 int write_file(fileno_t fileno, const uint8_t *buf, file_size_t size, file_size_t offset)
 {
     assert_fileno_valid(fileno);
-    uint8_t block_buf[BLOCK_SIZE];
+    uint8_t *block_buf = take_block_buf();
     struct file_metadata *file_info = metadatas + fileno;
     block_size_t start_blockno, end_blockno;
     file_size_t start_inblock_offset, end_inblock_offset;
     file_size_t end_offset;
-    file_info->access_time = file_info->modify_time = time(NULL);
+    time_t now = time(NULL);
+    touch_modify_time(fileno, now);
+    touch_access_time(fileno, now);
+    lock_block_map(false);
     start_blockno = get_blockno(offset);
     start_inblock_offset = get_inblock_offset(offset);
     end_offset = offset + size;
     end_blockno = get_blockno(end_offset);
     end_inblock_offset = get_inblock_offset(end_offset);
     if (end_offset > file_info->file_size) {
+        zero_file_gap(fileno, offset);
         file_info->file_size = end_offset;
         if (end_blockno >= file_info->block_count) {
             block_size_t new_chain_head = acquire_block_chain(end_blockno + 1 - file_info->block_count);
@@ -201,27 +424,31 @@ int write_file(fileno_t fileno, const uint8_t *buf, file_size_t size, file_size_
         block_size_t current_blockid, current_blockno = start_blockno;
         const uint8_t *current_buf_loc = buf;
         current_blockid = get_n_next_block_id(file_info->first_block_id, current_blockno);
-        //write the first block
-        read_block(current_blockid, block_buf);
-        memcpy(block_buf + start_inblock_offset, current_buf_loc, BLOCK_SIZE - start_inblock_offset);
-        write_block(current_blockid, block_buf);
-
-        current_blockid = get_n_next_block_id(current_blockid, 1);
-        current_blockno++;
-        current_buf_loc += BLOCK_SIZE - start_inblock_offset;
-        //write other entire block
-        while (current_blockno < end_blockno) {
-            write_block(current_blockid, current_buf_loc);
+        //write the first block, unless it is overwritten entirely with the others
+        if (start_inblock_offset != 0) {
+            read_block(current_blockid, block_buf);
+            memcpy(block_buf + start_inblock_offset, current_buf_loc, BLOCK_SIZE - start_inblock_offset);
+            write_block(current_blockid, block_buf);
 
             current_blockid = get_n_next_block_id(current_blockid, 1);
             current_blockno++;
-            current_buf_loc += BLOCK_SIZE;
+            current_buf_loc += BLOCK_SIZE - start_inblock_offset;
+        }
+        //write other entire block straight from buf
+        if (current_blockno < end_blockno) {
+            current_blockid = write_blocks(current_blockid, end_blockno - current_blockno, current_buf_loc);
+            current_buf_loc += (file_size_t)(end_blockno - current_blockno) * BLOCK_SIZE;
+        }
+        //write the last block, an aligned end does not touch it
+        if (end_inblock_offset != 0) {
+            read_block(current_blockid, block_buf);
+            memcpy(block_buf, current_buf_loc, end_inblock_offset);
+            write_block(current_blockid, block_buf);
         }
-        //write the last block
-        read_block(current_blockid, block_buf);
-        memcpy(block_buf, current_buf_loc, end_inblock_offset);
-        write_block(current_blockid, block_buf);
     }
+    unlock_block_map();
+    put_block_buf(block_buf);
+    unsynced[fileno] = true;// after the blocks are written, see fsync_file()
     return end_offset - offset;
 }
 
@@ -232,90 +459,747 @@ bool cut_file(fileno_t fileno, file_size_t size)
         return false;
     }
     block_size_t new_block_count = get_blockno(size) + 1;
+    lock_block_map(false);
     if (new_block_count < file_info->block_count) {
         cut_block_chain_at(file_info->first_block_id, new_block_count);
         file_info->block_count = new_block_count;
     }
+    unlock_block_map();
     file_info->file_size = size;
     sync_file_metadata(fileno);
     return true;
 }
 
-void read_dir(fileno_t fileno, struct dir_record *dest)
+bool allocate_file(fileno_t fileno, file_size_t offset, file_size_t length, bool keep_size)
+{
+    assert_fileno_valid(fileno);
+    struct file_metadata *file_info = metadatas + fileno;
+    if (length == 0 || offset > FILE_SIZE_MAX - length) {
+        return false;
+    }
+    file_size_t end_offset = offset + length;
+    block_size_t start_blockno = get_blockno(offset);
+    block_size_t end_blockno = get_blockno(end_offset - 1);
+    lock_block_map(false);
+    if (end_blockno >= file_info->block_count) {
+        block_size_t new_chain_head = acquire_contiguous_block_chain(end_blockno + 1 - file_info->block_count);
+        merge_block_chain(file_info->first_block_id, new_chain_head);
+        file_info->block_count = end_blockno + 1;
+    }
+    reserve_block_chain(get_n_next_block_id(file_info->first_block_id, start_blockno),
+        end_blockno + 1 - start_blockno);
+    if (!keep_size && end_offset > file_info->file_size) {
+        zero_file_gap(fileno, end_offset);
+        file_info->file_size = end_offset;
+        file_info->modify_time = time(NULL);
+    }
+    unlock_block_map();
+    sync_file_metadata(fileno);
+    return true;
+}
+
+void punch_file(fileno_t fileno, file_size_t offset, file_size_t length)
+{
+    assert_fileno_valid(fileno);
+    struct file_metadata *file_info = metadatas + fileno;
+    if (offset >= file_info->file_size) {
+        return ;
+    }
+    file_size_t end_offset = length > file_info->file_size - offset ? file_info->file_size : offset + length;
+    lock_block_map(false);
+    zero_file_range(fileno, offset, end_offset);
+    unlock_block_map();
+    touch_modify_time(fileno, time(NULL));
+    unsynced[fileno] = true;
+}
+
+/*
+    group commit: fsync_file() waits for a commit which starts after it is called,
+    and every fsync_file() waiting meanwhile is served by that same commit
+*/
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t commit_started = 0, commit_finished = 0;
+static bool committing = false;
+
+static void commit_volume(void)
+{
+    pthread_mutex_lock(&commit_lock);
+    uint64_t target = commit_started + 1;
+    while (commit_finished < target) {
+        if (committing) {
+            pthread_cond_wait(&commit_cond, &commit_lock);
+            continue;
+        }
+        committing = true;
+        uint64_t seq = ++commit_started;
+        pthread_mutex_unlock(&commit_lock);
+        NAIVE_PROBE1(commit_volume_entry, seq);
+        // the blocks first, then the fatable and the inodes pointing to them
+        flush_blockfile();
+        sync_fatable();
+        flush_fatable();
+        sync_inode_table(false);
+        flush_inode_table();
+        NAIVE_PROBE1(commit_volume_return, seq);
+        pthread_mutex_lock(&commit_lock);
+        committing = false;
+        commit_finished = seq;
+        pthread_cond_broadcast(&commit_cond);
+    }
+    pthread_mutex_unlock(&commit_lock);
+}
+
+void fsync_file(fileno_t fileno, bool datasync)
 {
     assert_fileno_valid(fileno);
-    int filename_len;
+    if (volume_readonly) {
+        return ;
+    }
+    bool closed = __atomic_exchange_n(&closed_unsynced, false, __ATOMIC_SEQ_CST);
+    bool times = !datasync && times_dirty[fileno];
+    if (!unsynced[fileno] && !times && !closed) {
+        return ;
+    }
+    if (unsynced[fileno] || times) {
+        sync_file_metadata(fileno);
+    }
+    // cleared before the commit, a write finishing meanwhile sets it again
+    unsynced[fileno] = false;
+    commit_volume();
+}
+
+file_size_t copy_file(fileno_t in, file_size_t offset_in, fileno_t out, file_size_t offset_out, file_size_t length)
+{
+    assert_fileno_valid(in);
+    assert_fileno_valid(out);
+    uint8_t *buf = malloc(COPY_CHUNK_SIZE);
+    if (buf == NULL) {
+        perror("copy_file() malloc");
+        exit(1);
+    }
+    file_size_t copied = 0;
+    while (copied < length) {
+        file_size_t chunk = length - copied < COPY_CHUNK_SIZE ? length - copied : COPY_CHUNK_SIZE;
+        int nbytes = read_file(in, buf, chunk, offset_in + copied);
+        if (nbytes <= 0) {
+            break;
+        }
+        write_file(out, buf, nbytes, offset_out + copied);
+        copied += nbytes;
+    }
+    free(buf);
+    return copied;
+}
+
+bool clone_file(fileno_t src, fileno_t dst)
+{
+    assert_fileno_valid(src);
+    assert_fileno_valid(dst);
+    struct file_metadata *src_info = metadatas + src, *dst_info = metadatas + dst;
+    if (src_info->first_block_id == dst_info->first_block_id) {
+        return false;
+    }
+    lock_block_map(false);
+    if (dst_info->block_count > src_info->block_count) {
+        cut_block_chain_at(dst_info->first_block_id, src_info->block_count);
+    } else if (dst_info->block_count < src_info->block_count) {
+        block_size_t new_chain_head = acquire_block_chain(src_info->block_count - dst_info->block_count);
+        merge_block_chain(dst_info->first_block_id, new_chain_head);
+    }
+    dst_info->block_count = src_info->block_count;
+    dst_info->file_size = src_info->file_size;
+    dst_info->access_time = dst_info->modify_time = time(NULL);
+    //the first block identifies the file, it is copied instead of shared
+    uint8_t *block_buf = take_block_buf();
+    read_block(src_info->first_block_id, block_buf);
+    write_block(dst_info->first_block_id, block_buf);
+    put_block_buf(block_buf);
+    if (src_info->block_count > 1) {
+        share_block_chain(get_n_next_block_id(src_info->first_block_id, 1),
+            get_n_next_block_id(dst_info->first_block_id, 1), src_info->block_count - 1);
+    }
+    unlock_block_map();
+    sync_file_metadata(dst);
+    return true;
+}
+
+/*
+    the dir records of a thread are carved from its arena one after another,
+    a released record at the top is popped, and the arena is rewound once no record of the thread is live
+*/
+struct dir_arena {
+    uint8_t *buf;
+    size_t cap, used;
+    unsigned int live;
+};
+static pthread_key_t dir_arena_key;
+static pthread_once_t dir_arena_once = PTHREAD_ONCE_INIT;
+static __thread struct dir_arena *local_dir_arena = NULL;
+
+static void free_dir_arena(void *p)
+{
+    struct dir_arena *arena = p;
+    free(arena->buf);
+    free(arena);
+}
+
+static void create_dir_arena_key(void)
+{
+    pthread_key_create(&dir_arena_key, free_dir_arena);
+}
+
+static struct dir_arena *get_dir_arena(void)
+{
+    if (local_dir_arena != NULL) {
+        return local_dir_arena;
+    }
+    pthread_once(&dir_arena_once, create_dir_arena_key);
+    local_dir_arena = calloc(1, sizeof(struct dir_arena));
+    if (local_dir_arena == NULL) {
+        perror("get_dir_arena() calloc");
+        exit(1);
+    }
+    pthread_setspecific(dir_arena_key, local_dir_arena);
+    return local_dir_arena;
+}
+
+/*
+    give raw to rec, taken from the arena if it fits, or else malloc()ed
+*/
+static void alloc_dir_raw(struct dir_record *rec, file_size_t cap)
+{
+    struct dir_arena *arena = get_dir_arena();
+    cap = (cap + 7) & ~(file_size_t) 7;// keeps the slots of the next record aligned
+    if (arena->live == 0) {
+        arena->used = 0;
+        if (arena->cap < cap && cap <= DIR_ARENA_MAX) {
+            size_t new_cap = arena->cap ? arena->cap : DIR_ARENA_SIZE;
+            while (new_cap < cap) {
+                new_cap *= 2;
+            }
+            free(arena->buf);
+            arena->buf = malloc(new_cap);
+            if (arena->buf == NULL) {
+                perror("alloc_dir_raw() malloc");
+                exit(1);
+            }
+            arena->cap = new_cap;
+        }
+    }
+    rec->cap = cap;
+    rec->owned = arena->used + cap > arena->cap;
+    if (rec->owned) {
+        rec->raw = malloc(cap);
+        if (rec->raw == NULL) {
+            perror("alloc_dir_raw() malloc");
+            exit(1);
+        }
+    } else {
+        rec->raw = arena->buf + arena->used;
+        arena->used += cap;
+        arena->live++;
+    }
+}
+
+static void free_dir_raw(struct dir_record *rec)
+{
+    if (rec->owned) {
+        free(rec->raw);
+        return ;
+    }
+    struct dir_arena *arena = get_dir_arena();
+    if (rec->raw + rec->cap == arena->buf + arena->used) {
+        arena->used -= rec->cap;
+    }
+    if (--arena->live == 0) {
+        arena->used = 0;
+    }
+}
+
+/*
+    make raw hold at least cap bytes, in place if it is at the top of the arena
+*/
+static void grow_dir_raw(struct dir_record *rec, file_size_t cap)
+{
+    if (cap <= rec->cap) {
+        return ;
+    }
+    cap = cap > rec->cap * 2 ? cap : rec->cap * 2;
+    cap = (cap + 7) & ~(file_size_t) 7;
+    struct dir_arena *arena = get_dir_arena();
+    if (rec->owned) {
+        uint8_t *raw = realloc(rec->raw, cap);
+        if (raw == NULL) {
+            perror("grow_dir_raw() realloc");
+            exit(1);
+        }
+        rec->raw = raw;
+    } else if (rec->raw + rec->cap == arena->buf + arena->used && arena->used - rec->cap + cap <= arena->cap) {
+        arena->used += cap - rec->cap;
+    } else {
+        uint8_t *raw = malloc(cap);
+        if (raw == NULL) {
+            perror("grow_dir_raw() malloc");
+            exit(1);
+        }
+        memcpy(raw, rec->raw, rec->size);
+        free_dir_raw(rec);
+        rec->raw = raw;
+        rec->owned = true;
+    }
+    rec->cap = cap;
+}
+
+/*
+    dir_epochs[fileno] counts the changes of an open dir, a record read before one is out of date
+    the dir lock of a dir is held shared while its file is read, and exclusively while it is changed or compacted
+*/
+static uint32_t dir_epochs[FILENO_TABLE_SIZE];
+static pthread_rwlock_t dir_locks[DIR_LOCK_STRIPES] = {[0 ... DIR_LOCK_STRIPES - 1] = PTHREAD_RWLOCK_INITIALIZER};
+/*
+    first block ids of the dirs waiting for the compactor
+*/
+static block_size_t compact_queue[DIR_COMPACT_QUEUE];
+static unsigned int compact_queue_len = 0;
+static bool compactor_running = false;
+static pthread_t compactor_tid;
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+
+static inline pthread_rwlock_t *dir_lock(fileno_t fileno)
+{
+    return dir_locks + fileno % DIR_LOCK_STRIPES;
+}
+
+static inline uint32_t *dir_hashes(const struct dir_record *dir)
+{
+    return (uint32_t *) (dir->raw + DIR_HEADER_SIZE);
+}
+
+static inline uint32_t *dir_offs(const struct dir_record *dir)
+{
+    return (uint32_t *) (dir->raw + DIR_HEADER_SIZE + dir->slot_cap * sizeof(uint32_t));
+}
+
+static inline file_size_t dir_entries_start(file_count_t slot_cap)
+{
+    return DIR_HEADER_SIZE + slot_cap * 2 * sizeof(uint32_t);
+}
+
+static file_count_t slots_for(file_count_t count)
+{
+    file_count_t slots = DIR_MIN_SLOTS;
+    while (slots < count) {
+        slots *= 2;
+    }
+    return slots;
+}
+
+file_size_t dir_record_size(file_count_t count, file_size_t names_len)
+{
+    return dir_entries_start(slots_for(count)) + count * sizeof(block_size_t) + names_len;
+}
+
+static void write_dir_header(struct dir_record *dir)
+{
+    uint32_t header[] = {dir->file_count, DIR_MAGIC, dir->slot_cap, dir->slot_end, dir->free_slot, dir->dead_bytes};
+    memcpy(dir->raw, header, sizeof(header));
+}
+
+static inline bool dir_needs_compaction(const struct dir_record *dir)
+{
+    return dir->dead_bytes >= DIR_COMPACT_MIN && dir->dead_bytes * 2 >= dir->size - dir_entries_start(dir->slot_cap);
+}
+
+/*
+    lay out raw anew with slot_cap slots, the live entries take the first ones and are packed after them
+*/
+static void pack_dir(struct dir_record *dir, file_count_t slot_cap)
+{
+    struct dir_record old = *dir;
+    const uint32_t *old_hashes = dir_hashes(&old);
+    struct dir_entry entry = DIR_ENTRY_INIT;
+    file_size_t size = dir_entries_start(slot_cap);
+    while (next_dir_entry(&old, &entry)) {
+        size += entry.next - entry.off;
+    }
+    alloc_dir_raw(dir, size);
+    dir->slot_cap = slot_cap;
+    dir->slot_end = 0;
+    dir->free_slot = DIR_SLOT_NONE;
+    dir->dead_bytes = 0;
+    dir->stale = true;
+    dir->size = dir_entries_start(slot_cap);
+    uint32_t *hashes = dir_hashes(dir), *offs = dir_offs(dir);
+    entry = (struct dir_entry) DIR_ENTRY_INIT;
+    while (next_dir_entry(&old, &entry)) {
+        memcpy(dir->raw + dir->size, old.raw + entry.off, entry.next - entry.off);
+        hashes[dir->slot_end] = old_hashes[entry.seen - 1];
+        offs[dir->slot_end++] = dir->size;
+        dir->size += entry.next - entry.off;
+    }
+    dir->file_count = dir->slot_end;
+    write_dir_header(dir);
+    free_dir_raw(&old);
+}
+
+/*
+    lay out a dir of an older format like the others, in memory
+    v1 dirs keep their slot_cap slots, the others get the hashes and the offsets of their entries
+*/
+static void upgrade_dir(struct dir_record *dir, bool v1, file_count_t slot_cap)
+{
+    file_size_t from = v1 ? DIR_HEADER_V1_SIZE : sizeof(file_count_t);
+    file_size_t to = v1 ? DIR_HEADER_SIZE : dir_entries_start(slot_cap);
+    grow_dir_raw(dir, dir->size + to - from);
+    memmove(dir->raw + to, dir->raw + from, dir->size - from);
+    dir->size += to - from;
+    dir->slot_cap = slot_cap;
+    dir->slot_end = dir->file_count;
+    dir->free_slot = DIR_SLOT_NONE;
+    dir->dead_bytes = 0;
+    dir->stale = true;
+    uint32_t *hashes = dir_hashes(dir), *offs = dir_offs(dir);
+    file_size_t off = to;
+    for (file_count_t i = 0; i < dir->file_count; i++) {
+        if (v1) {
+            offs[i] += to - from;
+            continue;
+        }
+        file_size_t name_off = off + sizeof(block_size_t);
+        const uint8_t *name_end = name_off < dir->size ? memchr(dir->raw + name_off, '\0', dir->size - name_off) : NULL;
+        if (name_end == NULL) {
+            printerrf("upgrade_dir(): bad file_size\n");
+            exit(1);
+        }
+        offs[i] = off;
+        hashes[i] = dir_name_hash((const char *) dir->raw + name_off);
+        off = name_end + 1 - dir->raw;
+    }
+    write_dir_header(dir);
+}
+
+/*
+    caller holds the dir lock of fileno
+*/
+static void read_dir_locked(fileno_t fileno, struct dir_record *dest)
+{
     struct file_metadata *file_info = metadatas + fileno;
     if (file_info->mode != MODE_ISDIR) {
         printerrf("read_dir(): given fileno isn't dir\n");
         exit(1);
     }
-    uint8_t *raw_buf = malloc(file_info->file_size), *raw_buf_pos = raw_buf;
-    read_file(fileno, raw_buf, file_info->file_size, 0);// read the hole file
-    memcpy(&dest->file_count, raw_buf_pos, sizeof(file_count_t));
-    raw_buf_pos += sizeof(file_count_t);
-
+    file_size_t size = file_info->file_size;
+    if (size < sizeof(file_count_t)) {
+        printerrf("read_dir(): bad file_size\n");
+        exit(1);
+    }
     dest->dir_fileno = fileno;
-    dest->list_first_block_id = malloc(dest->file_count * sizeof(block_size_t));
-    dest->list_filename = malloc(dest->file_count * sizeof(char *));
-    for (file_count_t i = 0; i < dest->file_count; i++) {
-        if (raw_buf_pos >= raw_buf + file_info->file_size) {
-            printerrf("read_dir(): bad file_size\n");
+    dest->epoch = dir_epochs[fileno];
+    dest->stale = false;
+    alloc_dir_raw(dest, size);
+    dest->size = read_file(fileno, dest->raw, size, 0);// read the hole file
+    uint32_t header[6] = {0, 0, 0, 0, 0, 0};
+    memcpy(header, dest->raw, dest->size < sizeof(header) ? dest->size : sizeof(header));
+    dest->file_count = header[0];
+    if (header[1] == DIR_MAGIC) {
+        dest->slot_cap = header[2];
+        dest->slot_end = header[3];
+        dest->free_slot = header[4];
+        dest->dead_bytes = header[5];
+        if (dest->size < DIR_HEADER_SIZE || dest->slot_cap > dest->size / (2 * sizeof(uint32_t))
+            || dir_entries_start(dest->slot_cap) > dest->size || dest->slot_end > dest->slot_cap
+            || dest->file_count > dest->slot_end
+            || (dest->free_slot != DIR_SLOT_NONE && dest->free_slot >= dest->slot_end)) {
+            printerrf("read_dir(): bad dir slots\n");
             exit(1);
         }
-        memcpy(&(dest->list_first_block_id[i]), raw_buf_pos, sizeof(block_size_t));
-        raw_buf_pos += sizeof(block_size_t);
+    } else if (header[1] == DIR_MAGIC_V1) {
+        if (dest->size < DIR_HEADER_V1_SIZE || header[2] > dest->size / (2 * sizeof(uint32_t))
+            || DIR_HEADER_V1_SIZE + header[2] * 2 * sizeof(uint32_t) > dest->size || header[2] < dest->file_count) {
+            printerrf("read_dir(): bad dir slots\n");
+            exit(1);
+        }
+        upgrade_dir(dest, true, header[2]);
+    } else {
+        upgrade_dir(dest, false, slots_for(dest->file_count));
+    }
+}
+
+void read_dir(fileno_t fileno, struct dir_record *dest)
+{
+    NAIVE_PROBE1(read_dir_entry, fileno);
+    assert_fileno_valid(fileno);
+    pthread_rwlock_rdlock(dir_lock(fileno));
+    read_dir_locked(fileno, dest);
+    pthread_rwlock_unlock(dir_lock(fileno));
+    NAIVE_PROBE3(read_dir_return, fileno, dest->file_count, dest->size);
+}
 
-        filename_len = strlen((const char *)raw_buf_pos) + 1;
-        dest->list_filename[i] = malloc(filename_len * sizeof(char));
-        memcpy(dest->list_filename[i], raw_buf_pos, filename_len);
-        raw_buf_pos += filename_len;
+static void write_dir_locked(const struct dir_record *dir)
+{
+    NAIVE_PROBE2(write_dir_entry, dir->dir_fileno, dir->file_count);
+    write_file(dir->dir_fileno, dir->raw, dir->size, 0);
+    if (metadatas[dir->dir_fileno].file_size > dir->size) {
+        cut_file(dir->dir_fileno, dir->size);
     }
+    NAIVE_PROBE2(write_dir_return, dir->dir_fileno, dir->size);
 }
 
 void write_dir(const struct dir_record *dir)
 {
-    int buflen = sizeof(dir->file_count), bufoff = 0;
-    for (file_count_t i = 0; i < dir->file_count; i++) {
-        buflen += sizeof(dir->list_first_block_id[i]);
-        buflen += strlen(dir->list_filename[i]) + 1;
+    pthread_rwlock_wrlock(dir_lock(dir->dir_fileno));
+    write_dir_locked(dir);
+    dir_epochs[dir->dir_fileno]++;
+    pthread_rwlock_unlock(dir_lock(dir->dir_fileno));
+}
+
+/*
+    write a slot of dir to its file, with its hash if `hash` is set
+*/
+static void write_dir_slot(const struct dir_record *dir, file_count_t slot, bool hash)
+{
+    if (hash) {
+        write_file(dir->dir_fileno, (const uint8_t *) (dir_hashes(dir) + slot), sizeof(uint32_t),
+            DIR_HEADER_SIZE + slot * sizeof(uint32_t));
     }
-    uint8_t buf[buflen];
-    memcpy(buf + bufoff, &dir->file_count, sizeof(dir->file_count));
-    bufoff += sizeof(dir->file_count);
-    for (file_count_t i = 0; i < dir->file_count; i++) {
-        memcpy(buf + bufoff, &(dir->list_first_block_id[i]), sizeof(dir->list_first_block_id[i]));
-        bufoff += sizeof(dir->list_first_block_id[i]);
-        int pathlen = strlen(dir->list_filename[i]) + 1;
-        memcpy(buf + bufoff, dir->list_filename[i], pathlen);
-        bufoff += pathlen;
+    write_file(dir->dir_fileno, (const uint8_t *) (dir_offs(dir) + slot), sizeof(uint32_t),
+        DIR_HEADER_SIZE + (dir->slot_cap + slot) * sizeof(uint32_t));
+}
+
+/*
+    read dir again if it was changed since it was read, caller holds its dir lock
+    returns false if it was not
+*/
+static bool refresh_dir_record(struct dir_record *dir)
+{
+    if (dir->epoch == dir_epochs[dir->dir_fileno]) {
+        return false;
     }
-    write_file(dir->dir_fileno, buf, buflen, 0);
-    if (metadatas[dir->dir_fileno].file_size > buflen) {
-        cut_file(dir->dir_fileno, buflen);
+    fileno_t fileno = dir->dir_fileno;
+    free_dir_raw(dir);
+    read_dir_locked(fileno, dir);
+    return true;
+}
+
+/*
+    count a change of dir made through its record, which stays up to date, caller holds its dir lock
+*/
+static void dir_record_changed(struct dir_record *dir)
+{
+    dir->epoch = ++dir_epochs[dir->dir_fileno];
+}
+
+/*
+    compact an open dir if it still has enough dead bytes
+*/
+static void compact_dir(fileno_t fileno)
+{
+    struct dir_record dir;
+    pthread_rwlock_wrlock(dir_lock(fileno));
+    read_dir_locked(fileno, &dir);
+    if (dir_needs_compaction(&dir)) {
+        NAIVE_PROBE2(compact_dir_entry, fileno, dir.dead_bytes);
+        pack_dir(&dir, slots_for(dir.file_count));
+        write_dir_locked(&dir);
+        dir_epochs[fileno]++;
+        NAIVE_PROBE2(compact_dir_return, fileno, dir.size);
     }
+    pthread_rwlock_unlock(dir_lock(fileno));
+    free_dir_raw(&dir);
 }
 
-void destruct_dir_record(struct dir_record *rec)
+/*
+    hand an open dir to the compactor, or compact it now if there is none
+*/
+static void queue_dir_compaction(fileno_t fileno)
+{
+    block_size_t id = metadatas[fileno].first_block_id;
+    pthread_mutex_lock(&compact_lock);
+    bool running = compactor_running;
+    if (running) {
+        unsigned int i = 0;
+        while (i < compact_queue_len && compact_queue[i] != id) {
+            i++;
+        }
+        if (i == compact_queue_len && compact_queue_len < DIR_COMPACT_QUEUE) {
+            compact_queue[compact_queue_len++] = id;
+            pthread_cond_signal(&compact_cond);
+        }
+    }
+    pthread_mutex_unlock(&compact_lock);
+    if (!running) {
+        compact_dir(fileno);
+    }
+}
+
+static void *dir_compactor_thread(void *arg)
+{
+    pthread_mutex_lock(&compact_lock);
+    while (compactor_running) {
+        if (compact_queue_len == 0) {
+            pthread_cond_wait(&compact_cond, &compact_lock);
+            continue;
+        }
+        block_size_t id = compact_queue[--compact_queue_len];
+        pthread_mutex_unlock(&compact_lock);
+        fileno_t fn = id == 0 ? 0 : try_open_file(id);
+        if (fn != -1 && metadatas[fn].mode == MODE_ISDIR) {
+            compact_dir(fn);
+        }
+        if (fn > 0) {
+            close_file(fn);
+        }
+        pthread_mutex_lock(&compact_lock);
+    }
+    pthread_mutex_unlock(&compact_lock);
+    return NULL;
+}
+
+void start_dir_compactor(void)
+{
+    compactor_running = true;
+    if (pthread_create(&compactor_tid, NULL, dir_compactor_thread, NULL) != 0) {
+        perror("start_dir_compactor() pthread_create");
+        exit(1);
+    }
+}
+
+void stop_dir_compactor(void)
 {
-    free(rec->list_first_block_id);
-    for (file_count_t i = 0; i < rec->file_count; i++) {
-        free(rec->list_filename[i]);
+    pthread_mutex_lock(&compact_lock);
+    if (!compactor_running) {
+        pthread_mutex_unlock(&compact_lock);
+        return ;
     }
-    free(rec->list_filename);
-    if (rec->dir_fileno != 0) {
+    compactor_running = false;
+    compact_queue_len = 0;
+    pthread_cond_signal(&compact_cond);
+    pthread_mutex_unlock(&compact_lock);
+    pthread_join(compactor_tid, NULL);
+}
+
+void destruct_dir_record(struct dir_record *rec)
+{
+    free_dir_raw(rec);
+    if (rec->dir_fileno > 0) {
         close_file(rec->dir_fileno);
     }
 }
 
-file_count_t find_name_in_dir_record(const char *name, struct dir_record *rec)
+void init_dir_record(struct dir_record *rec, block_size_t self_id, block_size_t parent_id)
 {
-    for (file_count_t i = 0; i < rec->file_count; i++) {
-        if (strcmp(name, rec->list_filename[i]) == 0) {
-            return i;
+    rec->dir_fileno = -1;
+    rec->epoch = 0;
+    rec->stale = false;
+    alloc_dir_raw(rec, EMPTY_DIR_SIZE);
+    rec->file_count = 0;
+    rec->slot_cap = DIR_MIN_SLOTS;
+    rec->slot_end = 0;
+    rec->free_slot = DIR_SLOT_NONE;
+    rec->dead_bytes = 0;
+    rec->size = dir_entries_start(DIR_MIN_SLOTS);
+    write_dir_header(rec);
+    add_item_in_dir(rec, self_id, ".");
+    add_item_in_dir(rec, parent_id, "..");
+}
+
+bool next_dir_entry(const struct dir_record *dir, struct dir_entry *entry)
+{
+    const uint32_t *offs = dir_offs(dir);
+    while (entry->seen < dir->slot_end && (offs[entry->seen] & DIR_SLOT_DEAD)) {
+        entry->seen++;
+    }
+    if (entry->seen == dir->slot_end) {
+        return false;
+    }
+    file_size_t off = offs[entry->seen];
+    file_size_t name_off = off + sizeof(block_size_t);
+    const uint8_t *name_end = name_off < dir->size ? memchr(dir->raw + name_off, '\0', dir->size - name_off) : NULL;
+    if (name_end == NULL) {
+        printerrf("next_dir_entry(): bad file_size\n");
+        exit(1);
+    }
+    memcpy(&entry->first_block_id, dir->raw + off, sizeof(block_size_t));
+    entry->name = (const char *) dir->raw + name_off;
+    entry->off = off;
+    entry->next = name_end + 1 - dir->raw;
+    entry->seen++;
+    return true;
+}
+
+bool find_name_in_dir_record(const char *name, const struct dir_record *rec, struct dir_entry *entry)
+{
+    *entry = (struct dir_entry) DIR_ENTRY_INIT;
+    uint32_t hash = dir_name_hash(name);
+    const uint32_t *hashes = dir_hashes(rec), *offs = dir_offs(rec);
+    for (file_count_t i = find_dir_hash(hashes, 0, rec->slot_end, hash); i < rec->slot_end;
+        i = find_dir_hash(hashes, i + 1, rec->slot_end, hash)) {
+        if (offs[i] & DIR_SLOT_DEAD) {
+            continue;// a tombstone keeps the hash of its entry
+        }
+        entry->seen = i;
+        next_dir_entry(rec, entry);
+        if (strcmp(name, entry->name) == 0) {
+            return true;
         }
     }
-    return FILE_COUNT_MAX;
+    return false;
+}
+
+/*
+    caller holds the dir lock of dir
+*/
+static void link_dir_entry_locked(struct dir_record *dir, block_size_t first_block_id, const char *name)
+{
+    file_size_t off = dir->size;
+    file_count_t slot = add_item_in_dir(dir, first_block_id, name);
+    if (dir->stale) {
+        write_dir_locked(dir);
+        dir->stale = false;
+    } else {
+        write_file(dir->dir_fileno, dir->raw + off, dir->size - off, off);
+        write_dir_slot(dir, slot, true);
+        write_file(dir->dir_fileno, dir->raw, DIR_HEADER_SIZE, 0);
+    }
+    dir_record_changed(dir);
+}
+
+void link_dir_entry(struct dir_record *dir, block_size_t first_block_id, const char *name)
+{
+    pthread_rwlock_wrlock(dir_lock(dir->dir_fileno));
+    refresh_dir_record(dir);
+    link_dir_entry_locked(dir, first_block_id, name);
+    pthread_rwlock_unlock(dir_lock(dir->dir_fileno));
+}
+
+bool unlink_dir_entry(struct dir_record *dir, const struct dir_entry *entry)
+{
+    struct dir_entry found = *entry;
+    char name[strlen(entry->name) + 1];
+    strcpy(name, entry->name);
+    pthread_rwlock_wrlock(dir_lock(dir->dir_fileno));
+    if (refresh_dir_record(dir)
+        && (!find_name_in_dir_record(name, dir, &found) || found.first_block_id != entry->first_block_id)) {
+        pthread_rwlock_unlock(dir_lock(dir->dir_fileno));
+        return false;
+    }
+    remove_item_in_dir(dir, &found);
+    if (dir->stale) {
+        write_dir_locked(dir);
+        dir->stale = false;
+    } else {
+        write_dir_slot(dir, found.seen - 1, false);
+        write_file(dir->dir_fileno, dir->raw, DIR_HEADER_SIZE, 0);
+    }
+    dir_record_changed(dir);
+    bool compact = dir_needs_compaction(dir);
+    pthread_rwlock_unlock(dir_lock(dir->dir_fileno));
+    if (compact) {
+        queue_dir_compaction(dir->dir_fileno);
+    }
+    return true;
 }
 
 fileno_t create_file(fileno_t dir_fileno, const char *filename, bool is_dir)
@@ -323,20 +1207,52 @@ fileno_t create_file(fileno_t dir_fileno, const char *filename, bool is_dir)
     assert_fileno_valid(dir_fileno);
     int filename_len = strlen(filename) + 1;
     uint8_t buf[sizeof(block_size_t) + filename_len];
-    fileno_t fileno = acquire_fileno();
+    struct file_metadata new_info;
+    // the block is opened before a garbage scan can start, see begin_block_scan(),
+    // and a scan reading the dir before the entry is linked gives up
+    begin_namespace_change();
+    lock_block_map(false);
+    new_info.first_block_id = acquire_block_chain(1);
+    new_info.block_count = 1;
+    new_info.file_size = 0;
+    new_info.mode = is_dir ? MODE_ISDIR : MODE_ISREG;
+    new_info.create_time = new_info.modify_time = new_info.access_time = time(NULL);
+    fileno_t fileno = install_fileno(&new_info);
+    unlock_block_map();
     struct file_metadata *fileinfo = metadatas + fileno;
-    fileinfo->first_block_id = acquire_block_chain(1);
-    fileinfo->block_count = 1;
-    fileinfo->file_size = 0;
-    fileinfo->mode = is_dir ? MODE_ISDIR : MODE_ISREG;
-    fileinfo->create_time = fileinfo->modify_time = fileinfo->access_time = time(NULL);
-    memcpy(buf, &fileinfo->first_block_id, sizeof(block_size_t));
-    memcpy(buf + sizeof(block_size_t), filename, filename_len);
-    write_file(dir_fileno, buf, sizeof(buf), metadatas[dir_fileno].file_size);// write info in dir
-    file_count_t count;
-    read_file(dir_fileno, (uint8_t *) &count, sizeof(file_count_t), 0);
-    count++;
-    write_file(dir_fileno, (uint8_t *) &count, sizeof(file_count_t), 0);
+    pthread_rwlock_wrlock(dir_lock(dir_fileno));
+    uint32_t header[6] = {0, 0, 0, 0, 0, 0};
+    read_file(dir_fileno, (uint8_t *) header, DIR_HEADER_SIZE, 0);
+    file_count_t slot_cap = header[2], slot = header[3], free_slot = header[4];
+    bool tombstone = free_slot < slot;
+    if (header[1] == DIR_MAGIC && slot <= slot_cap && (tombstone || (free_slot == DIR_SLOT_NONE && slot < slot_cap))) {
+        // take a slot, append the entry, fill the slot, then count it
+        uint32_t hash = dir_name_hash(filename), off = metadatas[dir_fileno].file_size;
+        if (tombstone) {
+            uint32_t next;
+            read_file(dir_fileno, (uint8_t *) &next, sizeof(next), DIR_HEADER_SIZE + (slot_cap + free_slot) * sizeof(uint32_t));
+            slot = free_slot;
+            header[4] = next & ~DIR_SLOT_DEAD;
+        } else {
+            header[3]++;
+        }
+        header[0]++;
+        memcpy(buf, &fileinfo->first_block_id, sizeof(block_size_t));
+        memcpy(buf + sizeof(block_size_t), filename, filename_len);
+        write_file(dir_fileno, buf, sizeof(buf), off);// write info in dir
+        write_file(dir_fileno, (uint8_t *) &hash, sizeof(hash), DIR_HEADER_SIZE + slot * sizeof(uint32_t));
+        write_file(dir_fileno, (uint8_t *) &off, sizeof(off), DIR_HEADER_SIZE + (slot_cap + slot) * sizeof(uint32_t));
+        write_file(dir_fileno, (uint8_t *) header, DIR_HEADER_SIZE, 0);
+        dir_epochs[dir_fileno]++;// the records read before miss the entry
+    } else {
+        // the slots are full, or the dir is of an older format
+        struct dir_record dir;
+        read_dir_locked(dir_fileno, &dir);
+        link_dir_entry_locked(&dir, fileinfo->first_block_id, filename);
+        free_dir_raw(&dir);
+    }
+    pthread_rwlock_unlock(dir_lock(dir_fileno));
+    end_namespace_change();
     if (is_dir) {
         init_empty_dir(fileno, metadatas[dir_fileno].first_block_id);
     }
@@ -347,49 +1263,45 @@ fileno_t create_file(fileno_t dir_fileno, const char *filename, bool is_dir)
 void init_empty_dir(fileno_t fileno, block_size_t father_block_id)
 {
     assert_fileno_valid(fileno);
-    uint8_t buf[EMPTY_DIR_SIZE];
-    block_size_t block_id = metadatas[fileno].first_block_id;
-    int buf_off = 0;
-    file_count_t c = 2;
-    memcpy(buf, &c, sizeof(file_count_t));
-    buf_off += sizeof(file_count_t);
-    memcpy(buf + buf_off, &block_id, sizeof(block_size_t));
-    buf_off += sizeof(block_size_t);
-    memcpy(buf + buf_off, ".", sizeof("."));
-    buf_off += sizeof(".");
-    memcpy(buf + buf_off, &father_block_id, sizeof(block_size_t));
-    buf_off += sizeof(block_size_t);
-    memcpy(buf + buf_off, "..", sizeof(".."));
-    write_file(fileno, buf, EMPTY_DIR_SIZE, 0);
-}
-
-void add_item_in_dir(struct dir_record *dir, block_size_t first_blockid, const char *name)
-{
-    file_count_t file_count = dir->file_count + 1;
-    block_size_t *list_first_block_id = malloc(file_count * sizeof(block_size_t));
-    char **list_filename = malloc(file_count * sizeof(char *));
-    for (file_count_t i = 0; i < dir->file_count; i++) {
-        list_first_block_id[i] = dir->list_first_block_id[i];
-        list_filename[i] = dir->list_filename[i];
-    }
-    list_first_block_id[file_count - 1] = first_blockid;
-    list_filename[file_count - 1] = malloc((strlen(name) + 1) * sizeof(char));
-    strcpy(list_filename[file_count - 1], name);
-
-    //TODO: release mem manually
-    free(dir->list_first_block_id);
-    free(dir->list_filename);
-    dir->file_count = file_count;
-    dir->list_first_block_id = list_first_block_id;
-    dir->list_filename = list_filename;
+    struct dir_record dir;
+    init_dir_record(&dir, metadatas[fileno].first_block_id, father_block_id);
+    write_file(fileno, dir.raw, dir.size, 0);
+    destruct_dir_record(&dir);
 }
 
-void remove_item_in_dir(struct dir_record *dir, file_count_t index)
+file_count_t add_item_in_dir(struct dir_record *dir, block_size_t first_blockid, const char *name)
 {
-    free(dir->list_filename[index]);
-    while (++index < dir->file_count) {
-        dir->list_first_block_id[index - 1] = dir->list_first_block_id[index];
-        dir->list_filename[index - 1] = dir->list_filename[index];
+    if (dir->free_slot == DIR_SLOT_NONE && dir->slot_end == dir->slot_cap) {
+        pack_dir(dir, slots_for(dir->file_count + 1));
     }
+    file_count_t slot = dir->free_slot;
+    if (slot != DIR_SLOT_NONE) {
+        dir->free_slot = dir_offs(dir)[slot] & ~DIR_SLOT_DEAD;
+        if (dir->free_slot != DIR_SLOT_NONE && dir->free_slot >= dir->slot_end) {
+            printerrf("add_item_in_dir(): bad dir slots\n");
+            exit(1);
+        }
+    } else {
+        slot = dir->slot_end++;
+    }
+    file_size_t name_len = strlen(name) + 1;
+    grow_dir_raw(dir, dir->size + sizeof(block_size_t) + name_len);
+    memcpy(dir->raw + dir->size, &first_blockid, sizeof(block_size_t));
+    memcpy(dir->raw + dir->size + sizeof(block_size_t), name, name_len);
+    dir_hashes(dir)[slot] = dir_name_hash(name);
+    dir_offs(dir)[slot] = dir->size;
+    dir->size += sizeof(block_size_t) + name_len;
+    dir->file_count++;
+    write_dir_header(dir);
+    return slot;
+}
+
+void remove_item_in_dir(struct dir_record *dir, const struct dir_entry *entry)
+{
+    file_count_t slot = entry->seen - 1;
+    dir_offs(dir)[slot] = DIR_SLOT_DEAD | dir->free_slot;
+    dir->free_slot = slot;
+    dir->dead_bytes += entry->next - entry->off;
     dir->file_count--;
+    write_dir_header(dir);
 }
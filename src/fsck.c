@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "base.h"
+#include "block.h"
+#include "inode.h"
+#include "check.h"
+#include "stats.h"
+
+static void usage(const char *prog)
+{
+    printerrf("usage: %s [options] volume-dir\n"
+        "  check the volume in volume-dir, which should not be mounted\n"
+        "  exits with 0 if it is sound, 1 if it has errors, 2 if it only has leaked blocks left\n"
+        "  -j threads    threads checking the fatable and the dirs, up to %d (default one per CPU)\n"
+        "  -r            release the leaked blocks and fix the free block count, if there are no errors\n",
+        prog, CHECK_MAX_THREADS);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    unsigned int threads = 0;
+    bool repair = false;
+    while ((opt = getopt(argc, argv, "j:r")) != -1) {
+        switch (opt) {
+        case 'j': threads = strtoul(optarg, NULL, 0); break;
+        case 'r': repair = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || threads > CHECK_MAX_THREADS) {
+        usage(argv[0]);
+    }
+    if (chdir(argv[optind]) == -1) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (access(FATABLE_FILENAME, F_OK) != 0 || access(BLOCKFILE_FILENAME, F_OK) != 0) {
+        printerrf("%s holds no volume\n", argv[optind]);
+        return 1;
+    }
+    if (volume_in_use()) {
+        printerrf("%s is in use by naivevfs or another naivevfs-fsck\n", argv[optind]);
+        return 1;
+    }
+
+    uint64_t start_ns = stats_now_ns();
+    init_block_module();
+    load_inode_table(INODE_FILENAME);
+    struct check_report report;
+    bool ok = check_volume(threads, repair, &report);
+    double secs = (stats_now_ns() - start_ns) / 1e9;
+    print_check_report(&report, stdout);
+    printf("%.2f s, %.0f MB of blocks\n", secs, (double) report.block_num * BLOCK_SIZE / 1048576.0);
+    if (!ok) {
+        return 1;
+    }
+    return check_found_leaks(&report) && !repair ? 2 : 0;
+}
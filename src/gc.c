@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "gc.h"
+#include "file.h"
+
+/*
+    namespace changes in progress, and the number of them started so far:
+    a scan trusts its marks if none was in progress when it started and none started meanwhile
+*/
+static uint64_t namespace_changing = 0;
+static uint64_t namespace_generation = 0;
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void begin_namespace_change(void)
+{
+    __atomic_add_fetch(&namespace_changing, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&namespace_generation, 1, __ATOMIC_SEQ_CST);
+}
+
+void end_namespace_change(void)
+{
+    __atomic_sub_fetch(&namespace_changing, 1, __ATOMIC_SEQ_CST);
+}
+
+void begin_unlinked_chain(void)
+{
+    pthread_mutex_lock(&gc_lock);
+}
+
+void end_unlinked_chain(void)
+{
+    pthread_mutex_unlock(&gc_lock);
+}
+
+struct block_stack {
+    block_size_t *ids;
+    size_t len;
+    size_t cap;
+};
+
+static void push_block(struct block_stack *stack, block_size_t id)
+{
+    if (stack->len == stack->cap) {
+        stack->cap = stack->cap ? stack->cap * 2 : 256;
+        stack->ids = realloc(stack->ids, stack->cap * sizeof(block_size_t));
+        if (stack->ids == NULL) {
+            perror("push_block() realloc");
+            exit(1);
+        }
+    }
+    stack->ids[stack->len++] = id;
+}
+
+/*
+    mark every file reachable from the root dir
+*/
+static void mark_tree(uint8_t *reachable, block_size_t n)
+{
+    struct block_stack stack = {NULL, 0, 0};
+    struct dir_record dir;
+    struct file_metadata md;
+    push_block(&stack, 0);
+    while (stack.len > 0) {
+        block_size_t id = stack.ids[--stack.len];
+        if (mark_block_chain(id, reachable, n, false) == 0) {
+            continue;// visited
+        }
+        // rootdir is always opened as fileno 0
+        fileno_t fn = id == 0 ? 0 : try_open_file(id);
+        if (fn == -1) {
+            continue;// removed meanwhile
+        }
+        get_metadata(fn, &md);
+        if (md.mode != MODE_ISDIR) {
+            close_file(fn);
+            continue;
+        }
+        read_dir(fn, &dir);
+        struct dir_entry entry = DIR_ENTRY_INIT;
+        while (next_dir_entry(&dir, &entry)) {
+            if (strcmp(entry.name, ".") != 0 && strcmp(entry.name, "..") != 0) {
+                push_block(&stack, entry.first_block_id);
+            }
+        }
+        destruct_dir_record(&dir);
+    }
+    free(stack.ids);
+}
+
+block_size_t collect_garbage(void)
+{
+    uint8_t *reachable;
+    block_size_t *opened;
+    pthread_mutex_lock(&gc_lock);
+    uint64_t generation = __atomic_load_n(&namespace_generation, __ATOMIC_SEQ_CST);
+    bool changing = __atomic_load_n(&namespace_changing, __ATOMIC_SEQ_CST) > 0;
+    block_size_t n = begin_block_scan(&reachable);
+    mark_tree(reachable, n);
+    block_size_t opened_num = list_opened_files(&opened);
+    for (block_size_t i = 0; i < opened_num; i++) {
+        mark_block_chain(opened[i], reachable, n, true);
+    }
+    free(opened);
+    if (changing || generation != __atomic_load_n(&namespace_generation, __ATOMIC_SEQ_CST)) {
+        // a file may have been moved to a dir already scanned, keep everything
+        memset(reachable, 0xff, (n + 7) / 8);
+    }
+    block_size_t reclaimed = end_block_scan(reachable, n);
+    pthread_mutex_unlock(&gc_lock);
+    return reclaimed;
+}
+
+static void *gc_thread(void *arg)
+{
+    unsigned int interval = (uintptr_t) arg;
+    while (true) {
+        block_size_t reclaimed = collect_garbage();
+        if (reclaimed > 0) {
+            printerrf("gc: reclaimed %u blocks\n", (unsigned int) reclaimed);
+        }
+        if (interval == 0) {
+            break;
+        }
+        sleep(interval);
+    }
+    return NULL;
+}
+
+void start_gc(unsigned int interval)
+{
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, gc_thread, (void *)(uintptr_t) interval) != 0) {
+        perror("start_gc() pthread_create");
+        exit(1);
+    }
+    pthread_detach(tid);
+}
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "inode.h"
+#include "probes.h"
+
+/*
+    inodes[slot] is the metadata of the file starting at block inodes[slot].first_block_id,
+    a slot whose block_count is 0 is free
+    the slots are handed out apart from the block ids, so that the table grows with the number of files,
+    not with the volume; inode_cap is always a multiple of INODES_PER_PAGE
+*/
+static struct file_metadata *inodes = NULL;
+static block_size_t inode_cap = 0;
+static block_size_t inode_end = 0;// the slots from it on were never used
+static block_size_t *free_slots = NULL;// freed slots below inode_end, taken again last freed first
+static block_size_t free_slot_num = 0;
+/*
+    the slot of every first block id, an open addressing hash with linear probing, at most half full
+*/
+#define INODE_SLOT_NONE ((block_size_t) -1)
+static block_size_t *slot_index = NULL;
+static unsigned int index_bits = 0;
+static block_size_t live_inodes = 0;
+/*
+    a lazy page only has timestamp updates, it is written back by sync_inode_table(true)
+*/
+enum page_state {
+    PAGE_CLEAN,
+    PAGE_LAZY,
+    PAGE_DIRTY,
+};
+static uint8_t *dirty_pages = NULL;
+/*
+    protect inodes, the slots, slot_index and dirty_pages
+*/
+static pthread_rwlock_t inode_lock = PTHREAD_RWLOCK_INITIALIZER;
+/*
+    protect inode_fd
+    priority: inode_file_lock > inode_lock
+*/
+static pthread_mutex_t inode_file_lock = PTHREAD_MUTEX_INITIALIZER;
+static int inode_fd = -1;
+
+static inline block_size_t page_of(block_size_t slot)
+{
+    return slot / INODES_PER_PAGE;
+}
+
+static inline block_size_t index_of(block_size_t id)
+{
+    return (block_size_t) (((uint64_t) id * 0x9e3779b97f4a7c15ULL) >> (64 - index_bits));
+}
+
+/*
+    the entry of slot_index holding id, or the empty one where it would go
+    caller should hold inode_lock
+*/
+static block_size_t find_index_locked(block_size_t id)
+{
+    block_size_t mask = ((block_size_t) 1 << index_bits) - 1;
+    block_size_t i = index_of(id);
+    while (slot_index[i] != INODE_SLOT_NONE && inodes[slot_index[i]].first_block_id != id) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/*
+    make slot_index hold at least twice n entries
+    caller should hold inode_lock for writing
+*/
+static void grow_slot_index_locked(block_size_t n)
+{
+    unsigned int bits = index_bits ? index_bits : 10;
+    while (((uint64_t) 1 << bits) < (uint64_t) n * 2) {
+        bits++;
+    }
+    if (bits == index_bits) {
+        return ;
+    }
+    block_size_t *old = slot_index;
+    block_size_t old_size = index_bits ? (block_size_t) 1 << index_bits : 0;
+    slot_index = malloc(((size_t) 1 << bits) * sizeof(block_size_t));
+    if (slot_index == NULL) {
+        perror("grow_slot_index_locked() malloc");
+        exit(1);
+    }
+    memset(slot_index, 0xff, ((size_t) 1 << bits) * sizeof(block_size_t));// INODE_SLOT_NONE
+    index_bits = bits;
+    for (block_size_t i = 0; i < old_size; i++) {
+        if (old[i] != INODE_SLOT_NONE) {
+            slot_index[find_index_locked(inodes[old[i]].first_block_id)] = old[i];
+        }
+    }
+    free(old);
+}
+
+/*
+    remove entry i of slot_index, moving back the entries after it which would not be found otherwise
+    caller should hold inode_lock for writing
+*/
+static void remove_index_locked(block_size_t i)
+{
+    block_size_t mask = ((block_size_t) 1 << index_bits) - 1;
+    block_size_t hole = i;
+    for (i = (i + 1) & mask; slot_index[i] != INODE_SLOT_NONE; i = (i + 1) & mask) {
+        block_size_t home = index_of(inodes[slot_index[i]].first_block_id);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            slot_index[hole] = slot_index[i];
+            hole = i;
+        }
+    }
+    slot_index[hole] = INODE_SLOT_NONE;
+}
+
+/*
+    make the table hold at least n slots
+    caller should hold inode_lock for writing
+*/
+static void grow_inode_table_locked(block_size_t n)
+{
+    if (n <= inode_cap) {
+        return ;
+    }
+    block_size_t new_cap = inode_cap * MAGNIFICATION > n ? inode_cap * MAGNIFICATION : n;
+    new_cap = (new_cap + INODES_PER_PAGE - 1) / INODES_PER_PAGE * INODES_PER_PAGE;
+    struct file_metadata *new_inodes = realloc(inodes, new_cap * sizeof(struct file_metadata));
+    block_size_t *new_free = realloc(free_slots, new_cap * sizeof(block_size_t));
+    uint8_t *new_dirty = realloc(dirty_pages, page_of(new_cap) * sizeof(uint8_t));
+    if (new_inodes == NULL || new_free == NULL || new_dirty == NULL) {
+        perror("grow_inode_table_locked() realloc");
+        exit(1);
+    }
+    memset(new_inodes + inode_cap, 0, (new_cap - inode_cap) * sizeof(struct file_metadata));
+    memset(new_dirty + page_of(inode_cap), PAGE_CLEAN, (page_of(new_cap) - page_of(inode_cap)) * sizeof(uint8_t));
+    inodes = new_inodes;
+    free_slots = new_free;
+    dirty_pages = new_dirty;
+    inode_cap = new_cap;
+}
+
+/*
+    move the used slots to the front of the table, so that it is as large as the number of files again
+    every page is written back by the next sync_inode_table()
+    caller should hold inode_lock for writing
+*/
+static void pack_inode_table_locked(void)
+{
+    block_size_t end = 0;
+    for (block_size_t slot = 0; slot < inode_end; slot++) {
+        if (inodes[slot].block_count != 0) {
+            inodes[end++] = inodes[slot];
+        }
+    }
+    memset(inodes + end, 0, (inode_end - end) * sizeof(struct file_metadata));
+    memset(dirty_pages, PAGE_DIRTY, page_of(inode_end + INODES_PER_PAGE - 1));
+    memset(slot_index, 0xff, ((size_t) 1 << index_bits) * sizeof(block_size_t));
+    for (block_size_t slot = 0; slot < end; slot++) {
+        slot_index[find_index_locked(inodes[slot].first_block_id)] = slot;
+    }
+    inode_end = end;
+    free_slot_num = 0;
+}
+
+void load_inode_table(const char *path)
+{
+    inode_fd = open(path, volume_readonly ? O_RDONLY : O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (inode_fd == -1) {
+        if (volume_readonly && errno == ENOENT) {
+            return ;// a snapshot taken before the inode table
+        }
+        perror("load_inode_table() open");
+        exit(1);
+    }
+    struct stat st;
+    if (fstat(inode_fd, &st) == -1) {
+        perror("load_inode_table() fstat");
+        exit(1);
+    }
+    block_size_t page_num = (st.st_size + META_PAGE_SIZE - 1) / META_PAGE_SIZE;// the last page has no padding
+    pthread_rwlock_wrlock(&inode_lock);
+    grow_inode_table_locked(page_num * INODES_PER_PAGE);
+    grow_slot_index_locked(0);
+    for (block_size_t page = 0; page < page_num; page++) {
+        size_t len = INODES_PER_PAGE * sizeof(struct file_metadata);
+        if (pread(inode_fd, inodes + page * INODES_PER_PAGE, len, (off_t)page * META_PAGE_SIZE) != len) {
+            printerrf("load_inode_table(): inode table is broken\n");
+            exit(1);
+        }
+    }
+    // every record holds its first block id, tables written when the slot was the first block id load alike
+    inode_end = page_num * INODES_PER_PAGE;
+    for (block_size_t slot = 0; slot < inode_end; slot++) {
+        if (inodes[slot].block_count == 0) {
+            continue;
+        }
+        grow_slot_index_locked(live_inodes + 1);
+        block_size_t i = find_index_locked(inodes[slot].first_block_id);
+        if (slot_index[i] != INODE_SLOT_NONE) {
+            printerrf("load_inode_table(): inode table is broken\n");
+            exit(1);
+        }
+        slot_index[i] = slot;
+        live_inodes++;
+    }
+    for (block_size_t slot = inode_end; slot-- > 0;) {
+        if (inodes[slot].block_count == 0) {
+            free_slots[free_slot_num++] = slot;
+        }
+    }
+    if (live_inodes < inode_end / 2 && inode_end > INODES_PER_PAGE) {
+        pack_inode_table_locked();
+    }
+    pthread_rwlock_unlock(&inode_lock);
+    if (!volume_readonly && inode_end < page_num * INODES_PER_PAGE) {
+        sync_inode_table(false);
+        if (ftruncate(inode_fd, (off_t) page_of(inode_end + INODES_PER_PAGE - 1) * META_PAGE_SIZE) == -1) {
+            perror("load_inode_table() ftruncate");
+            exit(1);
+        }
+    }
+}
+
+bool get_inode(block_size_t id, struct file_metadata *md)
+{
+    bool res = false;
+    pthread_rwlock_rdlock(&inode_lock);
+    if (index_bits != 0) {
+        block_size_t slot = slot_index[find_index_locked(id)];
+        if (slot != INODE_SLOT_NONE) {
+            *md = inodes[slot];
+            res = true;
+        }
+    }
+    pthread_rwlock_unlock(&inode_lock);
+    return res;
+}
+
+void put_inode(block_size_t id, const struct file_metadata *md, bool lazy)
+{
+    pthread_rwlock_wrlock(&inode_lock);
+    grow_slot_index_locked(live_inodes + 1);
+    block_size_t i = find_index_locked(id);
+    block_size_t slot = slot_index[i];
+    if (slot == INODE_SLOT_NONE) {
+        if (free_slot_num > 0) {
+            slot = free_slots[--free_slot_num];
+        } else {
+            grow_inode_table_locked(inode_end + 1);
+            slot = inode_end++;
+        }
+        slot_index[i] = slot;
+        live_inodes++;
+        lazy = false;// the record is new to its page
+    }
+    inodes[slot] = *md;
+    inodes[slot].first_block_id = id;
+    if (!lazy) {
+        dirty_pages[page_of(slot)] = PAGE_DIRTY;
+    } else if (dirty_pages[page_of(slot)] == PAGE_CLEAN) {
+        dirty_pages[page_of(slot)] = PAGE_LAZY;
+    }
+    pthread_rwlock_unlock(&inode_lock);
+}
+
+void drop_inode(block_size_t id)
+{
+    pthread_rwlock_wrlock(&inode_lock);
+    block_size_t i = index_bits != 0 ? find_index_locked(id) : 0;
+    if (index_bits != 0 && slot_index[i] != INODE_SLOT_NONE) {
+        block_size_t slot = slot_index[i];
+        remove_index_locked(i);
+        memset(inodes + slot, 0, sizeof(struct file_metadata));
+        dirty_pages[page_of(slot)] = PAGE_DIRTY;
+        free_slots[free_slot_num++] = slot;
+        live_inodes--;
+    }
+    pthread_rwlock_unlock(&inode_lock);
+}
+
+size_t sync_inode_table(bool lazy)
+{
+    size_t written = 0;
+    if (volume_readonly) {
+        return 0;
+    }
+    pthread_mutex_lock(&inode_file_lock);
+    pthread_rwlock_rdlock(&inode_lock);
+    for (block_size_t page = 0; page < page_of(inode_end + INODES_PER_PAGE - 1); page++) {
+        if (dirty_pages[page] == PAGE_CLEAN || (dirty_pages[page] == PAGE_LAZY && !lazy)) {
+            continue;
+        }
+        // the page is wholly in memory, it is written without being read
+        size_t len = INODES_PER_PAGE * sizeof(struct file_metadata);
+        if (pwrite(inode_fd, inodes + page * INODES_PER_PAGE, len, (off_t)page * META_PAGE_SIZE) != len) {
+            perror("sync_inode_table() pwrite");
+            exit(1);
+        }
+        dirty_pages[page] = PAGE_CLEAN;
+        written++;
+    }
+    pthread_rwlock_unlock(&inode_lock);
+    pthread_mutex_unlock(&inode_file_lock);
+    NAIVE_PROBE1(sync_inode_table, written);
+    return written;
+}
+
+void flush_inode_table(void)
+{
+    if (volume_readonly || inode_fd == -1) {
+        return ;
+    }
+    pthread_mutex_lock(&inode_file_lock);
+    if (fdatasync(inode_fd) == -1) {
+        perror("flush_inode_table() fdatasync");
+        exit(1);
+    }
+    pthread_mutex_unlock(&inode_file_lock);
+}
+
+bool save_inode_table(const char *path)
+{
+    char tmp_path[strlen(path) + sizeof(".tmp")];
+    sprintf(tmp_path, "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    bool ok = fd != -1;
+    pthread_rwlock_rdlock(&inode_lock);
+    for (block_size_t page = 0; ok && page < page_of(inode_end + INODES_PER_PAGE - 1); page++) {
+        size_t len = INODES_PER_PAGE * sizeof(struct file_metadata);
+        ok = pwrite(fd, inodes + page * INODES_PER_PAGE, len, (off_t)page * META_PAGE_SIZE) == len;
+    }
+    pthread_rwlock_unlock(&inode_lock);
+    ok = ok && fsync(fd) == 0;
+    if (fd != -1) {
+        close(fd);
+    }
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok) {
+        perror("save_inode_table()");
+        unlink(tmp_path);
+    }
+    return ok;
+}
@@ -2,464 +2,707 @@
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <locale.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "base.h"
 #include "block.h"
 #include "file.h"
-#include "path.h"
+#include "inode.h"
+#include "ops.h"
+#include "stats.h"
+#include "trace.h"
+#include "gc.h"
+#include "defrag.h"
+#include "snapshot.h"
+#include "writeback.h"
+#include "tier.h"
+#include "check.h"
+#include "probes.h"
 
-static void *naive_init(struct fuse_conn_info *conn)
+#define CONTROL_DIR_PATH "/.naivevfs"
+#define SNAPSHOTS_DIR_PATH CONTROL_DIR_PATH "/snapshots"
+
+struct naive_options {
+    int stats;
+    unsigned int stats_interval;
+    char *trace;
+    int gc;
+    unsigned int gc_interval;
+    int defrag;
+    unsigned int defrag_interval;
+    unsigned int defrag_rate;
+    char *discard;
+    unsigned int discard_interval;
+    enum discard_policy discard_policy;
+    char *snapshot;
+    int noatime;
+    int relatime;
+    int lazytime;
+    int writeback;
+    unsigned int writeback_limit;
+    unsigned int writeback_expire;
+    int writeback_cache;
+    unsigned int block_size;
+    unsigned int stripes;
+    unsigned int stripe_unit;
+    unsigned int fast_tier;
+    unsigned int tier_interval;
+    unsigned int volume_size;
+    double grow_factor;
+    unsigned int grow_chunk;
+    int check;// 1 to check the volume before it is mounted, 2 to repair its leaks too
+};
+
+static struct naive_options options;
+
+#define NAIVE_OPT(templ, field, value) { templ, offsetof(struct naive_options, field), value }
+
+static const struct fuse_opt naive_opts[] = {
+    NAIVE_OPT("stats", stats, 1),
+    NAIVE_OPT("stats_interval=%u", stats_interval, 0),
+    NAIVE_OPT("trace=%s", trace, 0),
+    NAIVE_OPT("gc", gc, 1),
+    NAIVE_OPT("gc_interval=%u", gc_interval, 0),
+    NAIVE_OPT("defrag", defrag, 1),
+    NAIVE_OPT("defrag_interval=%u", defrag_interval, 0),
+    NAIVE_OPT("defrag_rate=%u", defrag_rate, 0),
+    NAIVE_OPT("discard=%s", discard, 0),
+    NAIVE_OPT("discard_interval=%u", discard_interval, 0),
+    NAIVE_OPT("snapshot=%s", snapshot, 0),
+    NAIVE_OPT("noatime", noatime, 1),
+    NAIVE_OPT("relatime", relatime, 1),
+    NAIVE_OPT("lazytime", lazytime, 1),
+    NAIVE_OPT("writeback", writeback, 1),
+    NAIVE_OPT("writeback_limit=%u", writeback_limit, 0),
+    NAIVE_OPT("writeback_expire=%u", writeback_expire, 0),
+    NAIVE_OPT("writeback_cache", writeback_cache, 1),
+    NAIVE_OPT("block_size=%u", block_size, 0),
+    NAIVE_OPT("stripes=%u", stripes, 0),
+    NAIVE_OPT("stripe_unit=%u", stripe_unit, 0),
+    NAIVE_OPT("fast_tier=%u", fast_tier, 0),
+    NAIVE_OPT("tier_interval=%u", tier_interval, 0),
+    NAIVE_OPT("volume_size=%u", volume_size, 0),
+    NAIVE_OPT("grow_factor=%lf", grow_factor, 0),
+    NAIVE_OPT("grow_chunk=%u", grow_chunk, 0),
+    NAIVE_OPT("check", check, 1),
+    NAIVE_OPT("check=repair", check, 2),
+    FUSE_OPT_END
+};
+
+/*
+    content of an opened control file, rendered at open time
+    its address is kept in fuse_file_info.fh
+*/
+struct control_file {
+    size_t len;
+    char *data;
+};
+
+struct fill_dir_arg {
+    void *buf;
+    fuse_fill_dir_t filler;
+};
+
+/*
+    files in the control dir, each rendered by its function
+*/
+static const struct control_entry {
+    const char *name;
+    char *(*render)(size_t *len);
+} control_entries[] = {
+    {"stats", render_stats},
+    {"defrag", render_defrag_stats},
+    {"writeback", render_writeback_stats},
+    {"tier", render_tier_stats},
+};
+
+#define CONTROL_ENTRY_NUM (sizeof(control_entries) / sizeof(control_entries[0]))
+
+static const struct control_entry *find_control_entry(const char *path)
 {
-    init_block_module();
-    init_file_module();
+    const char *name = path + strlen(CONTROL_DIR_PATH "/");
+    for (size_t i = 0; i < CONTROL_ENTRY_NUM; i++) {
+        if (strcmp(name, control_entries[i].name) == 0) {
+            return control_entries + i;
+        }
+    }
     return NULL;
 }
 
-static void naive_destroy(void * op)
+static bool is_control_path(const char *path)
 {
-    sync_all_metadatas();
-    sync_fatable();
+    size_t len = strlen(CONTROL_DIR_PATH);
+    return strncmp(path, CONTROL_DIR_PATH, len) == 0 && (path[len] == '\0' || path[len] == '/');
 }
 
-static int naive_statfs(const char *path, struct statvfs *stfs)
+static bool is_control_dir(const char *path)
 {
-    // temporary solution
-    stfs->f_bsize = BLOCK_SIZE;
-    stfs->f_frsize = BLOCK_SIZE;
-    stfs->f_blocks = BLOCK_COUNT_MAX;
-    stfs->f_bfree = stfs->f_bavail = BLOCK_COUNT_MAX - get_used_block_num();
-    stfs->f_files = stfs->f_ffree = FILE_COUNT_MAX / 2;
-    stfs->f_namemax = MAX_FILENAME_LEN;
-    return 0;
+    return strcmp(path, CONTROL_DIR_PATH) == 0 || strcmp(path, CONTROL_DIR_PATH "/") == 0;
 }
 
-static int naive_readdir(const char *_path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info)
+/*
+    the snapshot name of a path like SNAPSHOTS_DIR_PATH "/name", NULL for other paths
+*/
+static const char *snapshot_name_of(const char *path)
 {
-    struct dir_record dir;
-    int pathlen = strlen(_path);
-    char path[pathlen + 2];
-    strcpy(path, _path);
-    if (path[pathlen - 1] != '/') {
-        path[pathlen] = '/';
-        path[++pathlen] = '\0';
-    }
-    if (read_dir_recursively(path, &dir) == -1) {
-        destruct_dir_record(&dir);
-        return -ENOENT;
+    size_t len = strlen(SNAPSHOTS_DIR_PATH "/");
+    if (strncmp(path, SNAPSHOTS_DIR_PATH "/", len) != 0 || path[len] == '\0') {
+        return NULL;
     }
-    for (file_count_t i = 0; i < dir.file_count; i++) {
-        if(filler(buf, dir.list_filename[i], NULL, 0)) {
-            break;
+    return path + len;
+}
+
+static int control_getattr(const char *path, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    const char *snapshot = snapshot_name_of(path);
+    if (is_control_dir(path)) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+    } else if (strcmp(path, SNAPSHOTS_DIR_PATH) == 0) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    } else if (snapshot != NULL) {
+        if (!snapshot_exists(snapshot)) {
+            return -ENOENT;
         }
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+    } else if (find_control_entry(path) != NULL) {
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+    } else {
+        return -ENOENT;
     }
     return 0;
 }
 
-static int naive_mkdir(const char *_path, mode_t mode)
+static int fill_snapshot(void *buf, const char *name)
+{
+    struct fill_dir_arg *arg = buf;
+    return arg->filler(arg->buf, name, NULL, 0);
+}
+
+static int control_readdir(const char *path, void *buf, fuse_fill_dir_t filler)
 {
-    struct dir_record dir;
-    int pathlen = strlen(_path);
-    char path[pathlen];
-    strcpy(path, _path);
-    if (path[pathlen - 1] == '/') {
-        if (pathlen <= 1) {
-            //root dir
-            return -EEXIST;
-        } else {
-            path[pathlen - 1] = '\0';
-            pathlen--;
+    const char *snapshot = snapshot_name_of(path);
+    if (strcmp(path, SNAPSHOTS_DIR_PATH) == 0) {
+        struct fill_dir_arg arg = {buf, filler};
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        list_snapshots(&arg, fill_snapshot);
+        return 0;
+    }
+    if (snapshot != NULL) {
+        // mount it with -o snapshot=name to see its files
+        if (!snapshot_exists(snapshot)) {
+            return -ENOENT;
         }
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        return 0;
     }
-    int last_slash_i = read_dir_recursively(path, &dir);
-    const char *filename = path + last_slash_i + 1;
-    if (last_slash_i == -1) {
-        destruct_dir_record(&dir);
-        return -ENOENT;
+    if (!is_control_dir(path)) {
+        return -ENOTDIR;
     }
-    for (file_count_t i = 0; i < dir.file_count; i++) {
-        if (strcmp(filename, dir.list_filename[i]) == 0) {
-            destruct_dir_record(&dir);
-            return -EEXIST;
-        }
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    filler(buf, "snapshots", NULL, 0);
+    for (size_t i = 0; i < CONTROL_ENTRY_NUM; i++) {
+        filler(buf, control_entries[i].name, NULL, 0);
     }
-    fileno_t fn;
-    fn = create_file(dir.dir_fileno, filename, true);
-    init_empty_dir(fn, dir.dir_fileno);
-    destruct_dir_record(&dir);
     return 0;
 }
 
-static int naive_rmdir(const char *_path)
+static int control_mkdir(const char *path)
+{
+    const char *snapshot = snapshot_name_of(path);
+    return snapshot != NULL ? create_snapshot(snapshot) : -EACCES;
+}
+
+static int control_rmdir(const char *path)
+{
+    const char *snapshot = snapshot_name_of(path);
+    return snapshot != NULL ? delete_snapshot(snapshot) : -EACCES;
+}
+
+static int control_open(const char *path, struct fuse_file_info *info)
 {
-    int pathlen = strlen(_path);
-    char path[pathlen + 1];
-    strcpy(path, _path);
-    if (path[pathlen - 1] == '/') {
-        path[--pathlen] = '\0';
+    if (is_control_dir(path) || strcmp(path, SNAPSHOTS_DIR_PATH) == 0 || snapshot_name_of(path) != NULL) {
+        return -EISDIR;
     }
-    struct dir_record dir;
-    int last_slash_i = read_dir_recursively(path, &dir);
-    const char *filename = path + last_slash_i + 1;
-    if (last_slash_i == -1) {
-        destruct_dir_record(&dir);
+    const struct control_entry *entry = find_control_entry(path);
+    if (entry == NULL) {
         return -ENOENT;
     }
-    file_count_t fi = find_name_in_dir_record(filename, &dir);
-    if (fi == FILE_COUNT_MAX) {
-        destruct_dir_record(&dir);
-        return -ENOENT;
+    if ((info->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
     }
-    fileno_t fn = open_file(dir.list_first_block_id[fi]);
-    struct file_metadata fm;
-    get_metadata(fn, &fm);
-    close_file(fn);
-    int res;
-    if (fm.mode != MODE_ISDIR) {
-        res = -ENOTDIR;
-    } else {
-        fileno_t fn = open_file(dir.list_first_block_id[fi]);
-        struct dir_record subdir;
-        read_dir(fn, &subdir);
-        file_count_t file_count = subdir.file_count;
-        destruct_dir_record(&subdir);
-        if (file_count > 2) {
-            res = -ENOTEMPTY;
-        } else {
-            remove_item_in_dir(&dir, fi);
-            write_dir(&dir);
-            res = 0;
-        }
+    struct control_file *cf = malloc(sizeof(struct control_file));
+    cf->data = entry->render(&cf->len);
+    info->fh = (uintptr_t) cf;
+    info->direct_io = 1;
+    return 0;
+}
+
+static int control_read(char *buf, size_t size, off_t offset, struct fuse_file_info *info)
+{
+    struct control_file *cf = (struct control_file *)(uintptr_t) info->fh;
+    if (offset >= cf->len) {
+        return 0;
     }
-    destruct_dir_record(&dir);
-    return res;
+    if (size > cf->len - offset) {
+        size = cf->len - offset;
+    }
+    memcpy(buf, cf->data + offset, size);
+    return size;
 }
 
-static int naive_getattr(const char *_path, struct stat *st)
-{
-    struct dir_record dir;
-    struct file_metadata md;
-    int pathlen = strlen(_path);
-    char path[pathlen + 1];
-    strcpy(path, _path);
-    if (path[pathlen - 1] == '/') {
-        if (pathlen == 1) {
-            // root dir
-            get_metadata(0, &md);
-            st->st_mode = S_IFDIR | 0777;
-            st->st_nlink = 2;
-            st->st_atim = (struct timespec) {md.access_time, 0};
-            st->st_mtim = (struct timespec) {md.modify_time, 0};
-            st->st_ctim = (struct timespec) {md.create_time, 0};
-            return 0;
-        } else {
-            path[--pathlen] = '\0';
+static int control_release(struct fuse_file_info *info)
+{
+    struct control_file *cf = (struct control_file *)(uintptr_t) info->fh;
+    free(cf->data);
+    free(cf);
+    return 0;
+}
+
+/*
+    ask the kernel for large writes and parallel reads, read_file() and write_file() move the whole blocks
+    of a request as runs, but the data of a file starts FILE_METADATA_OFFSET bytes into its first block,
+    so a request aligned to pages is not aligned to blocks and each of its ends still rewrites a block
+    max_write is what libfuse can buffer unless lowered by `-o max_write=N`
+    max_readahead is already the largest the kernel takes unless lowered by `-o max_readahead=N`
+*/
+static void negotiate_conn(struct fuse_conn_info *conn)
+{
+    conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_ASYNC_READ);
+    conn->async_read = 1;
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    if (options.writeback_cache && options.snapshot == NULL) {
+        conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+    }
+#endif
+}
+
+static void *naive_init(struct fuse_conn_info *conn)
+{
+    if (options.snapshot != NULL) {
+        mount_snapshot(options.snapshot);
+        init_file_module();
+        negotiate_conn(conn);
+        if (options.trace != NULL) {
+            start_trace(options.trace);
         }
+        return NULL;
     }
-    int last_slash_i = read_dir_recursively(path, &dir);
-    char *filename = path + last_slash_i + 1;
-    if (last_slash_i == -1) {
-        destruct_dir_record(&dir);
-        return -ENOENT;
+    init_block_module();
+    init_file_module();
+    negotiate_conn(conn);
+    if (options.block_size != 0 && (int) options.block_size != BLOCK_SIZE) {
+        printerrf("the volume has %d byte blocks, block_size=%u is ignored\n", BLOCK_SIZE, options.block_size);
     }
-    for (file_count_t i = 0; i < dir.file_count; i++) {
-        if (strcmp(filename, dir.list_filename[i]) == 0) {
-            fileno_t fn = open_file(dir.list_first_block_id[i]);
-            get_metadata(fn, &md);
-            if (md.mode == MODE_ISDIR) {
-                st->st_mode = S_IFDIR | 0777;
-                st->st_nlink = 2;
-            } else if (md.mode == MODE_ISREG) {
-                st->st_mode = S_IFREG | 0777;
-                st->st_nlink = 1;
-                st->st_size = md.file_size;
-            }
-            st->st_atim = (struct timespec) {md.access_time, 0};
-            st->st_mtim = (struct timespec) {md.modify_time, 0};
-            st->st_ctim = (struct timespec) {md.create_time, 0};
-            close_file(fn);
-            destruct_dir_record(&dir);
-            return 0;
-        }
+    if (options.stripes != 0 && (int) options.stripes != volume_stripe_count) {
+        printerrf("the volume has %d stripes, stripes=%u is ignored\n", volume_stripe_count, options.stripes);
     }
-    destruct_dir_record(&dir);
-    return -ENOENT;
-}
-
-static int naive_utimens(const char *_path, const struct timespec ts[2])
-{
-    struct dir_record dir;
-    struct file_metadata md;
-    int pathlen = strlen(_path);
-    char path[pathlen + 1];
-    strcpy(path, _path);
-    if (path[pathlen - 1] == '/') {
-        if (pathlen == 1) {
-            // root dir
-            get_metadata(0, &md);
-            md.access_time = ts[0].tv_sec;
-            md.modify_time = ts[1].tv_sec;
-            set_metadata(0, &md);
-            return 0;
-        } else {
-            path[--pathlen] = '\0';
-        }
+    if (options.writeback || options.writeback_limit > 0 || options.writeback_expire > 0) {
+        start_writeback((size_t) (options.writeback_limit ? options.writeback_limit : 64) << 20,
+            (options.writeback_expire ? options.writeback_expire : 5) * 1000);
     }
-    int last_slash_i = read_dir_recursively(path, &dir);
-    char *filename = path + last_slash_i + 1;
-    if (last_slash_i == -1) {
-        destruct_dir_record(&dir);
-        return -ENOENT;
+    if (tier_enabled) {
+        start_tier_migrator((options.tier_interval ? options.tier_interval : 1) * 1000);
+    } else if (options.tier_interval > 0) {
+        printerrf("the volume has no fast tier, tier_interval=%u is ignored\n", options.tier_interval);
     }
-    for (file_count_t i = 0; i < dir.file_count; i++) {
-        if (strcmp(filename, dir.list_filename[i]) == 0) {
-            fileno_t fn = open_file(dir.list_first_block_id[i]);
-            get_metadata(fn, &md);
-            md.access_time = ts[0].tv_sec;
-            md.modify_time = ts[1].tv_sec;
-            set_metadata(fn, &md);
-            close_file(fn);
-            destruct_dir_record(&dir);
-            return 0;
-        }
+    if (options.stats_interval > 0) {
+        start_stats_dumper(options.stats_interval);
+    }
+    if (options.trace != NULL) {
+        start_trace(options.trace);
+    }
+    if (options.gc || options.gc_interval > 0) {
+        start_gc(options.gc_interval);
+    }
+    if (options.defrag || options.defrag_interval > 0) {
+        start_defrag(options.defrag_interval, options.defrag_rate);
+    }
+    start_discard(options.discard_policy, options.discard_interval);
+    start_dir_compactor();
+    return NULL;
+}
+
+static void naive_destroy(void * op)
+{
+    stop_trace();
+    stop_dir_compactor();
+    stop_writeback();
+    stop_tier_migrator();
+    sync_all_metadatas();
+    sync_fatable();
+}
+
+static int naive_statfs(const char *path, struct statvfs *stfs)
+{
+    return vfs_statfs(stfs);
+}
+
+static int fill_dir(void *buf, const char *name)
+{
+    struct fill_dir_arg *arg = buf;
+    return arg->filler(arg->buf, name, NULL, 0);
+}
+
+static int naive_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info)
+{
+    if (is_control_path(path)) {
+        return control_readdir(path, buf, filler);
+    }
+    struct fill_dir_arg arg = {buf, filler};
+    return vfs_readdir(path, &arg, fill_dir);
+}
+
+static int naive_mkdir(const char *path, mode_t mode)
+{
+    if (is_control_path(path)) {
+        return control_mkdir(path);
+    }
+    return vfs_mkdir(path);
+}
+
+static int naive_rmdir(const char *path)
+{
+    if (is_control_path(path)) {
+        return control_rmdir(path);
+    }
+    return vfs_rmdir(path);
+}
+
+static int naive_getattr(const char *path, struct stat *st)
+{
+    if (is_control_path(path)) {
+        return control_getattr(path, st);
     }
-    destruct_dir_record(&dir);
-    return -ENOENT;
+    return vfs_getattr(path, st);
+}
+
+static int naive_utimens(const char *path, const struct timespec ts[2])
+{
+    return vfs_utimens(path, ts);
 }
 
 static int naive_open(const char *path, struct fuse_file_info *info)
 {
-    struct dir_record dir;
-    int last_slash_i = read_dir_recursively(path, &dir);
-    const char *filename = path + last_slash_i + 1;
-    if (last_slash_i == -1) {
-        destruct_dir_record(&dir);
-        return -ENOENT;
+    if (is_control_path(path)) {
+        return control_open(path, info);
     }
-    for (file_count_t i = 0; i < dir.file_count; i++) {
-        if (strcmp(filename, dir.list_filename[i]) == 0) {
-            fileno_t fn = open_file(dir.list_first_block_id[i]);
-            info->fh = fn;
-            destruct_dir_record(&dir);
-            return 0;
-        }
+    if (volume_readonly && ((info->flags & O_ACCMODE) != O_RDONLY || (info->flags & O_TRUNC))) {
+        return -EROFS;
     }
-    destruct_dir_record(&dir);
-    return -ENOENT;
+    fileno_t fh;
+    int res = vfs_open(path, &fh);
+    if (res == 0) {
+        info->fh = fh;
+    }
+    return res;
 }
 
 static int naive_release(const char *path, struct fuse_file_info *info)
 {
-    if (!file_opened(info->fh)) {
-        return -EBADF;
+    if (is_control_path(path)) {
+        return control_release(info);
     }
-    close_file(info->fh);
-    return 0;
+    return vfs_release(info->fh);
 }
 
 static int naive_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *info)
 {
-    if (!file_opened(info->fh)) {
-        return -EBADF;
+    if (is_control_path(path)) {
+        return control_read(buf, size, offset, info);
     }
-    return read_file(info->fh, (uint8_t *) buf, size, offset);
+    return vfs_read(info->fh, buf, size, offset);
 }
 
 static int naive_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *info)
 {
-    if (!file_opened(info->fh)) {
-        return -EBADF;
-    }
-    return write_file(info->fh, (uint8_t *) buf, size, offset);
+    return vfs_write(info->fh, buf, size, offset);
 }
 
 static int naive_mknod(const char *path, mode_t mode, dev_t rdev)
 {
-    if (!S_ISREG(mode)) {
-        return -EINVAL;
-    }
-    struct dir_record dir;
-    int last_slash_i = read_dir_recursively(path, &dir);
-    const char *filename = path + last_slash_i + 1;
-    if (last_slash_i == -1) {
-        destruct_dir_record(&dir);
-        return -ENOENT;
-    }
-    for (file_count_t i = 0; i < dir.file_count; i++) {
-        if (strcmp(filename, dir.list_filename[i]) == 0) {
-            destruct_dir_record(&dir);
-            return -EEXIST;
-        }
-    }
-    create_file(dir.dir_fileno, filename, false);
-    destruct_dir_record(&dir);
-    return 0;
+    return vfs_mknod(path, mode);
 }
 
 static int naive_rename(const char *from, const char *to)
 {
-    if (strcmp(from, to) == 0) {
-        return 0;
-    }
-    struct dir_record fdir, tdir;
-    int fsi, tsi;
-    const char *from_fname, *to_fname;
-    fsi = read_dir_recursively(from, &fdir);
-    tsi = read_dir_recursively(to, &tdir);
-    if (fsi == -1 || tsi == -1) {
-        destruct_dir_record(&fdir);
-        destruct_dir_record(&tdir);
-        return -ENOENT;
-    }
-    from_fname = from + fsi + 1;
-    to_fname = to + tsi + 1;
-    file_count_t ffi, tfi;
-    ffi = find_name_in_dir_record(from_fname, &fdir);
-    if (ffi == FILE_COUNT_MAX) {
-        destruct_dir_record(&fdir);
-        destruct_dir_record(&tdir);
-        return -ENOENT;
-    }
-    tfi = find_name_in_dir_record(to_fname, &tdir);
-    fileno_t fn;
-    if (tfi != FILE_COUNT_MAX) {
-        struct file_metadata ffm, tfm;
-        fn = open_file(fdir.list_first_block_id[ffi]);
-        get_metadata(fn, &ffm);
-        close_file(fn);
-        fn = open_file(tdir.list_first_block_id[tfi]);
-        get_metadata(fn, &tfm);
-        close_file(fn);
-        if (ffm.mode == MODE_ISDIR) {
-            if (tfm.mode == MODE_ISDIR) {
-                fn = open_file(tdir.list_first_block_id[tfi]);
-                struct dir_record tsubdir;
-                read_dir(fn, &tsubdir);
-                destruct_dir_record(&tsubdir);
-
-                if (tsubdir.file_count == 2) {// to is empty
-                    remove_item_in_dir(&tdir, tfi);
-                } else {
-                    destruct_dir_record(&fdir);
-                    destruct_dir_record(&tdir);
-                    return -ENOTEMPTY;
-                }
-            } else {
-                destruct_dir_record(&fdir);
-                destruct_dir_record(&tdir);
-                return -ENOTDIR;
-            }
-        } else {
-            if (tfm.mode == MODE_ISDIR) {
-                destruct_dir_record(&fdir);
-                destruct_dir_record(&tdir);
-                return -EISDIR;
-            } else {
-                remove_item_in_dir(&tdir, tfi);
-            }
-        }
-    }
-    block_size_t fbid = fdir.list_first_block_id[ffi];
-    // TODO: write fdir, if fdir == tdir, sync them at the same time
-    if (fdir.dir_fileno == tdir.dir_fileno) {
-        //they are in the same dir, use tdir
-        ffi = find_name_in_dir_record(from_fname, &tdir);
-        remove_item_in_dir(&tdir, ffi);
-        add_item_in_dir(&tdir, fbid, to_fname);
-        write_dir(&tdir);
-    } else {
-        remove_item_in_dir(&fdir, ffi);
-        write_dir(&fdir);
-        add_item_in_dir(&tdir, fbid, to_fname);
-        write_dir(&tdir);
-    }
-    destruct_dir_record(&fdir);
-    destruct_dir_record(&tdir);
-    return 0;
+    return vfs_rename(from, to);
 }
 
 static int naive_unlink(const char *path)
 {
-    struct dir_record dir;
-    int last_slash_i = read_dir_recursively(path, &dir);
-    const char *filename = path + last_slash_i + 1;
-    if (last_slash_i == -1) {
-        destruct_dir_record(&dir);
-        return -ENOENT;
-    }
-    file_count_t fi = find_name_in_dir_record(filename, &dir);
-    if (fi == FILE_COUNT_MAX) {
-        destruct_dir_record(&dir);
-        return -ENOENT;
+    return vfs_unlink(path);
+}
+
+static int naive_truncate(const char *path, off_t size)
+{
+    return vfs_truncate(path, size);
+}
+
+static int naive_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *info)
+{
+    return vfs_fallocate(info->fh, mode, offset, length);
+}
+
+static int naive_fsync(const char *path, int datasync, struct fuse_file_info *info)
+{
+    if (is_control_path(path)) {
+        return 0;
     }
-    fileno_t fn = open_file(dir.list_first_block_id[fi]);
-    struct file_metadata fm;
-    get_metadata(fn, &fm);
-    close_file(fn);
-    int res;
-    if (fm.mode != MODE_ISREG) {
-        res = -EPERM;
-    } else {
-        remove_item_in_dir(&dir, fi);
-        write_dir(&dir);
-        res = 0;
+    return vfs_fsync(info->fh, datasync);
+}
+
+static int naive_fsyncdir(const char *path, int datasync, struct fuse_file_info *info)
+{
+    if (is_control_path(path)) {
+        return 0;
     }
-    destruct_dir_record(&dir);
-    return res;
+    return vfs_fsyncdir(path, datasync);
 }
 
-static int naive_truncate(const char *path, off_t size)
+static int naive_copy(const char *from, const char *to, int reflink)
 {
-    int pathlen = strlen(path);
-    if (size < 0) return -EINVAL;
-    if (path[pathlen - 1] == '/') return -EISDIR;
-    struct dir_record dir;
-    int last_slash_i = read_dir_recursively(path, &dir);
-    const char *filename = path + last_slash_i + 1;
-    if (last_slash_i == -1) {
-        destruct_dir_record(&dir);
-        return -ENOENT;
+    return vfs_copy(from, to, reflink);
+}
+
+/*
+    the fuse 2 api has no copy_file_range() and the kernel keeps FICLONE to itself,
+    so a copy is asked for by setting one of these attributes on the destination,
+    the value is the path of the source in the volume
+*/
+#define COPY_XATTR "user.naivevfs.copy"
+#define REFLINK_XATTR "user.naivevfs.reflink"
+
+static int timed_copy(const char *from, const char *to, int reflink);
+
+static int naive_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+    bool reflink = strcmp(name, REFLINK_XATTR) == 0;
+    if (!reflink && strcmp(name, COPY_XATTR) != 0) {
+        return -ENOTSUP;
     }
-    for (file_count_t i = 0; i < dir.file_count; i++) {
-        if (strcmp(filename, dir.list_filename[i]) == 0) {
-            fileno_t fn = open_file(dir.list_first_block_id[i]);
-            int res;
-            if (cut_file(fn, size)) {
-                res = 0;
-            } else {
-                res = -EFBIG;
-            }
-            close_file(fn);
-            destruct_dir_record(&dir);
-            return res;
-        }
+    if (size == 0 || size >= PATH_MAX || value[0] != '/') {
+        return -EINVAL;
     }
-    destruct_dir_record(&dir);
-    return -ENOENT;
+    char from[size + 1];
+    memcpy(from, value, size);
+    from[size] = '\0';
+    return timed_copy(from, path, reflink);
 }
 
+#define UNPAREN(...) __VA_ARGS__
+#define FIRST_ARG(first, ...) first
+
+/*
+    wrap naive_##name into timed_##name, which records its latency,
+    traces it with trace_args: (path, path2, fh, offset, size, flags)
+    and fires the static tracepoints name##_entry(path) and name##_return(path, res)
+*/
+#define TIMED_OP(name, op, params, args, trace_args) \
+    static int timed_##name params \
+    { \
+        NAIVE_PROBE1(name##_entry, FIRST_ARG trace_args); \
+        uint64_t start_ns = stats_enabled || trace_enabled ? stats_now_ns() : 0; \
+        int res = naive_##name args; \
+        NAIVE_PROBE2(name##_return, FIRST_ARG trace_args, res); \
+        if (start_ns != 0) { \
+            uint64_t latency_ns = stats_now_ns() - start_ns; \
+            if (stats_enabled) { \
+                stats_record(op, latency_ns); \
+            } \
+            if (trace_enabled) { \
+                trace_op(op, UNPAREN trace_args, res, start_ns, latency_ns); \
+            } \
+        } \
+        return res; \
+    }
+
+TIMED_OP(statfs, STATS_OP_STATFS, (const char *path, struct statvfs *stfs), (path, stfs),
+    (path, NULL, 0, 0, 0, 0))
+TIMED_OP(readdir, STATS_OP_READDIR,
+    (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *info),
+    (path, buf, filler, offset, info),
+    (path, NULL, 0, offset, 0, 0))
+TIMED_OP(mkdir, STATS_OP_MKDIR, (const char *path, mode_t mode), (path, mode),
+    (path, NULL, 0, 0, mode, 0))
+TIMED_OP(rmdir, STATS_OP_RMDIR, (const char *path), (path),
+    (path, NULL, 0, 0, 0, 0))
+TIMED_OP(getattr, STATS_OP_GETATTR, (const char *path, struct stat *st), (path, st),
+    (path, NULL, 0, 0, 0, 0))
+TIMED_OP(utimens, STATS_OP_UTIMENS, (const char *path, const struct timespec ts[2]), (path, ts),
+    (path, NULL, 0, ts[0].tv_sec, ts[1].tv_sec, 0))
+TIMED_OP(open, STATS_OP_OPEN, (const char *path, struct fuse_file_info *info), (path, info),
+    (path, NULL, info->fh, 0, info->flags, 0))
+TIMED_OP(release, STATS_OP_RELEASE, (const char *path, struct fuse_file_info *info), (path, info),
+    (path, NULL, info->fh, 0, 0, 0))
+TIMED_OP(read, STATS_OP_READ,
+    (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *info),
+    (path, buf, size, offset, info),
+    (path, NULL, info->fh, offset, size, 0))
+TIMED_OP(write, STATS_OP_WRITE,
+    (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *info),
+    (path, buf, size, offset, info),
+    (path, NULL, info->fh, offset, size, 0))
+TIMED_OP(mknod, STATS_OP_MKNOD, (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev),
+    (path, NULL, 0, 0, mode, 0))
+TIMED_OP(rename, STATS_OP_RENAME, (const char *from, const char *to), (from, to),
+    (from, to, 0, 0, 0, 0))
+TIMED_OP(unlink, STATS_OP_UNLINK, (const char *path), (path),
+    (path, NULL, 0, 0, 0, 0))
+TIMED_OP(truncate, STATS_OP_TRUNCATE, (const char *path, off_t size), (path, size),
+    (path, NULL, 0, 0, size, 0))
+TIMED_OP(fallocate, STATS_OP_FALLOCATE,
+    (const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *info),
+    (path, mode, offset, length, info),
+    (path, NULL, info->fh, offset, length, mode))
+TIMED_OP(fsync, STATS_OP_FSYNC, (const char *path, int datasync, struct fuse_file_info *info),
+    (path, datasync, info), (path, NULL, info->fh, 0, 0, datasync))
+TIMED_OP(fsyncdir, STATS_OP_FSYNCDIR, (const char *path, int datasync, struct fuse_file_info *info),
+    (path, datasync, info), (path, NULL, 0, 0, 0, datasync))
+TIMED_OP(copy, STATS_OP_COPY, (const char *from, const char *to, int reflink), (from, to, reflink),
+    (from, to, 0, 0, 0, reflink))
+
 static struct fuse_operations naivefs_oper = {
     .init = naive_init,
     .destroy = naive_destroy,
-    .statfs = naive_statfs,
-    .readdir = naive_readdir,
-    .mkdir = naive_mkdir,
-    .rmdir = naive_rmdir,
-    .getattr = naive_getattr,
-    .utimens = naive_utimens,
-    .open = naive_open,
-    .release = naive_release,
-    .read = naive_read,
-    .write = naive_write,
-    .mknod = naive_mknod,
-    .rename = naive_rename,
-    .unlink = naive_unlink,
-    .truncate = naive_truncate
+    .statfs = timed_statfs,
+    .readdir = timed_readdir,
+    .mkdir = timed_mkdir,
+    .rmdir = timed_rmdir,
+    .getattr = timed_getattr,
+    .utimens = timed_utimens,
+    .open = timed_open,
+    .release = timed_release,
+    .read = timed_read,
+    .write = timed_write,
+    .mknod = timed_mknod,
+    .rename = timed_rename,
+    .unlink = timed_unlink,
+    .truncate = timed_truncate,
+    .fallocate = timed_fallocate,
+    .fsync = timed_fsync,
+    .fsyncdir = timed_fsyncdir,
+    .setxattr = naive_setxattr
 };
 
+/*
+    check the volume in the working dir like naivevfs-fsck, before fuse mounts anything
+    it is loaded in a child, since fuse_main() may fork away the threads of the block module and reloads it anyway
+    returns false if the volume has errors
+*/
+static bool check_before_mount(bool repair)
+{
+    if (access(FATABLE_FILENAME, F_OK) != 0) {
+        return true;// the mount creates the volume
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("check_before_mount() fork");
+        return false;
+    }
+    if (pid == 0) {
+        init_block_module();
+        load_inode_table(INODE_FILENAME);
+        struct check_report report;
+        bool ok = check_volume(0, repair, &report);
+        print_check_report(&report, stderr);
+        exit(ok ? 0 : 1);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("check_before_mount() waitpid");
+        return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
 int main(int argc, char *argv[])
 {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     setlocale(LC_ALL, "en_US.UTF-8");
-    return fuse_main(argc, argv, &naivefs_oper, NULL);
-}
\ No newline at end of file
+    if (fuse_opt_parse(&args, &options, naive_opts, NULL) == -1) {
+        return 1;
+    }
+    stats_enabled = options.stats || options.stats_interval > 0;
+    if (options.discard == NULL || strcmp(options.discard, "off") == 0) {
+        options.discard_policy = DISCARD_OFF;
+    } else if (strcmp(options.discard, "periodic") == 0) {
+        options.discard_policy = DISCARD_PERIODIC;
+    } else if (strcmp(options.discard, "immediate") == 0) {
+        options.discard_policy = DISCARD_IMMEDIATE;
+    } else {
+        printerrf("bad discard policy: %s, should be immediate, periodic or off\n", options.discard);
+        return 1;
+    }
+    if (options.discard_interval == 0) {
+        options.discard_interval = 60;
+    }
+    if (options.noatime) {
+        atime_policy = ATIME_NOATIME;
+    } else if (options.relatime) {
+        atime_policy = ATIME_RELATIME;
+    }
+    lazytime = options.lazytime;
+    if (options.block_size != 0) {
+        if (!block_size_valid(options.block_size)) {
+            printerrf("bad block_size: %u, should be a power of two from %d to %d\n", options.block_size,
+                MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+            return 1;
+        }
+        format_block_size = options.block_size;
+    }
+    if (options.stripes != 0 || options.stripe_unit != 0) {
+        size_t count = options.stripes ? options.stripes : 1;
+        size_t unit = options.stripe_unit ? options.stripe_unit : DEFAULT_STRIPE_UNIT;
+        if (!stripe_layout_valid(count, unit)) {
+            printerrf("bad stripes=%zu,stripe_unit=%zu: at most %d stripes, a stripe unit is a power of two from %d\n",
+                count, unit, MAX_STRIPE_COUNT, MIN_BLOCK_SIZE);
+            return 1;
+        }
+        format_stripe_count = count;
+        format_stripe_unit = unit;
+    }
+    format_tier_size = (size_t) options.fast_tier << 20;
+    format_volume_size = (size_t) options.volume_size << 20;
+    if (options.grow_factor == 0) {
+        options.grow_factor = MAGNIFICATION;
+    }
+    if (!grow_policy_valid(options.grow_factor, (size_t) options.grow_chunk << 20)) {
+        printerrf("bad grow_factor=%g,grow_chunk=%u: the factor is above 1 and at most %g\n", options.grow_factor,
+            options.grow_chunk, MAX_GROW_FACTOR);
+        return 1;
+    }
+    grow_factor = options.grow_factor;
+    grow_chunk = (size_t) options.grow_chunk << 20;
+#ifndef FUSE_CAP_WRITEBACK_CACHE
+    if (options.writeback_cache) {
+        printerrf("writeback_cache is not supported by this libfuse, ignored\n");
+    }
+#endif
+    if (options.snapshot == NULL) {
+        if (volume_in_use()) {
+            printerrf("the volume is in use by another naivevfs or naivevfs-fsck\n");
+            return 1;
+        }
+        if (options.check && !check_before_mount(options.check == 2)) {
+            printerrf("the volume has errors, see naivevfs-fsck\n");
+            return 1;
+        }
+    }
+    int res = fuse_main(args.argc, args.argv, &naivefs_oper, NULL);
+    fuse_opt_free_args(&args);
+    return res;
+}
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "base.h"
+#include "block.h"
+#include "file.h"
+#include "inode.h"
+#include "stats.h"
+
+#define MKFS_CHUNK_SIZE (1 << 20)// bytes written at a time, a whole number of blocks
+
+/*
+    a file or a dir found in a host dir
+*/
+struct mkfs_entry {
+    char *name;
+    struct stat st;
+    block_size_t first_block_id;
+};
+
+static struct {
+    unsigned long long files;
+    unsigned long long dirs;
+    unsigned long long skipped;
+    unsigned long long bytes;
+} totals;
+
+static bool verbose = false;
+static uint8_t *chunk_buf;
+
+static void usage(const char *prog)
+{
+    printerrf("usage: %s [options] source-dir volume-dir\n"
+        "  build a volume in volume-dir holding a copy of source-dir\n"
+        "  -B bytes      block size of the volume, a power of two from 4K to 1M (default 4K)\n"
+        "  -t count      stripe the volume across this many files, up to 16 (default 1)\n"
+        "  -u bytes      stripe unit, a power of two from 4K (default 64K)\n"
+        "  -S bytes      size of the volume, fallocated at once, grown if the copy needs more (default the copy)\n"
+        "  -v            print every skipped entry\n", prog);
+    exit(1);
+}
+
+static size_t parse_size(const char *str)
+{
+    char *end;
+    size_t res = strtoull(str, &end, 0);
+    switch (*end) {
+    case 'M': case 'm': res <<= 10;// fall through
+    case 'K': case 'k': res <<= 10;
+    }
+    return res;
+}
+
+static inline block_size_t blocks_of(file_size_t size)
+{
+    return get_blockno(size) + 1;
+}
+
+static inline bool entry_wanted(const struct stat *st)
+{
+    return S_ISDIR(st->st_mode) || (S_ISREG(st->st_mode) && st->st_size <= FILE_SIZE_MAX);
+}
+
+static void skip_entry(const char *name, const struct stat *st)
+{
+    totals.skipped++;
+    if (verbose) {
+        printerrf("skipped %s: %s\n", name, S_ISREG(st->st_mode) ? "too large" : "not a regular file or dir");
+    }
+}
+
+/*
+    open a host dir relative to dir_fd, exit on failure
+*/
+static int open_host_dir(int dir_fd, const char *name)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd == -1) {
+        perror(name);
+        exit(1);
+    }
+    return fd;
+}
+
+/*
+    list the files and dirs of a host dir, others are skipped
+    the result is malloc()ed, so is every name
+*/
+static size_t list_host_dir(int dir_fd, struct mkfs_entry **entries, bool count_skipped)
+{
+    size_t n = 0, cap = 16;
+    DIR *dir = fdopendir(dup(dir_fd));
+    *entries = malloc(cap * sizeof(struct mkfs_entry));
+    if (dir == NULL || *entries == NULL) {
+        perror("list_host_dir()");
+        exit(1);
+    }
+    rewinddir(dir);// the dup shares its offset with dir_fd, which may have been listed before
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (fstatat(dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            perror(de->d_name);
+            exit(1);
+        }
+        if (!entry_wanted(&st)) {
+            if (count_skipped) {
+                skip_entry(de->d_name, &st);
+            }
+            continue;
+        }
+        if (n == cap) {
+            cap *= 2;
+            *entries = realloc(*entries, cap * sizeof(struct mkfs_entry));
+            if (*entries == NULL) {
+                perror("list_host_dir() realloc");
+                exit(1);
+            }
+        }
+        (*entries)[n].name = strdup(de->d_name);
+        (*entries)[n].st = st;
+        (*entries)[n].first_block_id = BLOCK_ID_NONE;
+        n++;
+    }
+    closedir(dir);
+    return n;
+}
+
+static void free_entries(struct mkfs_entry *entries, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+/*
+    size of the dir record of a dir holding these entries, with "." and ".."
+*/
+static file_size_t entries_record_size(const struct mkfs_entry *entries, size_t n)
+{
+    file_size_t names_len = sizeof(".") + sizeof("..");
+    for (size_t i = 0; i < n; i++) {
+        names_len += strlen(entries[i].name) + 1;
+    }
+    return dir_record_size(n + 2, names_len);
+}
+
+/*
+    count the blocks of a host tree, as they will be laid out in the volume
+*/
+static block_size_t count_blocks(int dir_fd)
+{
+    struct mkfs_entry *entries;
+    size_t n = list_host_dir(dir_fd, &entries, false);
+    block_size_t blocks = blocks_of(entries_record_size(entries, n));
+    for (size_t i = 0; i < n; i++) {
+        if (S_ISDIR(entries[i].st.st_mode)) {
+            int fd = open_host_dir(dir_fd, entries[i].name);
+            blocks += count_blocks(fd);
+            close(fd);
+        } else {
+            blocks += blocks_of(entries[i].st.st_size);
+        }
+    }
+    free_entries(entries, n);
+    return blocks;
+}
+
+/*
+    the chain holds `size` bytes of data after FILE_METADATA_OFFSET,
+    they are copied from fd, or from mem if fd is -1, and written whole chunks at a time
+*/
+static void fill_chain(block_size_t id, int fd, const uint8_t *mem, file_size_t size, const char *name)
+{
+    size_t head = FILE_METADATA_OFFSET;
+    memset(chunk_buf, 0, head);
+    while (size > 0) {
+        size_t len = MKFS_CHUNK_SIZE - head < size ? MKFS_CHUNK_SIZE - head : size, done = 0;
+        if (fd == -1) {
+            memcpy(chunk_buf + head, mem, len);
+            mem += len;
+            done = len;
+        }
+        while (done < len) {
+            ssize_t nbytes = read(fd, chunk_buf + head + done, len - done);
+            if (nbytes <= 0) {
+                printerrf("%s: shrank while being copied, the rest is zeros\n", name);
+                memset(chunk_buf + head + done, 0, len - done);
+                break;
+            }
+            done += nbytes;
+        }
+        size_t used = head + len, blocks = (used + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        memset(chunk_buf + used, 0, blocks * BLOCK_SIZE - used);
+        id = write_blocks(id, blocks, chunk_buf);
+        size -= len;
+        head = 0;
+    }
+}
+
+static void init_metadata(struct file_metadata *md, block_size_t id, block_size_t blocks,
+    file_size_t size, bool is_dir, const struct stat *st)
+{
+    md->first_block_id = id;
+    md->block_count = blocks;
+    md->file_size = size;
+    md->mode = is_dir ? MODE_ISDIR : MODE_ISREG;
+    md->create_time = st->st_mtime;
+    md->access_time = st->st_atime;
+    md->modify_time = st->st_mtime;
+}
+
+static void build_file(int dir_fd, const struct mkfs_entry *entry)
+{
+    struct file_metadata md;
+    int fd = openat(dir_fd, entry->name, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1) {
+        perror(entry->name);
+        exit(1);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    fill_chain(entry->first_block_id, fd, NULL, entry->st.st_size, entry->name);
+    close(fd);
+    init_metadata(&md, entry->first_block_id, blocks_of(entry->st.st_size), entry->st.st_size, false, &entry->st);
+    put_inode(entry->first_block_id, &md, false);
+    totals.files++;
+    totals.bytes += entry->st.st_size;
+}
+
+/*
+    copy a host dir into the dir starting at block `id`, which has one block so far
+    the chains of its entries are acquired one after another, then its record is written once,
+    then its files are copied and its dirs built the same way
+*/
+static void build_dir(int dir_fd, block_size_t id, block_size_t parent_id, const struct stat *st)
+{
+    struct mkfs_entry *entries;
+    size_t n = list_host_dir(dir_fd, &entries, true);
+    for (size_t i = 0; i < n; i++) {
+        bool is_dir = S_ISDIR(entries[i].st.st_mode);
+        entries[i].first_block_id = acquire_block_chain(is_dir ? 1 : blocks_of(entries[i].st.st_size));
+    }
+
+    struct dir_record record;
+    init_dir_record(&record, id, parent_id);
+    for (size_t i = 0; i < n; i++) {
+        add_item_in_dir(&record, entries[i].first_block_id, entries[i].name);
+    }
+    file_size_t size = record.size;
+    if (blocks_of(size) > 1) {
+        merge_block_chain(id, acquire_block_chain(blocks_of(size) - 1));
+    }
+    fill_chain(id, -1, record.raw, size, ".");
+    destruct_dir_record(&record);
+
+    struct file_metadata md;
+    init_metadata(&md, id, blocks_of(size), size, true, st);
+    if (id == 0) {
+        set_metadata(0, &md);// rootdir is kept open by the file module
+    } else {
+        put_inode(id, &md, false);
+    }
+    totals.dirs++;
+
+    for (size_t i = 0; i < n; i++) {
+        if (!S_ISDIR(entries[i].st.st_mode)) {
+            build_file(dir_fd, entries + i);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (S_ISDIR(entries[i].st.st_mode)) {
+            int fd = open_host_dir(dir_fd, entries[i].name);
+            build_dir(fd, entries[i].first_block_id, id, &entries[i].st);
+            close(fd);
+        }
+    }
+    free_entries(entries, n);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    size_t block_size = DEFAULT_BLOCK_SIZE, stripe_count = 1, stripe_unit = DEFAULT_STRIPE_UNIT;
+    while ((opt = getopt(argc, argv, "B:t:u:S:v")) != -1) {
+        switch (opt) {
+        case 'B': block_size = parse_size(optarg); break;
+        case 't': stripe_count = parse_size(optarg); break;
+        case 'u': stripe_unit = parse_size(optarg); break;
+        case 'S': format_volume_size = parse_size(optarg); break;
+        case 'v': verbose = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || !block_size_valid(block_size) || !stripe_layout_valid(stripe_count, stripe_unit)) {
+        usage(argv[0]);
+    }
+    format_block_size = block_size;
+    format_stripe_count = stripe_count;
+    format_stripe_unit = stripe_unit;
+    chunk_buf = malloc(MKFS_CHUNK_SIZE);
+    if (chunk_buf == NULL) {
+        perror("main() malloc");
+        return 1;
+    }
+    int source_fd = open_host_dir(AT_FDCWD, argv[optind]);
+    struct stat source_st;
+    if (fstat(source_fd, &source_st) == -1) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (chdir(argv[optind + 1]) == -1) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    if (access(FATABLE_FILENAME, F_OK) == 0 || access(BLOCKFILE_FILENAME, F_OK) == 0
+        || access(INODE_FILENAME, F_OK) == 0) {
+        printerrf("%s already holds a volume\n", argv[optind + 1]);
+        return 1;
+    }
+
+    uint64_t start_ns = stats_now_ns();
+    init_block_module();
+    init_file_module();
+    presize_fatable(count_blocks(source_fd));
+    build_dir(source_fd, 0, 0, &source_st);
+    close(source_fd);
+
+    sync_all_metadatas();
+    sync_fatable();
+    flush_blockfile();
+    flush_fatable();
+    flush_inode_table();
+    double secs = (stats_now_ns() - start_ns) / 1e9;
+    printf("%llu files, %llu dirs, %llu skipped, %.1f MB in %u blocks of %d bytes, %d stripes\n", totals.files,
+        totals.dirs, totals.skipped, totals.bytes / 1048576.0, (unsigned int) get_used_block_num(), BLOCK_SIZE,
+        volume_stripe_count);
+    printf("%.2f s, %.0f files/s, %.2f MB/s\n", secs, (totals.files + totals.dirs) / secs,
+        totals.bytes / 1048576.0 / secs);
+    return 0;
+}
@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include "ops.h"
+#include "block.h"
+#include "path.h"
+#include "gc.h"
+
+static bool fileno_valid(fileno_t fh)
+{
+    return fh >= 0 && fh < FILENO_TABLE_SIZE && file_opened(fh);
+}
+
+int vfs_statfs(struct statvfs *stfs)
+{
+    // temporary solution
+    stfs->f_bsize = BLOCK_SIZE;
+    stfs->f_frsize = BLOCK_SIZE;
+    stfs->f_blocks = BLOCK_COUNT_MAX;
+    stfs->f_bfree = stfs->f_bavail = BLOCK_COUNT_MAX - get_used_block_num();
+    stfs->f_files = stfs->f_ffree = FILE_COUNT_MAX / 2;
+    stfs->f_namemax = MAX_FILENAME_LEN;
+    stfs->f_flag = volume_readonly ? ST_RDONLY : 0;
+    return 0;
+}
+
+int vfs_readdir(const char *_path, void *buf, vfs_filler_t filler)
+{
+    struct dir_record dir;
+    int pathlen = strlen(_path);
+    char path[pathlen + 2];
+    strcpy(path, _path);
+    if (path[pathlen - 1] != '/') {
+        path[pathlen] = '/';
+        path[++pathlen] = '\0';
+    }
+    if (read_dir_recursively(path, &dir) == -1) {
+        destruct_dir_record(&dir);
+        return -ENOENT;
+    }
+    struct dir_entry entry = DIR_ENTRY_INIT;
+    while (next_dir_entry(&dir, &entry)) {
+        if(filler(buf, entry.name)) {
+            break;
+        }
+    }
+    destruct_dir_record(&dir);
+    return 0;
+}
+
+int vfs_mkdir(const char *_path)
+{
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    struct dir_record dir;
+    int pathlen = strlen(_path);
+    char path[pathlen + 1];
+    strcpy(path, _path);
+    if (path[pathlen - 1] == '/') {
+        if (pathlen <= 1) {
+            //root dir
+            return -EEXIST;
+        } else {
+            path[pathlen - 1] = '\0';
+            pathlen--;
+        }
+    }
+    int last_slash_i = read_dir_recursively(path, &dir);
+    const char *filename = path + last_slash_i + 1;
+    if (last_slash_i == -1) {
+        destruct_dir_record(&dir);
+        return -ENOENT;
+    }
+    struct dir_entry entry;
+    if (find_name_in_dir_record(filename, &dir, &entry)) {
+        destruct_dir_record(&dir);
+        return -EEXIST;
+    }
+    fileno_t fn;
+    fn = create_file(dir.dir_fileno, filename, true);
+    close_file(fn);
+    destruct_dir_record(&dir);
+    return 0;
+}
+
+int vfs_rmdir(const char *_path)
+{
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    int pathlen = strlen(_path);
+    char path[pathlen + 1];
+    strcpy(path, _path);
+    if (path[pathlen - 1] == '/') {
+        path[--pathlen] = '\0';
+    }
+    struct dir_record dir;
+    int last_slash_i = read_dir_recursively(path, &dir);
+    const char *filename = path + last_slash_i + 1;
+    if (last_slash_i == -1) {
+        destruct_dir_record(&dir);
+        return -ENOENT;
+    }
+    struct dir_entry entry;
+    if (!find_name_in_dir_record(filename, &dir, &entry)) {
+        destruct_dir_record(&dir);
+        return -ENOENT;
+    }
+    fileno_t fn = open_file(entry.first_block_id);
+    struct file_metadata fm;
+    get_metadata(fn, &fm);
+    close_file(fn);
+    int res;
+    if (fm.mode != MODE_ISDIR) {
+        res = -ENOTDIR;
+    } else {
+        fileno_t fn = open_file(entry.first_block_id);
+        struct dir_record subdir;
+        read_dir(fn, &subdir);// the record owns fn, destruct_dir_record() closes it
+        file_count_t file_count = subdir.file_count;
+        destruct_dir_record(&subdir);
+        if (file_count > 2) {
+            res = -ENOTEMPTY;
+        } else if (!unlink_dir_entry(&dir, &entry)) {
+            res = -ENOENT;// removed by another rmdir meanwhile
+        } else {
+            remove_file(entry.first_block_id);
+            res = 0;
+        }
+    }
+    destruct_dir_record(&dir);
+    return res;
+}
+
+int vfs_getattr(const char *_path, struct stat *st)
+{
+    struct dir_record dir;
+    struct file_metadata md;
+    int pathlen = strlen(_path);
+    char path[pathlen + 1];
+    strcpy(path, _path);
+    if (path[pathlen - 1] == '/') {
+        if (pathlen == 1) {
+            // root dir
+            get_metadata(0, &md);
+            st->st_mode = S_IFDIR | 0777;
+            st->st_nlink = 2;
+            st->st_atim = (struct timespec) {md.access_time, 0};
+            st->st_mtim = (struct timespec) {md.modify_time, 0};
+            st->st_ctim = (struct timespec) {md.create_time, 0};
+            return 0;
+        } else {
+            path[--pathlen] = '\0';
+        }
+    }
+    int last_slash_i = read_dir_recursively(path, &dir);
+    char *filename = path + last_slash_i + 1;
+    if (last_slash_i == -1) {
+        destruct_dir_record(&dir);
+        return -ENOENT;
+    }
+    struct dir_entry entry;
+    if (find_name_in_dir_record(filename, &dir, &entry)) {
+        fileno_t fn = open_file(entry.first_block_id);
+        get_metadata(fn, &md);
+        if (md.mode == MODE_ISDIR) {
+            st->st_mode = S_IFDIR | 0777;
+            st->st_nlink = 2;
+        } else if (md.mode == MODE_ISREG) {
+            st->st_mode = S_IFREG | 0777;
+            st->st_nlink = 1;
+            st->st_size = md.file_size;
+        }
+        st->st_atim = (struct timespec) {md.access_time, 0};
+        st->st_mtim = (struct timespec) {md.modify_time, 0};
+        st->st_ctim = (struct timespec) {md.create_time, 0};
+        close_file(fn);
+        destruct_dir_record(&dir);
+        return 0;
+    }
+    destruct_dir_record(&dir);
+    return -ENOENT;
+}
+
+int vfs_utimens(const char *_path, const struct timespec ts[2])
+{
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    struct dir_record dir;
+    struct file_metadata md;
+    int pathlen = strlen(_path);
+    char path[pathlen + 1];
+    strcpy(path, _path);
+    if (path[pathlen - 1] == '/') {
+        if (pathlen == 1) {
+            // root dir
+            get_metadata(0, &md);
+            md.access_time = ts[0].tv_sec;
+            md.modify_time = ts[1].tv_sec;
+            set_metadata(0, &md);
+            return 0;
+        } else {
+            path[--pathlen] = '\0';
+        }
+    }
+    int last_slash_i = read_dir_recursively(path, &dir);
+    char *filename = path + last_slash_i + 1;
+    if (last_slash_i == -1) {
+        destruct_dir_record(&dir);
+        return -ENOENT;
+    }
+    struct dir_entry entry;
+    if (find_name_in_dir_record(filename, &dir, &entry)) {
+        fileno_t fn = open_file(entry.first_block_id);
+        get_metadata(fn, &md);
+        md.access_time = ts[0].tv_sec;
+        md.modify_time = ts[1].tv_sec;
+        set_metadata(fn, &md);
+        close_file(fn);
+        destruct_dir_record(&dir);
+        return 0;
+    }
+    destruct_dir_record(&dir);
+    return -ENOENT;
+}
+
+int vfs_open(const char *path, fileno_t *fh)
+{
+    struct dir_record dir;
+    int last_slash_i = read_dir_recursively(path, &dir);
+    const char *filename = path + last_slash_i + 1;
+    if (last_slash_i == -1) {
+        destruct_dir_record(&dir);
+        return -ENOENT;
+    }
+    struct dir_entry entry;
+    if (find_name_in_dir_record(filename, &dir, &entry)) {
+        fileno_t fn = open_file(entry.first_block_id);
+        *fh = fn;
+        destruct_dir_record(&dir);
+        return 0;
+    }
+    destruct_dir_record(&dir);
+    return -ENOENT;
+}
+
+int vfs_release(fileno_t fh)
+{
+    if (!fileno_valid(fh)) {
+        return -EBADF;
+    }
+    close_file(fh);
+    return 0;
+}
+
+int vfs_read(fileno_t fh, char *buf, size_t size, off_t offset)
+{
+    if (!fileno_valid(fh)) {
+        return -EBADF;
+    }
+    return read_file(fh, (uint8_t *) buf, size, offset);
+}
+
+int vfs_write(fileno_t fh, const char *buf, size_t size, off_t offset)
+{
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    if (!fileno_valid(fh)) {
+        return -EBADF;
+    }
+    return write_file(fh, (uint8_t *) buf, size, offset);
+}
+
+int vfs_mknod(const char *path, mode_t mode)
+{
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    if (!S_ISREG(mode)) {
+        return -EINVAL;
+    }
+    struct dir_record dir;
+    int last_slash_i = read_dir_recursively(path, &dir);
+    const char *filename = path + last_slash_i + 1;
+    if (last_slash_i == -1) {
+        destruct_dir_record(&dir);
+        return -ENOENT;
+    }
+    struct dir_entry entry;
+    if (find_name_in_dir_record(filename, &dir, &entry)) {
+        destruct_dir_record(&dir);
+        return -EEXIST;
+    }
+    close_file(create_file(dir.dir_fileno, filename, false));
+    destruct_dir_record(&dir);
+    return 0;
+}
+
+/*
+    move the dir entry, the first block id of a replaced file is stored in `replaced`
+*/
+static int rename_entry(const char *from, const char *to, block_size_t *replaced)
+{
+    if (strcmp(from, to) == 0) {
+        return 0;
+    }
+    struct dir_record fdir, tdir;
+    int fsi, tsi;
+    const char *from_fname, *to_fname;
+    fsi = read_dir_recursively(from, &fdir);
+    tsi = read_dir_recursively(to, &tdir);
+    if (fsi == -1 || tsi == -1) {
+        destruct_dir_record(&fdir);
+        destruct_dir_record(&tdir);
+        return -ENOENT;
+    }
+    from_fname = from + fsi + 1;
+    to_fname = to + tsi + 1;
+    struct dir_entry fentry, tentry;
+    if (!find_name_in_dir_record(from_fname, &fdir, &fentry)) {
+        destruct_dir_record(&fdir);
+        destruct_dir_record(&tdir);
+        return -ENOENT;
+    }
+    fileno_t fn;
+    bool replacing = find_name_in_dir_record(to_fname, &tdir, &tentry);
+    if (replacing) {
+        struct file_metadata ffm, tfm;
+        fn = open_file(fentry.first_block_id);
+        get_metadata(fn, &ffm);
+        close_file(fn);
+        fn = open_file(tentry.first_block_id);
+        get_metadata(fn, &tfm);
+        close_file(fn);
+        if (ffm.mode == MODE_ISDIR) {
+            if (tfm.mode == MODE_ISDIR) {
+                fn = open_file(tentry.first_block_id);
+                struct dir_record tsubdir;
+                read_dir(fn, &tsubdir);// the record owns fn, destruct_dir_record() closes it
+                destruct_dir_record(&tsubdir);
+
+                if (tsubdir.file_count != 2) {// to is not empty
+                    destruct_dir_record(&fdir);
+                    destruct_dir_record(&tdir);
+                    return -ENOTEMPTY;
+                }
+            } else {
+                destruct_dir_record(&fdir);
+                destruct_dir_record(&tdir);
+                return -ENOTDIR;
+            }
+        } else {
+            if (tfm.mode == MODE_ISDIR) {
+                destruct_dir_record(&fdir);
+                destruct_dir_record(&tdir);
+                return -EISDIR;
+            }
+        }
+    }
+    block_size_t fbid = fentry.first_block_id;
+    bool unlinked;
+    if (fdir.dir_fileno == tdir.dir_fileno) {
+        //they are in the same dir, use tdir
+        unlinked = find_name_in_dir_record(from_fname, &tdir, &fentry) && unlink_dir_entry(&tdir, &fentry);
+    } else {
+        unlinked = unlink_dir_entry(&fdir, &fentry);
+    }
+    if (!unlinked) {
+        // moved or removed by another operation meanwhile
+        destruct_dir_record(&fdir);
+        destruct_dir_record(&tdir);
+        return -ENOENT;
+    }
+    if (replacing && (fdir.dir_fileno != tdir.dir_fileno || find_name_in_dir_record(to_fname, &tdir, &tentry))
+        && unlink_dir_entry(&tdir, &tentry)) {
+        // unless another operation removed it meanwhile
+        *replaced = tentry.first_block_id;
+    }
+    link_dir_entry(&tdir, fbid, to_fname);
+    destruct_dir_record(&fdir);
+    destruct_dir_record(&tdir);
+    return 0;
+}
+
+int vfs_rename(const char *from, const char *to)
+{
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    block_size_t replaced = BLOCK_ID_NONE;
+    begin_namespace_change();
+    int res = rename_entry(from, to, &replaced);
+    end_namespace_change();
+    if (replaced != BLOCK_ID_NONE) {
+        remove_file(replaced);
+    }
+    return res;
+}
+
+int vfs_unlink(const char *path)
+{
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    struct dir_record dir;
+    int last_slash_i = read_dir_recursively(path, &dir);
+    const char *filename = path + last_slash_i + 1;
+    if (last_slash_i == -1) {
+        destruct_dir_record(&dir);
+        return -ENOENT;
+    }
+    struct dir_entry entry;
+    if (!find_name_in_dir_record(filename, &dir, &entry)) {
+        destruct_dir_record(&dir);
+        return -ENOENT;
+    }
+    fileno_t fn = open_file(entry.first_block_id);
+    struct file_metadata fm;
+    get_metadata(fn, &fm);
+    close_file(fn);
+    int res;
+    if (fm.mode != MODE_ISREG) {
+        res = -EPERM;
+    } else if (!unlink_dir_entry(&dir, &entry)) {
+        res = -ENOENT;// removed by another unlink meanwhile
+    } else {
+        remove_file(entry.first_block_id);
+        res = 0;
+    }
+    destruct_dir_record(&dir);
+    return res;
+}
+
+int vfs_truncate(const char *path, off_t size)
+{
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    int pathlen = strlen(path);
+    if (size < 0) return -EINVAL;
+    if (path[pathlen - 1] == '/') return -EISDIR;
+    struct dir_record dir;
+    int last_slash_i = read_dir_recursively(path, &dir);
+    const char *filename = path + last_slash_i + 1;
+    if (last_slash_i == -1) {
+        destruct_dir_record(&dir);
+        return -ENOENT;
+    }
+    struct dir_entry entry;
+    if (find_name_in_dir_record(filename, &dir, &entry)) {
+        fileno_t fn = open_file(entry.first_block_id);
+        int res;
+        if (cut_file(fn, size)) {
+            res = 0;
+        } else {
+            res = -EFBIG;
+        }
+        close_file(fn);
+        destruct_dir_record(&dir);
+        return res;
+    }
+    destruct_dir_record(&dir);
+    return -ENOENT;
+}
+
+int vfs_fallocate(fileno_t fh, int mode, off_t offset, off_t length)
+{
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    if (!fileno_valid(fh)) {
+        return -EBADF;
+    }
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    if (offset > FILE_SIZE_MAX || length > FILE_SIZE_MAX - offset) {
+        return -EFBIG;
+    }
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+            return -EOPNOTSUPP;
+        }
+        punch_file(fh, offset, length);
+        return 0;
+    }
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        return -EOPNOTSUPP;
+    }
+    if (!allocate_file(fh, offset, length, mode & FALLOC_FL_KEEP_SIZE)) {
+        return -EFBIG;
+    }
+    return 0;
+}
+
+int vfs_fsync(fileno_t fh, bool datasync)
+{
+    if (!fileno_valid(fh)) {
+        return -EBADF;
+    }
+    fsync_file(fh, datasync);
+    return 0;
+}
+
+int vfs_fsyncdir(const char *path, bool datasync)
+{
+    fileno_t fh;
+    if (strcmp(path, "/") == 0) {
+        fsync_file(0, datasync);// rootdir
+        return 0;
+    }
+    int res = vfs_open(path, &fh);
+    if (res != 0) {
+        return res;
+    }
+    struct file_metadata md;
+    get_metadata(fh, &md);
+    if (md.mode != MODE_ISDIR) {
+        res = -ENOTDIR;
+    } else {
+        fsync_file(fh, datasync);
+    }
+    close_file(fh);
+    return res;
+}
+
+int vfs_copy_file_range(fileno_t fh_in, off_t offset_in, fileno_t fh_out, off_t offset_out, size_t size)
+{
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    if (!fileno_valid(fh_in) || !fileno_valid(fh_out)) {
+        return -EBADF;
+    }
+    if (offset_in < 0 || offset_out < 0) {
+        return -EINVAL;
+    }
+    struct file_metadata md_in, md_out;
+    get_metadata(fh_in, &md_in);
+    get_metadata(fh_out, &md_out);
+    if (md_in.mode == MODE_ISDIR || md_out.mode == MODE_ISDIR) {
+        return -EISDIR;
+    }
+    if (size > INT_MAX) {
+        size = INT_MAX;
+    }
+    if (offset_in >= md_in.file_size) {
+        return 0;
+    }
+    if (size > md_in.file_size - offset_in) {
+        size = md_in.file_size - offset_in;
+    }
+    if (md_in.first_block_id == md_out.first_block_id
+        && offset_in < offset_out + (off_t) size && offset_out < offset_in + (off_t) size) {
+        return -EINVAL;
+    }
+    if (offset_out > FILE_SIZE_MAX || size > FILE_SIZE_MAX - offset_out) {
+        return -EFBIG;
+    }
+    return copy_file(fh_in, offset_in, fh_out, offset_out, size);
+}
+
+int vfs_copy(const char *from, const char *to, bool reflink)
+{
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    fileno_t fh_in, fh_out;
+    int res = vfs_open(from, &fh_in);
+    if (res != 0) {
+        return res;
+    }
+    res = vfs_open(to, &fh_out);
+    if (res != 0) {
+        close_file(fh_in);
+        return res;
+    }
+    struct file_metadata md_in, md_out;
+    get_metadata(fh_in, &md_in);
+    get_metadata(fh_out, &md_out);
+    if (md_in.mode == MODE_ISDIR || md_out.mode == MODE_ISDIR) {
+        res = -EISDIR;
+    } else if (reflink) {
+        res = clone_file(fh_in, fh_out) ? 0 : -EINVAL;
+    } else if (md_in.first_block_id == md_out.first_block_id) {
+        res = -EINVAL;// the source would be cut before it is read
+    } else {
+        cut_file(fh_out, 0);
+        for (file_size_t copied = 0; res == 0 && copied < md_in.file_size;) {
+            int n = vfs_copy_file_range(fh_in, copied, fh_out, copied, md_in.file_size - copied);
+            res = n < 0 ? n : n == 0 ? -EIO : 0;// at most INT_MAX bytes a call
+            copied += n > 0 ? n : 0;
+        }
+    }
+    close_file(fh_out);
+    close_file(fh_in);
+    return res;
+}
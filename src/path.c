@@ -16,18 +16,15 @@ int read_dir_recursively(const char *_path, struct dir_record *dir)
     char path[path_len + 1];
     strcpy(path, _path);
     int start = 0, end;
-    int fi;
-    block_size_t block_id;
+    struct dir_entry entry;
     read_dir(0, dir);// read rootdir
     while((end = find_next_slash(path, path_len, start)) != -1) {
         path[end] = '\0';
-        fi = find_name_in_dir_record(path + start + 1, dir);
-        if (fi == FILE_COUNT_MAX) {
+        if (!find_name_in_dir_record(path + start + 1, dir, &entry)) {
             return -1;
         }
-        block_id = dir->list_first_block_id[fi];
         destruct_dir_record(dir);
-        fileno_t fh = open_file(block_id);
+        fileno_t fh = open_file(entry.first_block_id);
         read_dir(fh, dir);
         path[end] = '/';
         start = end;
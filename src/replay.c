@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include "base.h"
+#include "block.h"
+#include "file.h"
+#include "ops.h"
+#include "stats.h"
+#include "trace.h"
+
+#define CONTROL_DIR_PATH "/.naivevfs"
+
+struct replay_config {
+    const char *dir;
+    double speed;// 0 means as fast as possible
+    bool quiet;
+};
+
+static struct replay_config config = {
+    .dir = "/tmp",
+    .speed = 1,
+    .quiet = false,
+};
+
+/*
+    recorded fh -> fileno in the replayed volume
+*/
+static fileno_t fh_map[FILENO_TABLE_SIZE];
+
+static uint8_t *io_buf = NULL;
+static size_t io_buf_size = 0;
+
+static uint8_t *get_io_buf(size_t size)
+{
+    if (size > io_buf_size) {
+        io_buf = realloc(io_buf, size);
+        if (io_buf == NULL) {
+            perror("get_io_buf() realloc");
+            exit(1);
+        }
+        for (size_t i = io_buf_size; i < size; i++) {
+            io_buf[i] = i * 31;
+        }
+        io_buf_size = size;
+    }
+    return io_buf;
+}
+
+static int ignore_entry(void *buf, const char *name)
+{
+    return 0;
+}
+
+static fileno_t map_fh(uint64_t fh)
+{
+    return fh < FILENO_TABLE_SIZE ? fh_map[fh] : -1;
+}
+
+static int replay_record(const struct trace_record *rec, const char *path)
+{
+    struct stat st;
+    struct statvfs stfs;
+    struct timespec ts[2];
+    fileno_t fh;
+    int res;
+    switch (rec->op) {
+    case STATS_OP_GETATTR:
+        return vfs_getattr(path, &st);
+    case STATS_OP_READDIR:
+        return vfs_readdir(path, NULL, ignore_entry);
+    case STATS_OP_MKDIR:
+        return vfs_mkdir(path);
+    case STATS_OP_RMDIR:
+        return vfs_rmdir(path);
+    case STATS_OP_UTIMENS:
+        ts[0] = (struct timespec) {rec->offset, 0};
+        ts[1] = (struct timespec) {rec->size, 0};
+        return vfs_utimens(path, ts);
+    case STATS_OP_OPEN:
+        res = vfs_open(path, &fh);
+        if (res == 0 && rec->result == 0 && rec->fh < FILENO_TABLE_SIZE) {
+            fh_map[rec->fh] = fh;
+        }
+        return res;
+    case STATS_OP_RELEASE:
+        res = vfs_release(map_fh(rec->fh));
+        if (rec->fh < FILENO_TABLE_SIZE) {
+            fh_map[rec->fh] = -1;
+        }
+        return res;
+    case STATS_OP_READ:
+        return vfs_read(map_fh(rec->fh), (char *) get_io_buf(rec->size), rec->size, rec->offset);
+    case STATS_OP_WRITE:
+        return vfs_write(map_fh(rec->fh), (char *) get_io_buf(rec->size), rec->size, rec->offset);
+    case STATS_OP_MKNOD:
+        return vfs_mknod(path, rec->size);
+    case STATS_OP_RENAME:
+        return vfs_rename(path, path + strlen(path) + 1);
+    case STATS_OP_UNLINK:
+        return vfs_unlink(path);
+    case STATS_OP_TRUNCATE:
+        return vfs_truncate(path, rec->size);
+    case STATS_OP_FALLOCATE:
+        return vfs_fallocate(map_fh(rec->fh), rec->flags, rec->offset, rec->size);
+    case STATS_OP_STATFS:
+        return vfs_statfs(&stfs);
+    case STATS_OP_FSYNC:
+        return vfs_fsync(map_fh(rec->fh), rec->flags);
+    case STATS_OP_FSYNCDIR:
+        return vfs_fsyncdir(path, rec->flags);
+    case STATS_OP_COPY:
+        return vfs_copy(path, path + strlen(path) + 1, rec->flags);
+    default:
+        return 0;
+    }
+}
+
+/*
+    sleep until `ns` after `begin_ns`
+*/
+static void wait_until(uint64_t begin_ns, uint64_t ns)
+{
+    uint64_t now = stats_now_ns();
+    if (begin_ns + ns > now) {
+        uint64_t delta = begin_ns + ns - now;
+        struct timespec ts = {delta / 1000000000, delta % 1000000000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void usage(const char *prog)
+{
+    printerrf("usage: %s [options] trace-file\n"
+        "  -m         replay as fast as possible\n"
+        "  -x speed   replay at `speed` times the recorded speed (default 1)\n"
+        "  -D dir     where the scratch volume is created (default /tmp)\n"
+        "  -q         only print the summary\n", prog);
+    exit(1);
+}
+
+static bool is_control_path(const char *path)
+{
+    size_t len = strlen(CONTROL_DIR_PATH);
+    return strncmp(path, CONTROL_DIR_PATH, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "mx:D:q")) != -1) {
+        switch (opt) {
+        case 'm': config.speed = 0; break;
+        case 'x': config.speed = atof(optarg); break;
+        case 'D': config.dir = optarg; break;
+        case 'q': config.quiet = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || config.speed < 0) {
+        usage(argv[0]);
+    }
+    FILE *trace = open_trace(argv[optind]);
+    if (trace == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < FILENO_TABLE_SIZE; i++) {
+        fh_map[i] = -1;
+    }
+
+    char volume_dir[strlen(config.dir) + sizeof("/naivevfs-replay-XXXXXX")];
+    sprintf(volume_dir, "%s/naivevfs-replay-XXXXXX", config.dir);
+    if (mkdtemp(volume_dir) == NULL || chdir(volume_dir) == -1) {
+        perror("main() scratch volume");
+        return 1;
+    }
+    printf("scratch volume: %s\n", volume_dir);
+    init_block_module();
+    init_file_module();
+    stats_enabled = true;
+
+    struct trace_record rec;
+    char path[TRACE_PATH_MAX];
+    size_t ops = 0, mismatches = 0;
+    uint64_t recorded_ns = 0, begin_ns = stats_now_ns();
+    while (read_trace_record(trace, &rec, path)) {
+        if (is_control_path(path)) {
+            continue;
+        }
+        if (config.speed > 0) {
+            wait_until(begin_ns, rec.timestamp_ns / config.speed);
+        }
+        uint64_t start_ns = stats_now_ns();
+        int res = replay_record(&rec, path);
+        stats_record(rec.op, stats_now_ns() - start_ns);
+        if ((res < 0) != (rec.result < 0)) {
+            mismatches++;
+        }
+        ops++;
+        recorded_ns = rec.timestamp_ns + rec.latency_ns;
+    }
+    uint64_t total_ns = stats_now_ns() - begin_ns;
+    fclose(trace);
+
+    sync_all_metadatas();
+    sync_fatable();
+    if (!config.quiet) {
+        size_t len;
+        char *report = render_stats(&len);
+        fwrite(report, 1, len, stdout);
+        free(report);
+    }
+    printf("replayed %zu ops in %.3fs (%.1f ops/s), recorded in %.3fs, %zu results differ from the trace\n",
+        ops, total_ns / 1e9, ops / (total_ns / 1e9), recorded_ns / 1e9, mismatches);
+
+    unlink(FATABLE_FILENAME);
+    remove_blockfile(BLOCKFILE_FILENAME);
+    chdir("/");
+    rmdir(volume_dir);
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "snapshot.h"
+#include "block.h"
+#include "file.h"
+#include "inode.h"
+#include "writeback.h"
+
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool snapshot_name_valid(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 0 && len <= SNAPSHOT_NAME_MAX && strchr(name, '/') == NULL
+        && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+/*
+    path is at least sizeof(SNAPSHOT_FILENAME_PREFIX SNAPSHOT_FILENAME_SUFFIX) + SNAPSHOT_NAME_MAX bytes
+*/
+static void snapshot_path(const char *name, char *path)
+{
+    sprintf(path, SNAPSHOT_FILENAME_PREFIX "%s" SNAPSHOT_FILENAME_SUFFIX, name);
+}
+
+#define SNAPSHOT_PATH_MAX (sizeof(SNAPSHOT_FILENAME_PREFIX SNAPSHOT_FILENAME_SUFFIX) + SNAPSHOT_NAME_MAX)
+
+/*
+    the inode table of a snapshot is kept aside of it, in SNAPSHOT_INODE_SUFFIX instead of SNAPSHOT_FILENAME_SUFFIX
+*/
+static void snapshot_inode_path(const char *name, char *path)
+{
+    sprintf(path, SNAPSHOT_FILENAME_PREFIX "%s" SNAPSHOT_INODE_SUFFIX, name);
+}
+
+static int count_snapshot(void *buf, const char *name)
+{
+    (*(size_t *) buf)++;
+    return 0;
+}
+
+int create_snapshot(const char *name)
+{
+    char path[SNAPSHOT_PATH_MAX], inode_path[SNAPSHOT_PATH_MAX];
+    size_t count = 0;
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    if (!snapshot_name_valid(name)) {
+        return -EINVAL;
+    }
+    pthread_mutex_lock(&snapshot_mutex);
+    list_snapshots(&count, count_snapshot);
+    if (snapshot_exists(name)) {
+        pthread_mutex_unlock(&snapshot_mutex);
+        return -EEXIST;
+    }
+    if (count >= SNAPSHOT_MAX) {
+        pthread_mutex_unlock(&snapshot_mutex);
+        return -ENOSPC;
+    }
+    snapshot_path(name, path);
+    snapshot_inode_path(name, inode_path);
+    // no block I/O is in flight, so every file is frozen between two operations
+    lock_block_map(true);
+    sync_all_metadatas();
+    writeback_all();// the snapshot is read straight from the blockfile
+    // the inode table first, a snapshot file is only there with it
+    bool ok = save_inode_table(inode_path) && save_block_snapshot(path);
+    unlock_block_map();
+    if (!ok) {
+        unlink(inode_path);
+    }
+    if (ok) {
+        sync_fatable();// the physical map of the live volume
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+    return ok ? 0 : -EIO;
+}
+
+int delete_snapshot(const char *name)
+{
+    char path[SNAPSHOT_PATH_MAX], inode_path[SNAPSHOT_PATH_MAX];
+    if (volume_readonly) {
+        return -EROFS;
+    }
+    if (!snapshot_name_valid(name)) {
+        return -ENOENT;
+    }
+    snapshot_path(name, path);
+    pthread_mutex_lock(&snapshot_mutex);
+    int res = 0;
+    if (access(path, F_OK) == -1) {
+        res = -ENOENT;
+    } else if (!drop_block_snapshot(path)) {
+        res = -EIO;
+    } else {
+        snapshot_inode_path(name, inode_path);
+        unlink(inode_path);
+        sync_fatable();
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+    return res;
+}
+
+bool snapshot_exists(const char *name)
+{
+    char path[SNAPSHOT_PATH_MAX];
+    if (!snapshot_name_valid(name)) {
+        return false;
+    }
+    snapshot_path(name, path);
+    return access(path, F_OK) == 0;
+}
+
+void list_snapshots(void *buf, snapshot_filler_t filler)
+{
+    DIR *dir = opendir(".");
+    struct dirent *entry;
+    if (dir == NULL) {
+        return ;
+    }
+    size_t prefix_len = strlen(SNAPSHOT_FILENAME_PREFIX), suffix_len = strlen(SNAPSHOT_FILENAME_SUFFIX);
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len <= prefix_len + suffix_len || strncmp(entry->d_name, SNAPSHOT_FILENAME_PREFIX, prefix_len) != 0
+            || strcmp(entry->d_name + len - suffix_len, SNAPSHOT_FILENAME_SUFFIX) != 0) {
+            continue;
+        }
+        entry->d_name[len - suffix_len] = '\0';
+        if (filler(buf, entry->d_name + prefix_len)) {
+            break;
+        }
+    }
+    closedir(dir);
+}
+
+void mount_snapshot(const char *name)
+{
+    char path[SNAPSHOT_PATH_MAX];
+    if (!snapshot_exists(name)) {
+        printerrf("mount_snapshot(): no snapshot named %s\n", name);
+        exit(1);
+    }
+    snapshot_path(name, path);
+    init_snapshot_block_module(path);
+    snapshot_inode_path(name, path);
+    load_inode_table(path);
+}
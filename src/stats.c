@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "stats.h"
+
+struct stats_counter {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[STATS_HIST_BUCKETS];
+};
+
+/*
+    counters of one thread, only the owner thread writes them,
+    readers load them with relaxed atomics so no lock is taken
+*/
+struct stats_thread {
+    struct stats_counter counters[STATS_OP_NUM];
+    struct stats_thread *next_all;
+    struct stats_thread *next_retired;
+};
+
+bool stats_enabled = false;
+
+static const char *op_names[STATS_OP_NUM] = {
+    [STATS_OP_GETATTR] = "getattr",
+    [STATS_OP_READDIR] = "readdir",
+    [STATS_OP_MKDIR] = "mkdir",
+    [STATS_OP_RMDIR] = "rmdir",
+    [STATS_OP_UTIMENS] = "utimens",
+    [STATS_OP_OPEN] = "open",
+    [STATS_OP_RELEASE] = "release",
+    [STATS_OP_READ] = "read",
+    [STATS_OP_WRITE] = "write",
+    [STATS_OP_MKNOD] = "mknod",
+    [STATS_OP_RENAME] = "rename",
+    [STATS_OP_UNLINK] = "unlink",
+    [STATS_OP_TRUNCATE] = "truncate",
+    [STATS_OP_FALLOCATE] = "fallocate",
+    [STATS_OP_STATFS] = "statfs",
+    [STATS_OP_COPY] = "copy",
+    [STATS_OP_FSYNC] = "fsync",
+    [STATS_OP_FSYNCDIR] = "fsyncdir",
+    [STATS_OP_READ_BLOCK] = "read_block",
+    [STATS_OP_WRITE_BLOCK] = "write_block",
+    [STATS_OP_READ_BLOCKS] = "read_blocks",
+    [STATS_OP_WRITE_BLOCKS] = "write_blocks",
+};
+
+/*
+    all_threads only grows, counters of exited threads are kept and
+    handed to the next new thread through the retired list
+*/
+static struct stats_thread *all_threads = NULL;
+static struct stats_thread *retired_threads = NULL;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_thread *local_stats = NULL;
+
+static void retire_thread_stats(void *p)
+{
+    struct stats_thread *st = p;
+    pthread_mutex_lock(&threads_lock);
+    st->next_retired = retired_threads;
+    retired_threads = st;
+    pthread_mutex_unlock(&threads_lock);
+}
+
+static void create_thread_key(void)
+{
+    pthread_key_create(&thread_key, retire_thread_stats);
+}
+
+static struct stats_thread *get_thread_stats(void)
+{
+    if (local_stats != NULL) {
+        return local_stats;
+    }
+    pthread_once(&thread_key_once, create_thread_key);
+    pthread_mutex_lock(&threads_lock);
+    if (retired_threads != NULL) {
+        local_stats = retired_threads;
+        retired_threads = retired_threads->next_retired;
+    } else {
+        local_stats = calloc(1, sizeof(struct stats_thread));
+        if (local_stats == NULL) {
+            perror("get_thread_stats() calloc");
+            exit(1);
+        }
+        local_stats->next_all = all_threads;
+        __atomic_store_n(&all_threads, local_stats, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&threads_lock);
+    pthread_setspecific(thread_key, local_stats);
+    return local_stats;
+}
+
+#define add_relaxed(field, delta) \
+    __atomic_store_n(&(field), (field) + (delta), __ATOMIC_RELAXED)
+
+void stats_record(enum stats_op op, uint64_t latency_ns)
+{
+    struct stats_counter *c = get_thread_stats()->counters + op;
+    int bucket = latency_ns == 0 ? 0 : 63 - __builtin_clzll(latency_ns);
+    if (bucket >= STATS_HIST_BUCKETS) {
+        bucket = STATS_HIST_BUCKETS - 1;
+    }
+    add_relaxed(c->count, 1);
+    add_relaxed(c->total_ns, latency_ns);
+    add_relaxed(c->hist[bucket], 1);
+    if (latency_ns > c->max_ns) {
+        __atomic_store_n(&c->max_ns, latency_ns, __ATOMIC_RELAXED);
+    }
+}
+
+const char *stats_op_name(enum stats_op op)
+{
+    return op_names[op];
+}
+
+/*
+    sum the counters of every thread into dest
+*/
+static void collect_stats(struct stats_counter *dest)
+{
+    memset(dest, 0, STATS_OP_NUM * sizeof(struct stats_counter));
+    struct stats_thread *st = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE);
+    for (; st != NULL; st = st->next_all) {
+        for (int op = 0; op < STATS_OP_NUM; op++) {
+            struct stats_counter *src = st->counters + op;
+            dest[op].count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+            dest[op].total_ns += __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+            uint64_t max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+            if (max_ns > dest[op].max_ns) {
+                dest[op].max_ns = max_ns;
+            }
+            for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+                dest[op].hist[i] += __atomic_load_n(&src->hist[i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/*
+    estimate a percentile by the upper bound of the bucket it falls in
+*/
+static uint64_t hist_percentile(const struct stats_counter *c, double p)
+{
+    uint64_t target = c->count * p, seen = 0;
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        seen += c->hist[i];
+        if (seen > target) {
+            return 2ULL << i;
+        }
+    }
+    return c->max_ns;
+}
+
+char *render_stats(size_t *len)
+{
+    struct stats_counter counters[STATS_OP_NUM];
+    char *buf;
+    FILE *out = open_memstream(&buf, len);
+    if (out == NULL) {
+        perror("render_stats() open_memstream");
+        exit(1);
+    }
+    collect_stats(counters);
+    fprintf(out, "stats: %s\n", stats_enabled ? "enabled" : "disabled");
+    fprintf(out, "%-12s %12s %12s %10s %10s %10s %10s %10s\n",
+        "op", "count", "total_ms", "avg_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (int op = 0; op < STATS_OP_NUM; op++) {
+        struct stats_counter *c = counters + op;
+        if (c->count == 0) {
+            continue;
+        }
+        fprintf(out, "%-12s %12llu %12.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+            op_names[op], (unsigned long long) c->count, c->total_ns / 1e6,
+            c->total_ns / 1e3 / c->count,
+            hist_percentile(c, 0.5) / 1e3, hist_percentile(c, 0.99) / 1e3,
+            hist_percentile(c, 0.999) / 1e3, c->max_ns / 1e3);
+    }
+    fprintf(out, "\nlatency histograms (bucket upper bound in us: count)\n");
+    for (int op = 0; op < STATS_OP_NUM; op++) {
+        struct stats_counter *c = counters + op;
+        if (c->count == 0) {
+            continue;
+        }
+        fprintf(out, "%s:", op_names[op]);
+        for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+            if (c->hist[i] != 0) {
+                fprintf(out, " %.3f:%llu", (2ULL << i) / 1e3, (unsigned long long) c->hist[i]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+    fclose(out);
+    return buf;
+}
+
+static void *stats_dumper(void *arg)
+{
+    unsigned int interval = (uintptr_t) arg;
+    while (true) {
+        sleep(interval);
+        size_t len;
+        char *buf = render_stats(&len);
+        fwrite(buf, 1, len, stderr);
+        free(buf);
+    }
+    return NULL;
+}
+
+void start_stats_dumper(unsigned int interval)
+{
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, stats_dumper, (void *)(uintptr_t) interval) != 0) {
+        perror("start_stats_dumper() pthread_create");
+        exit(1);
+    }
+    pthread_detach(tid);
+}
@@ -0,0 +1,605 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "tier.h"
+#include "probes.h"
+
+/*
+    the tiermap file starts with a header, then the slot held by every fast block, TIER_NONE if free
+*/
+#define TIERMAP_MAGIC 0x71e2aa9bu
+struct tiermap_header {
+    uint32_t magic;
+    uint32_t block_size;// of the volume when the fast tier was made
+    block_size_t capacity;// fast blocks
+};
+#define TIERMAP_PAGE_ENTRIES (META_PAGE_SIZE / sizeof(block_size_t))
+
+bool tier_enabled = false;
+size_t format_tier_size = 0;
+
+static bool tier_readonly = false;
+static int fast_fd = -1, map_fd = -1;
+static block_size_t capacity = 0;
+static block_size_t *owner = NULL;// slot held by every fast block
+static uint8_t *dirty_pages = NULL;// pages of owner changed since the last sync_tier()
+static uint8_t *fresh = NULL;// fast blocks taken by a write of a slot which had none, until it is done
+static block_size_t *slot_fast = NULL;// fast block of every slot
+static uint8_t *heat = NULL;// accesses of every slot, halved by every pass of the migrator
+static block_size_t slot_cap = 0;
+static block_size_t *free_blocks = NULL;// free fast blocks, the last one out first
+static block_size_t free_num = 0;
+static block_size_t *pending = NULL;// fast blocks left since the last sync_tier(), the oldest first
+static block_size_t pending_num = 0;
+/*
+    protects everything above which is not set at load time, and the counters
+    priority: fatable_mem_lock > io_lock > map_lock
+*/
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+/*
+    held for reading around the I/O of slots, for writing to move slots or to reuse the fast blocks they left
+*/
+static pthread_rwlock_t io_lock = PTHREAD_RWLOCK_INITIALIZER;
+/*
+    a slot written during its move is left where it was
+*/
+static uint32_t write_seq[TIER_SEQ_BUCKETS];
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    unsigned long long fast_reads;
+    unsigned long long home_reads;
+    unsigned long long fast_writes;
+    unsigned long long home_writes;
+    unsigned long long full_writes;// written home for want of a free fast block
+    unsigned long long promoted;
+    unsigned long long demoted;
+    unsigned long long raced;// moves given up because the slot changed meanwhile
+    unsigned long long syncs;
+} counters;
+
+static bool migrator_running = false;
+static pthread_t migrator_tid;
+static pthread_mutex_t migrator_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t migrator_cond = PTHREAD_COND_INITIALIZER;
+
+static inline uint32_t *seq_of(block_size_t slot)
+{
+    return write_seq + (slot * 2654435761u) % TIER_SEQ_BUCKETS;
+}
+
+/*
+    make slot_fast and heat cover `slot`
+    caller should hold map_lock
+*/
+static void cover_slot_locked(block_size_t slot)
+{
+    if (slot < slot_cap) {
+        return ;
+    }
+    block_size_t new_cap = slot_cap * 3 / 2 > slot ? slot_cap * 3 / 2 : slot + 1;
+    block_size_t *new_fast = realloc(slot_fast, new_cap * sizeof(block_size_t));
+    uint8_t *new_heat = realloc(heat, new_cap);
+    if (new_fast == NULL || new_heat == NULL) {
+        perror("cover_slot_locked() realloc");
+        exit(1);
+    }
+    for (block_size_t i = slot_cap; i < new_cap; i++) {
+        new_fast[i] = TIER_NONE;
+    }
+    memset(new_heat + slot_cap, 0, new_cap - slot_cap);
+    slot_fast = new_fast;
+    heat = new_heat;
+    slot_cap = new_cap;
+}
+
+/*
+    caller should hold map_lock
+*/
+static inline void set_owner_locked(block_size_t fast, block_size_t slot)
+{
+    owner[fast] = slot;
+    dirty_pages[fast / TIERMAP_PAGE_ENTRIES / 8] |= 1 << (fast / TIERMAP_PAGE_ENTRIES % 8);
+}
+
+static void alloc_tables(void)
+{
+    size_t pages = (capacity + TIERMAP_PAGE_ENTRIES - 1) / TIERMAP_PAGE_ENTRIES;
+    owner = malloc(capacity * sizeof(block_size_t));
+    free_blocks = malloc(capacity * sizeof(block_size_t));
+    pending = malloc(capacity * sizeof(block_size_t));
+    dirty_pages = calloc((pages + 7) / 8, 1);
+    fresh = calloc((capacity + 7) / 8, 1);
+    if (owner == NULL || free_blocks == NULL || pending == NULL || dirty_pages == NULL || fresh == NULL) {
+        perror("alloc_tables() malloc");
+        exit(1);
+    }
+}
+
+/*
+    create a fast tier of format_tier_size bytes, every fast block is free
+*/
+static void create_tier(void)
+{
+    capacity = format_tier_size / BLOCK_SIZE;
+    if (capacity == 0) {
+        return ;
+    }
+    fast_fd = open(TIER_FILENAME, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    map_fd = open(TIERMAP_FILENAME, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fast_fd == -1 || map_fd == -1) {
+        perror("create_tier() open");
+        exit(1);
+    }
+    alloc_tables();
+    for (block_size_t i = 0; i < capacity; i++) {
+        owner[i] = TIER_NONE;
+    }
+    struct tiermap_header header = {TIERMAP_MAGIC, BLOCK_SIZE, capacity};
+    if (pwrite(map_fd, &header, sizeof(header), 0) != sizeof(header)
+        || pwrite(map_fd, owner, capacity * sizeof(block_size_t), sizeof(header)) != capacity * sizeof(block_size_t)
+        || fdatasync(map_fd) == -1) {
+        perror("create_tier() write");
+        exit(1);
+    }
+    if (fallocate(fast_fd, 0, 0, (off_t)capacity * BLOCK_SIZE) == -1 && errno != EOPNOTSUPP) {
+        perror("create_tier() fallocate");
+    }
+}
+
+void open_tier(bool readonly)
+{
+    tier_readonly = readonly;
+    map_fd = open(TIERMAP_FILENAME, readonly ? O_RDONLY : O_RDWR);
+    if (map_fd == -1) {
+        if (errno != ENOENT) {
+            perror("open_tier() open");
+            exit(1);
+        }
+        if (readonly || format_tier_size == 0) {
+            return ;
+        }
+        create_tier();
+    } else {
+        struct tiermap_header header;
+        if (pread(map_fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != TIERMAP_MAGIC
+            || (int) header.block_size != BLOCK_SIZE) {
+            printerrf("open_tier(): tiermap file is broken\n");
+            exit(1);
+        }
+        capacity = header.capacity;
+        alloc_tables();
+        if (pread(map_fd, owner, capacity * sizeof(block_size_t), sizeof(header)) != capacity * sizeof(block_size_t)) {
+            printerrf("open_tier(): tiermap file is broken\n");
+            exit(1);
+        }
+        fast_fd = open(TIER_FILENAME, readonly ? O_RDONLY : O_RDWR);
+        if (fast_fd == -1) {
+            perror(TIER_FILENAME);
+            exit(1);
+        }
+    }
+    if (capacity == 0) {
+        return ;
+    }
+    // free blocks go out lowest first
+    for (block_size_t i = capacity; i-- > 0; ) {
+        if (owner[i] == TIER_NONE) {
+            free_blocks[free_num++] = i;
+        } else {
+            cover_slot_locked(owner[i]);
+            slot_fast[owner[i]] = i;
+        }
+    }
+    tier_enabled = true;
+}
+
+void tier_begin_io(void)
+{
+    pthread_rwlock_rdlock(&io_lock);
+}
+
+/*
+    the slot recorded for a fast block in the tiermap file, read by a snapshot mounted beside the live volume,
+    whose migrator keeps moving slots: the slots of a snapshot never change, so a fast block still recorded for one
+    holds its data, and one moved home since the mount has its data at home
+*/
+static block_size_t durable_owner(block_size_t fast)
+{
+    block_size_t slot;
+    if (pread(map_fd, &slot, sizeof(slot), sizeof(struct tiermap_header) + (off_t)fast * sizeof(block_size_t)) != sizeof(slot)) {
+        perror("durable_owner() pread");
+        return TIER_NONE;
+    }
+    return slot;
+}
+
+void tier_route(const block_size_t *slots, size_t n, block_size_t *fast, bool write)
+{
+    pthread_mutex_lock(&map_lock);
+    for (size_t i = 0; i < n; i++) {
+        fast[i] = TIER_NONE;
+        if (slots[i] == SLOT_NONE) {
+            continue;
+        }
+        cover_slot_locked(slots[i]);
+        fast[i] = slot_fast[slots[i]];
+        if (!write) {
+            if (tier_readonly && fast[i] != TIER_NONE && durable_owner(fast[i]) != slots[i]) {
+                fast[i] = TIER_NONE;
+            }
+            heat[slots[i]] += heat[slots[i]] < UINT8_MAX;
+            if (fast[i] != TIER_NONE) {
+                counters.fast_reads++;
+            } else {
+                counters.home_reads++;
+            }
+        } else if (fast[i] != TIER_NONE) {
+            counters.fast_writes++;
+        } else if (!tier_readonly && free_num > 0) {
+            fast[i] = free_blocks[--free_num];// recorded by tier_end_io() once written
+            fresh[fast[i] / 8] |= 1 << (fast[i] % 8);
+            counters.fast_writes++;
+        } else {
+            counters.home_writes++;
+            counters.full_writes++;
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+}
+
+void tier_io(const block_size_t *slots, const block_size_t *fast, size_t n, uint8_t *buf, bool write)
+{
+    for (size_t i = 0; i < n; ) {
+        if (fast[i] == TIER_NONE) {
+            i++;
+            continue;
+        }
+        size_t len = 1;
+        while (i + len < n && fast[i + len] == fast[i] + len) {
+            len++;
+        }
+        size_t done = 0, size = len * BLOCK_SIZE;
+        while (done < size) {
+            ssize_t nbytes = write ? pwrite(fast_fd, buf + i * BLOCK_SIZE + done, size - done, (off_t)fast[i] * BLOCK_SIZE + done)
+                : pread(fast_fd, buf + i * BLOCK_SIZE + done, size - done, (off_t)fast[i] * BLOCK_SIZE + done);
+            if (nbytes <= 0) {
+                if (write) {
+                    perror("tier_io() pwrite");
+                    exit(1);
+                } else if (nbytes == -1) {
+                    perror("tier_io() pread");
+                }
+                memset(buf + i * BLOCK_SIZE + done, 0, size - done);
+                break;
+            }
+            done += nbytes;
+        }
+        // checked again, the fast block may have been taken by another slot during the read
+        for (size_t j = i; tier_readonly && !write && j < i + len; j++) {
+            if (durable_owner(fast[j]) != slots[j]) {
+                read_home_slot(slots[j], buf + j * BLOCK_SIZE);
+            }
+        }
+        i += len;
+    }
+}
+
+void tier_end_io(const block_size_t *slots, const block_size_t *fast, size_t n, bool write)
+{
+    if (write) {
+        pthread_mutex_lock(&map_lock);
+        for (size_t i = 0; i < n; i++) {
+            if (slots[i] == SLOT_NONE) {
+                continue;
+            }
+            // a slot written in place may have been freed meanwhile, its fast block is left to tier_drop()
+            if (fast[i] != TIER_NONE && (fresh[fast[i] / 8] & (1 << (fast[i] % 8)))) {
+                fresh[fast[i] / 8] &= ~(1 << (fast[i] % 8));
+                if (slot_fast[slots[i]] == TIER_NONE) {
+                    slot_fast[slots[i]] = fast[i];
+                    set_owner_locked(fast[i], slots[i]);
+                } else {
+                    free_blocks[free_num++] = fast[i];// written by someone else meanwhile, never seen by a reader
+                }
+            }
+            __atomic_add_fetch(seq_of(slots[i]), 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&map_lock);
+    }
+    pthread_rwlock_unlock(&io_lock);
+}
+
+void tier_drop(block_size_t slot)
+{
+    pthread_mutex_lock(&map_lock);
+    if (slot < slot_cap) {
+        heat[slot] = 0;
+        if (slot_fast[slot] != TIER_NONE) {
+            set_owner_locked(slot_fast[slot], TIER_NONE);
+            pending[pending_num++] = slot_fast[slot];
+            slot_fast[slot] = TIER_NONE;
+        }
+    }
+    __atomic_add_fetch(seq_of(slot), 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&map_lock);
+}
+
+void sync_tier(void)
+{
+    if (!tier_enabled || tier_readonly) {
+        return ;
+    }
+    pthread_mutex_lock(&sync_lock);
+    // take the changed pages first, so that the data of every block they record is synced below
+    size_t pages = (capacity + TIERMAP_PAGE_ENTRIES - 1) / TIERMAP_PAGE_ENTRIES, taken_num = 0;
+    block_size_t *taken = malloc(pages * sizeof(block_size_t) + 1);
+    uint8_t *copy;
+    if (taken == NULL) {
+        perror("sync_tier() malloc");
+        exit(1);
+    }
+    pthread_mutex_lock(&map_lock);
+    for (size_t page = 0; page < pages; page++) {
+        if (dirty_pages[page / 8] & (1 << (page % 8))) {
+            taken[taken_num++] = page;
+        }
+    }
+    copy = malloc(taken_num * META_PAGE_SIZE + 1);
+    if (copy == NULL) {
+        perror("sync_tier() malloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < taken_num; i++) {
+        block_size_t start = taken[i] * TIERMAP_PAGE_ENTRIES;
+        block_size_t n = capacity - start < TIERMAP_PAGE_ENTRIES ? capacity - start : TIERMAP_PAGE_ENTRIES;
+        memcpy(copy + i * META_PAGE_SIZE, owner + start, n * sizeof(block_size_t));
+        dirty_pages[taken[i] / 8] &= ~(1 << (taken[i] % 8));
+    }
+    block_size_t left = pending_num;
+    pthread_mutex_unlock(&map_lock);
+
+    sync_home_slots();
+    if (fdatasync(fast_fd) == -1) {
+        perror("sync_tier() fdatasync");
+        exit(1);
+    }
+    for (size_t i = 0; i < taken_num; i++) {
+        block_size_t start = taken[i] * TIERMAP_PAGE_ENTRIES;
+        block_size_t n = capacity - start < TIERMAP_PAGE_ENTRIES ? capacity - start : TIERMAP_PAGE_ENTRIES;
+        size_t len = n * sizeof(block_size_t);
+        if (pwrite(map_fd, copy + i * META_PAGE_SIZE, len, sizeof(struct tiermap_header) + (off_t)start * sizeof(block_size_t)) != len) {
+            perror("sync_tier() pwrite");
+            exit(1);
+        }
+    }
+    if (taken_num > 0 && fdatasync(map_fd) == -1) {
+        perror("sync_tier() fdatasync");
+        exit(1);
+    }
+    free(taken);
+    free(copy);
+
+    // a reader which found a left block before it was left is done once the lock is taken
+    pthread_rwlock_wrlock(&io_lock);
+    pthread_mutex_lock(&map_lock);
+    for (block_size_t i = 0; i < left; i++) {
+        free_blocks[free_num++] = pending[i];
+    }
+    memmove(pending, pending + left, (pending_num - left) * sizeof(block_size_t));
+    pending_num -= left;
+    counters.syncs++;
+    pthread_mutex_unlock(&map_lock);
+    pthread_rwlock_unlock(&io_lock);
+    pthread_mutex_unlock(&sync_lock);
+}
+
+/*
+    a slot being moved, from its fast block to home or from home to a new fast block
+*/
+struct tier_move {
+    block_size_t slot;
+    block_size_t fast;
+    bool up;
+    uint32_t seq;
+};
+
+/*
+    choose the slots to move and cool every slot down
+    hot slots at home go up while more than 1/TIER_LOW_FREE of the fast tier is free,
+    cold slots go home while less than that is, until 1/TIER_HIGH_FREE is free
+    the fast blocks and the slots are walked TIER_SCAN_CHUNK at a time, map_lock is let go in between,
+    move_slots() gives up the moves whose slot changed meanwhile
+*/
+static size_t choose_moves(struct tier_move *moves, block_size_t *demote_hand)
+{
+    size_t n = 0;
+    pthread_mutex_lock(&map_lock);
+    block_size_t reserve = capacity / TIER_LOW_FREE;
+    bool demote = free_num + pending_num < reserve;
+    block_size_t want = demote ? capacity / TIER_HIGH_FREE - free_num - pending_num : 0;
+    pthread_mutex_unlock(&map_lock);
+    for (block_size_t i = 0; i < capacity && n < TIER_MIGRATE_BATCH && n < want;) {
+        pthread_mutex_lock(&map_lock);
+        for (block_size_t end = i + TIER_SCAN_CHUNK; i < end && i < capacity && n < TIER_MIGRATE_BATCH && n < want; i++) {
+            block_size_t fast = (*demote_hand + i) % capacity, slot = owner[fast];
+            if (slot != TIER_NONE && heat[slot] == 0) {
+                moves[n++] = (struct tier_move) {slot, fast, false, 0};
+            }
+        }
+        pthread_mutex_unlock(&map_lock);
+    }
+    if (demote) {
+        *demote_hand = (*demote_hand + capacity / 8 + 1) % capacity;
+    }
+    for (block_size_t slot = 0; ;) {
+        pthread_mutex_lock(&map_lock);
+        if (slot >= slot_cap) {
+            pthread_mutex_unlock(&map_lock);
+            break;
+        }
+        for (block_size_t end = slot + TIER_SCAN_CHUNK; slot < end && slot < slot_cap; slot++) {
+            if (heat[slot] >= TIER_PROMOTE_HEAT && slot_fast[slot] == TIER_NONE && n < TIER_MIGRATE_BATCH
+                && free_num > reserve) {
+                moves[n++] = (struct tier_move) {slot, free_blocks[--free_num], true, 0};
+            }
+            heat[slot] >>= 1;
+        }
+        pthread_mutex_unlock(&map_lock);
+    }
+    return n;
+}
+
+/*
+    move a batch of slots: their data is read and the fast blocks of the slots going up are written
+    without holding the tiers, the moves whose slot was neither written nor freed meanwhile are then done at once,
+    the home of a slot going down is written while no one else can, its slot may have been freed and taken again
+    returns the number of moved slots
+*/
+static size_t move_slots(struct tier_move *moves, size_t n, uint8_t *buf)
+{
+    for (size_t i = 0; i < n; i++) {
+        moves[i].seq = __atomic_load_n(seq_of(moves[i].slot), __ATOMIC_ACQUIRE);
+        if (moves[i].up) {
+            read_home_slot(moves[i].slot, buf + i * BLOCK_SIZE);
+            tier_io(&moves[i].slot, &moves[i].fast, 1, buf + i * BLOCK_SIZE, true);
+        } else {
+            tier_io(&moves[i].slot, &moves[i].fast, 1, buf + i * BLOCK_SIZE, false);
+        }
+    }
+    size_t moved = 0;
+    pthread_rwlock_wrlock(&io_lock);
+    for (size_t i = 0; i < n; i++) {
+        struct tier_move *move = moves + i;
+        pthread_mutex_lock(&map_lock);
+        bool same = __atomic_load_n(seq_of(move->slot), __ATOMIC_ACQUIRE) == move->seq
+            && slot_fast[move->slot] == (move->up ? TIER_NONE : move->fast);
+        pthread_mutex_unlock(&map_lock);
+        if (same && !move->up) {
+            write_home_slot(move->slot, buf + i * BLOCK_SIZE);
+        }
+        pthread_mutex_lock(&map_lock);
+        // tier_drop() may have freed the slot during the write home
+        same = same && __atomic_load_n(seq_of(move->slot), __ATOMIC_ACQUIRE) == move->seq;
+        if (!same) {
+            counters.raced++;
+            if (move->up) {
+                free_blocks[free_num++] = move->fast;
+            }
+        } else if (move->up) {
+            slot_fast[move->slot] = move->fast;
+            set_owner_locked(move->fast, move->slot);
+            counters.promoted++;
+            moved++;
+        } else {
+            slot_fast[move->slot] = TIER_NONE;
+            set_owner_locked(move->fast, TIER_NONE);
+            pending[pending_num++] = move->fast;
+            counters.demoted++;
+            moved++;
+        }
+        pthread_mutex_unlock(&map_lock);
+    }
+    pthread_rwlock_unlock(&io_lock);
+    return moved;
+}
+
+static void *migrator_thread(void *arg)
+{
+    unsigned int interval_ms = (uintptr_t) arg;
+    struct tier_move moves[TIER_MIGRATE_BATCH];
+    block_size_t demote_hand = 0;
+    uint8_t *buf = malloc((size_t) TIER_MIGRATE_BATCH * BLOCK_SIZE);
+    if (buf == NULL) {
+        perror("migrator_thread() malloc");
+        exit(1);
+    }
+    pthread_mutex_lock(&migrator_lock);
+    while (migrator_running) {
+        pthread_mutex_unlock(&migrator_lock);
+        size_t n = choose_moves(moves, &demote_hand), moved = move_slots(moves, n, buf);
+        pthread_mutex_lock(&map_lock);
+        bool left = pending_num > 0;
+        pthread_mutex_unlock(&map_lock);
+        if (moved > 0 || left) {
+            sync_tier();
+        }
+        NAIVE_PROBE2(tier_migrate, n, moved);
+
+        pthread_mutex_lock(&migrator_lock);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += interval_ms / 1000;
+        ts.tv_nsec += (interval_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        while (migrator_running && pthread_cond_timedwait(&migrator_cond, &migrator_lock, &ts) != ETIMEDOUT) {
+        }
+    }
+    pthread_mutex_unlock(&migrator_lock);
+    free(buf);
+    return NULL;
+}
+
+void start_tier_migrator(unsigned int interval_ms)
+{
+    if (!tier_enabled || tier_readonly || migrator_running) {
+        return ;
+    }
+    migrator_running = true;
+    if (pthread_create(&migrator_tid, NULL, migrator_thread, (void *)(uintptr_t) interval_ms) != 0) {
+        perror("start_tier_migrator() pthread_create");
+        exit(1);
+    }
+}
+
+void stop_tier_migrator(void)
+{
+    if (migrator_running) {
+        pthread_mutex_lock(&migrator_lock);
+        migrator_running = false;
+        pthread_cond_signal(&migrator_cond);
+        pthread_mutex_unlock(&migrator_lock);
+        pthread_join(migrator_tid, NULL);
+    }
+    sync_tier();
+}
+
+char *render_tier_stats(size_t *len)
+{
+    char *buf = NULL;
+    FILE *out = open_memstream(&buf, len);
+    if (out == NULL) {
+        perror("render_tier_stats() open_memstream");
+        exit(1);
+    }
+    pthread_mutex_lock(&map_lock);
+    unsigned long long reads = counters.fast_reads + counters.home_reads;
+    fprintf(out, "state %s\n", tier_enabled ? "on" : "off");
+    fprintf(out, "fast_blocks %u\n", (unsigned int) capacity);
+    fprintf(out, "free_blocks %u\n", (unsigned int) free_num);
+    fprintf(out, "pending_blocks %u\n", (unsigned int) pending_num);
+    fprintf(out, "fast_reads %llu\n", counters.fast_reads);
+    fprintf(out, "home_reads %llu\n", counters.home_reads);
+    fprintf(out, "fast_read_ratio %.3f\n", reads > 0 ? (double) counters.fast_reads / reads : 0.0);
+    fprintf(out, "fast_writes %llu\n", counters.fast_writes);
+    fprintf(out, "home_writes %llu\n", counters.home_writes);
+    fprintf(out, "full_writes %llu\n", counters.full_writes);
+    fprintf(out, "promoted %llu\n", counters.promoted);
+    fprintf(out, "demoted %llu\n", counters.demoted);
+    fprintf(out, "raced %llu\n", counters.raced);
+    fprintf(out, "syncs %llu\n", counters.syncs);
+    pthread_mutex_unlock(&map_lock);
+    fclose(out);
+    return buf;
+}
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+#define TRACE_BUF_SIZE (1 << 20)
+
+bool trace_enabled = false;
+
+static FILE *trace_file = NULL;
+static uint64_t trace_begin_ns;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void start_trace(const char *path)
+{
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL) {
+        perror("start_trace() fopen");
+        exit(1);
+    }
+    setvbuf(trace_file, NULL, _IOFBF, TRACE_BUF_SIZE);
+    if (fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_file) != strlen(TRACE_MAGIC)) {
+        perror("start_trace() fwrite");
+        exit(1);
+    }
+    trace_begin_ns = stats_now_ns();
+    trace_enabled = true;
+}
+
+void stop_trace(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    trace_enabled = false;
+    if (trace_file != NULL) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_op(enum stats_op op, const char *path, const char *path2, uint64_t fh,
+    uint64_t offset, uint64_t size, uint8_t flags, int result, uint64_t start_ns, uint64_t latency_ns)
+{
+    size_t len = strlen(path), len2 = path2 == NULL ? 0 : strlen(path2) + 1;
+    struct trace_record rec = {
+        .op = op,
+        .flags = flags,
+        .path_len = len + len2,
+        .result = result,
+        .fh = fh,
+        .offset = offset,
+        .size = size,
+        .timestamp_ns = start_ns - trace_begin_ns,
+        .latency_ns = latency_ns,
+    };
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL) {
+        fwrite(&rec, sizeof(rec), 1, trace_file);
+        fwrite(path, 1, len, trace_file);
+        if (path2 != NULL) {
+            fputc('\0', trace_file);
+            fwrite(path2, 1, len2 - 1, trace_file);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+FILE *open_trace(const char *path)
+{
+    char magic[sizeof(TRACE_MAGIC)] = {0};
+    FILE *trace = fopen(path, "rb");
+    if (trace == NULL) {
+        perror("open_trace() fopen");
+        return NULL;
+    }
+    setvbuf(trace, NULL, _IOFBF, TRACE_BUF_SIZE);
+    if (fread(magic, 1, strlen(TRACE_MAGIC), trace) != strlen(TRACE_MAGIC) || strcmp(magic, TRACE_MAGIC) != 0) {
+        printerrf("open_trace(): %s is not a trace file\n", path);
+        fclose(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+bool read_trace_record(FILE *trace, struct trace_record *rec, char *path)
+{
+    if (fread(rec, sizeof(struct trace_record), 1, trace) != 1) {
+        return false;
+    }
+    if (rec->op >= STATS_OP_NUM || rec->path_len >= TRACE_PATH_MAX
+        || fread(path, 1, rec->path_len, trace) != rec->path_len) {
+        printerrf("read_trace_record(): trace file is broken\n");
+        return false;
+    }
+    path[rec->path_len] = '\0';
+    return true;
+}
@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "writeback.h"
+#include "stats.h"
+#include "probes.h"
+
+/*
+    a dirty slot, it is in the age list (oldest first) until the flusher takes it,
+    then in the flushing list until its write is done
+    a slot written again meanwhile is redirtied and goes back to the age list,
+    a slot freed meanwhile is dropped and goes away
+*/
+struct cached_block {
+    block_size_t slot;
+    bool flushing;
+    bool redirtied;
+    bool dropped;
+    uint64_t dirtied_ns;// first write since it was last clean
+    uint64_t flushing_ns;// dirtied_ns of the data being written
+    struct cached_block *hash_next;
+    struct cached_block *prev, *next;
+    uint8_t data[];// BLOCK_SIZE bytes
+};
+
+struct block_list {
+    struct cached_block *head, *tail;
+};
+
+static bool writeback_enabled = false;
+static struct cached_block **buckets = NULL;
+static size_t bucket_mask = 0;
+static struct block_list age_list = {NULL, NULL}, flushing_list = {NULL, NULL};
+static size_t dirty_num = 0, flushing_num = 0, dirty_limit = 0;
+static uint64_t expire_ns = 0;
+static bool flusher_running = false;
+static pthread_t flusher_tid;
+/*
+    protect everything above but writeback_enabled, which only changes with no I/O in flight
+*/
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t clean_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+    counters, protected by writeback_lock
+*/
+static struct {
+    unsigned long long cached;
+    unsigned long long rewritten;
+    unsigned long long read_hits;
+    unsigned long long written;
+    unsigned long long expired;
+    unsigned long long dropped;
+    unsigned long long throttled;
+    unsigned long long throttled_ns;
+} counters;
+
+static inline struct cached_block **bucket_of(block_size_t slot)
+{
+    return &buckets[(slot * 2654435761u) & bucket_mask];
+}
+
+static struct cached_block *find_block_locked(block_size_t slot)
+{
+    struct cached_block *cb = *bucket_of(slot);
+    while (cb != NULL && cb->slot != slot) {
+        cb = cb->hash_next;
+    }
+    return cb;
+}
+
+static void list_append(struct block_list *list, struct cached_block *cb)
+{
+    cb->prev = list->tail;
+    cb->next = NULL;
+    if (list->tail != NULL) {
+        list->tail->next = cb;
+    } else {
+        list->head = cb;
+    }
+    list->tail = cb;
+}
+
+static void list_remove(struct block_list *list, struct cached_block *cb)
+{
+    if (cb->prev != NULL) {
+        cb->prev->next = cb->next;
+    } else {
+        list->head = cb->next;
+    }
+    if (cb->next != NULL) {
+        cb->next->prev = cb->prev;
+    } else {
+        list->tail = cb->prev;
+    }
+}
+
+/*
+    unhash and free a block which is in no list
+    caller should hold writeback_lock
+*/
+static void free_block_locked(struct cached_block *cb)
+{
+    struct cached_block **pp = bucket_of(cb->slot);
+    while (*pp != cb) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = cb->hash_next;
+    free(cb);
+    dirty_num--;
+    pthread_cond_broadcast(&clean_cond);
+}
+
+/*
+    write back up to WRITEBACK_BATCH of the oldest slots dirtied no later than `before`
+    the data is copied under the lock and written without it
+    returns the number of written slots
+    caller should hold writeback_lock, it is released meanwhile
+*/
+static size_t flush_oldest_locked(uint64_t before)
+{
+    struct cached_block *batch[WRITEBACK_BATCH];
+    size_t n = 0, batch_max = WRITEBACK_BATCH_BYTES / BLOCK_SIZE < WRITEBACK_BATCH
+        ? WRITEBACK_BATCH_BYTES / BLOCK_SIZE : WRITEBACK_BATCH;
+    while (n < batch_max && age_list.head != NULL && age_list.head->dirtied_ns <= before) {
+        struct cached_block *cb = age_list.head;
+        list_remove(&age_list, cb);
+        list_append(&flushing_list, cb);
+        cb->flushing = true;
+        cb->flushing_ns = cb->dirtied_ns;
+        batch[n++] = cb;
+    }
+    flushing_num += n;
+    if (n == 0) {
+        return 0;
+    }
+    uint8_t *data = malloc(n * BLOCK_SIZE);
+    if (data == NULL) {
+        perror("flush_oldest_locked() malloc");
+        exit(1);
+    }
+    block_size_t slots[WRITEBACK_BATCH];
+    for (size_t i = 0; i < n; i++) {
+        slots[i] = batch[i]->slot;
+        memcpy(data + i * BLOCK_SIZE, batch[i]->data, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&writeback_lock);
+    for (size_t i = 0; i < n; i++) {
+        write_slot(slots[i], data + i * BLOCK_SIZE);
+    }
+    free(data);
+    pthread_mutex_lock(&writeback_lock);
+    flushing_num -= n;
+    for (size_t i = 0; i < n; i++) {
+        struct cached_block *cb = batch[i];
+        list_remove(&flushing_list, cb);
+        cb->flushing = false;
+        if (cb->redirtied && !cb->dropped) {
+            cb->redirtied = false;
+            list_append(&age_list, cb);
+        } else {
+            free_block_locked(cb);
+        }
+    }
+    counters.written += n;
+    pthread_cond_broadcast(&clean_cond);
+    NAIVE_PROBE1(writeback_flush, n);
+    return n;
+}
+
+/*
+    the flusher writes back expired slots, and the oldest ones while over half of the limit
+*/
+static void *flusher_thread(void *arg)
+{
+    pthread_mutex_lock(&writeback_lock);
+    while (flusher_running) {
+        uint64_t now = stats_now_ns();
+        if (age_list.head != NULL && dirty_num - flushing_num > dirty_limit / 2) {
+            flush_oldest_locked(UINT64_MAX);
+            continue;
+        }
+        if (age_list.head != NULL && age_list.head->dirtied_ns + expire_ns <= now) {
+            counters.expired += flush_oldest_locked(now - expire_ns);
+            continue;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += WRITEBACK_WAKE_MS * 1000000;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&flusher_cond, &writeback_lock, &ts);
+    }
+    pthread_mutex_unlock(&writeback_lock);
+    return NULL;
+}
+
+void start_writeback(size_t limit, unsigned int expire_ms)
+{
+    dirty_limit = limit / BLOCK_SIZE > WRITEBACK_BATCH ? limit / BLOCK_SIZE : WRITEBACK_BATCH;
+    expire_ns = (uint64_t) expire_ms * 1000000;
+    size_t bucket_num = 1;
+    while (bucket_num < dirty_limit) {
+        bucket_num *= 2;
+    }
+    buckets = calloc(bucket_num, sizeof(struct cached_block *));
+    if (buckets == NULL) {
+        perror("start_writeback() calloc");
+        exit(1);
+    }
+    bucket_mask = bucket_num - 1;
+    writeback_enabled = true;
+    flusher_running = true;
+    if (pthread_create(&flusher_tid, NULL, flusher_thread, NULL) != 0) {
+        perror("start_writeback() pthread_create");
+        exit(1);
+    }
+}
+
+void stop_writeback(void)
+{
+    if (!writeback_enabled) {
+        return ;
+    }
+    pthread_mutex_lock(&writeback_lock);
+    flusher_running = false;
+    pthread_cond_signal(&flusher_cond);
+    pthread_mutex_unlock(&writeback_lock);
+    pthread_join(flusher_tid, NULL);
+    writeback_all();
+    writeback_enabled = false;
+}
+
+bool writeback_read(block_size_t slot, uint8_t *buf)
+{
+    if (!writeback_enabled) {
+        return false;
+    }
+    pthread_mutex_lock(&writeback_lock);
+    struct cached_block *cb = find_block_locked(slot);
+    bool hit = cb != NULL && !cb->dropped;
+    if (hit) {
+        memcpy(buf, cb->data, BLOCK_SIZE);
+        counters.read_hits++;
+    }
+    pthread_mutex_unlock(&writeback_lock);
+    return hit;
+}
+
+bool writeback_write(block_size_t slot, const uint8_t *buf)
+{
+    if (!writeback_enabled) {
+        return false;
+    }
+    pthread_mutex_lock(&writeback_lock);
+    struct cached_block *cb = find_block_locked(slot);
+    if (cb == NULL) {
+        cb = malloc(sizeof(struct cached_block) + BLOCK_SIZE);
+        if (cb == NULL) {
+            perror("writeback_write() malloc");
+            exit(1);
+        }
+        cb->slot = slot;
+        cb->flushing = cb->redirtied = cb->dropped = false;
+        cb->dirtied_ns = stats_now_ns();
+        cb->hash_next = *bucket_of(slot);
+        *bucket_of(slot) = cb;
+        list_append(&age_list, cb);
+        if (++dirty_num > dirty_limit / 2) {
+            pthread_cond_signal(&flusher_cond);
+        }
+        counters.cached++;
+    } else {
+        if (cb->flushing && (!cb->redirtied || cb->dropped)) {
+            // the write in flight has the old data, this goes back to the age list once it is done
+            cb->redirtied = true;
+            cb->dropped = false;
+            cb->dirtied_ns = stats_now_ns();
+        }
+        counters.rewritten++;
+    }
+    memcpy(cb->data, buf, BLOCK_SIZE);
+    pthread_mutex_unlock(&writeback_lock);
+    return true;
+}
+
+void writeback_throttle(void)
+{
+    if (!writeback_enabled) {
+        return ;
+    }
+    pthread_mutex_lock(&writeback_lock);
+    if (dirty_num >= dirty_limit) {
+        uint64_t start = stats_now_ns();
+        counters.throttled++;
+        // the writer helps the flusher, it only waits when every dirty slot is in flight
+        while (dirty_num >= dirty_limit) {
+            if (flush_oldest_locked(UINT64_MAX) == 0) {
+                pthread_cond_wait(&clean_cond, &writeback_lock);
+            }
+        }
+        counters.throttled_ns += stats_now_ns() - start;
+    }
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+void writeback_drop(block_size_t slot)
+{
+    if (!writeback_enabled) {
+        return ;
+    }
+    pthread_mutex_lock(&writeback_lock);
+    struct cached_block *cb = find_block_locked(slot);
+    if (cb != NULL && !cb->dropped) {
+        counters.dropped++;
+        if (cb->flushing) {
+            cb->dropped = true;// freed once its write is done
+        } else {
+            list_remove(&age_list, cb);
+            free_block_locked(cb);
+        }
+    }
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+/*
+    check if a write carrying data dirtied no later than `before` is in flight
+    caller should hold writeback_lock
+*/
+static bool flushing_before_locked(uint64_t before)
+{
+    for (struct cached_block *cb = flushing_list.head; cb != NULL; cb = cb->next) {
+        if (cb->flushing_ns <= before) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void writeback_all(void)
+{
+    if (!writeback_enabled) {
+        return ;
+    }
+    pthread_mutex_lock(&writeback_lock);
+    uint64_t start = stats_now_ns();
+    while (flush_oldest_locked(start) > 0) {
+        ;
+    }
+    // the age list is in dirtied order, what is left was dirtied later
+    while (flushing_before_locked(start)) {
+        pthread_cond_wait(&clean_cond, &writeback_lock);
+    }
+    pthread_mutex_unlock(&writeback_lock);
+}
+
+char *render_writeback_stats(size_t *len)
+{
+    char *buf = NULL;
+    FILE *out = open_memstream(&buf, len);
+    if (out == NULL) {
+        perror("render_writeback_stats() open_memstream");
+        exit(1);
+    }
+    pthread_mutex_lock(&writeback_lock);
+    uint64_t oldest = age_list.head != NULL ? stats_now_ns() - age_list.head->dirtied_ns : 0;
+    fprintf(out, "state %s\n", writeback_enabled ? "on" : "off");
+    fprintf(out, "dirty_blocks %zu\n", dirty_num);
+    fprintf(out, "flushing_blocks %zu\n", flushing_num);
+    fprintf(out, "limit_blocks %zu\n", dirty_limit);
+    fprintf(out, "expire_ms %llu\n", (unsigned long long) (expire_ns / 1000000));
+    fprintf(out, "oldest_dirty_ms %llu\n", (unsigned long long) (oldest / 1000000));
+    fprintf(out, "cached %llu\n", counters.cached);
+    fprintf(out, "rewritten %llu\n", counters.rewritten);
+    fprintf(out, "read_hits %llu\n", counters.read_hits);
+    fprintf(out, "written %llu\n", counters.written);
+    fprintf(out, "expired %llu\n", counters.expired);
+    fprintf(out, "dropped %llu\n", counters.dropped);
+    fprintf(out, "throttled %llu\n", counters.throttled);
+    fprintf(out, "throttled_ms %llu\n", counters.throttled_ns / 1000000);
+    pthread_mutex_unlock(&writeback_lock);
+    fclose(out);
+    return buf;
+}